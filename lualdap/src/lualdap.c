@@ -4,19 +4,41 @@
 ** $Id: lualdap.c,v 1.48 2007-12-14 15:11:22 carregal Exp $
 */
 
+#ifndef WIN32
+#define _XOPEN_SOURCE 600 /* gettimeofday */
+#endif
+
+#include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #ifdef WIN32
 #include <Winsock2.h>
+#include <windows.h>
 #else
 #include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* The shared multiplexer needs POSIX threads */
+#if !defined (WIN32) && !defined (WINLDAP) && !defined (LUALDAP_NO_MUX)
+#define LUALDAP_MUX
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #endif
 
 #ifdef WINLDAP
 #include "open2winldap.h"
 #else
 #include "ldap.h"
+#include "ldap_schema.h"
 #endif
 
 #include "lua.h"
@@ -38,6 +60,11 @@ typedef const char * ldap_pchar_t;
 #define LUALDAP_TABLENAME "lualdap"
 #define LUALDAP_CONNECTION_METATABLE "LuaLDAP connection"
 #define LUALDAP_SEARCH_METATABLE "LuaLDAP search"
+#define LUALDAP_REPLICAS_METATABLE "LuaLDAP replica set"
+#define LUALDAP_AUTH_METATABLE "LuaLDAP authenticator"
+#define LUALDAP_SNAPSHOT_METATABLE "LuaLDAP snapshot"
+#define LUALDAP_MUX_METATABLE "LuaLDAP multiplexer"
+#define LUALDAP_TICKET_METATABLE "LuaLDAP multiplexer request"
 
 #define LUALDAP_MOD_ADD (LDAP_MOD_ADD | LDAP_MOD_BVALUES)
 #define LUALDAP_MOD_DEL (LDAP_MOD_DELETE | LDAP_MOD_BVALUES)
@@ -54,16 +81,113 @@ typedef const char * ldap_pchar_t;
 #define LUALDAP_ARRAY_VALUES_SIZE (2 * LUALDAP_MAX_ATTRS)
 #endif
 
+/* Maximum number of values compared one by one when diffing attributes */
+#ifndef LUALDAP_SMALL_SET
+#define LUALDAP_SMALL_SET 8
+#endif
+
 /* Maximum number of values structures */
 #ifndef LUALDAP_MAX_VALUES
 #define LUALDAP_MAX_VALUES (LUALDAP_ARRAY_VALUES_SIZE / 2)
 #endif
 
+/* Maximum number of replicas in a replica set */
+#ifndef LUALDAP_MAX_REPLICAS
+#define LUALDAP_MAX_REPLICAS 16
+#endif
+
+/* Weight of a new sample on the moving average of operations' latency */
+#ifndef LUALDAP_LATENCY_WEIGHT
+#define LUALDAP_LATENCY_WEIGHT 0.2
+#endif
+
+/* Default number of seconds an ejected replica stays out of rotation */
+#ifndef LUALDAP_REPLICA_RETRY
+#define LUALDAP_REPLICA_RETRY 30
+#endif
+
+/* Maximum and default number of connections of an authenticator */
+#ifndef LUALDAP_MAX_BINDERS
+#define LUALDAP_MAX_BINDERS 32
+#endif
+
+#ifndef LUALDAP_BINDERS
+#define LUALDAP_BINDERS 4
+#endif
+
+/* Maximum number of attributes dereferenced by a search */
+#ifndef LUALDAP_MAX_DEREF
+#define LUALDAP_MAX_DEREF 8
+#endif
+
+/* Maximum number of indexed attributes of a snapshot */
+#ifndef LUALDAP_MAX_INDEXES
+#define LUALDAP_MAX_INDEXES 8
+#endif
+
+/* Maximum and default number of connections of a shared multiplexer */
+#ifndef LUALDAP_MAX_MUX_CONNECTIONS
+#define LUALDAP_MAX_MUX_CONNECTIONS 16
+#endif
+
+#ifndef LUALDAP_MUX_CONNECTIONS
+#define LUALDAP_MUX_CONNECTIONS 2
+#endif
+
+/* Default time (in seconds) given to the requests of a multiplexer */
+#ifndef LUALDAP_MUX_TIMEOUT
+#define LUALDAP_MUX_TIMEOUT 60
+#endif
+
+/* Maximum length of an attribute name looked up on the schema */
+#ifndef LUALDAP_MAX_NAME
+#define LUALDAP_MAX_NAME 128
+#endif
+
+/* Number of pipelined requests when retrieving an attribute by ranges */
+#ifndef LUALDAP_RANGE_WINDOW
+#define LUALDAP_RANGE_WINDOW 8
+#endif
+
+/* Maximum depth of attribute type inheritance followed to find a syntax */
+#define LUALDAP_MAX_SUP 16
+
+/* Types of values decoded according to the attribute's syntax */
+#define LUALDAP_TYPE_STRING  1
+#define LUALDAP_TYPE_INTEGER 2
+#define LUALDAP_TYPE_BOOLEAN 3
+#define LUALDAP_TYPE_TIME    4
+#define LUALDAP_TYPE_MASK    7
+#define LUALDAP_TYPE_SINGLE  8 /* single-valued attribute */
+
+/* Largest magnitude of the integers exactly represented by a number (2^53) */
+#define LUALDAP_MAX_EXACT_INTEGER 9007199254740992.0
+
+/* Result code of operations given up by the client */
+#ifndef LDAP_USER_CANCELLED
+#define LDAP_USER_CANCELLED (-8)
+#endif
+
+/* Result codes which indicate that the server is not available */
+#define LUALDAP_NODE_FAILURE(rc) ((rc) == LDAP_SERVER_DOWN || \
+	(rc) == LDAP_CONNECT_ERROR || (rc) == LDAP_TIMEOUT || \
+	(rc) == LDAP_UNAVAILABLE || (rc) == LDAP_BUSY)
+
 
 /* LDAP connection information */
 typedef struct {
 	int        version; /* LDAP version */
 	LDAP      *ld;      /* LDAP connection */
+	double     latency; /* moving average of operations' latency (seconds) */
+	int        failures;/* number of operations failed by server unavailability */
+	int        schema;  /* reference to cached schema table */
+	int        types;   /* reference to table of attributes' value types */
+	int        trace;   /* reference to trace callback (LUA_NOREF if disabled) */
+	double     threshold; /* minimum elapsed time of traced operations (ms) */
+	int        referrals; /* reference to table of connections to referred servers */
+	int        tls;     /* connection is protected by TLS (StartTLS or ldaps) */
+	int        chasing; /* searches which chase referrals themselves */
+	int        auto_referrals; /* LDAP_OPT_REFERRALS before these searches */
 } conn_data;
 
 
@@ -71,18 +195,108 @@ typedef struct {
 typedef struct {
 	int      conn;        /* conn_data reference */
 	int      msgid;
+	double   start;       /* time the request was sent (0 after first reply) */
+	int      typed;       /* decode values according to the schema */
+	int      normalize;   /* return normalized DNs */
+	int      deref;       /* attach dereferenced entries */
+	int      params;      /* reference to parameters (paged or traced searches) */
+	int      paged;       /* request the result in pages */
+	int      chase;       /* reference to chase_referrals option (LUA_NOREF if disabled) */
+	int      chased;      /* reference to table of continuation searches */
+	int      done;        /* result received; continuation searches pending */
+	double   begin;       /* time the first request was sent */
+	double   ended;       /* time the result was received (0 before) */
+	int      reported;    /* already reported to the trace callback */
+	long     count;       /* number of entries returned */
+	double   total;       /* size of the entries received */
+	LDAPMessage *res;     /* chain of messages received */
+	LDAPMessage *cur;     /* next message of the chain to be consumed */
+	long     entries;     /* number of entries received and not consumed */
+	long     max_entries; /* limit of buffered entries (0 if unlimited) */
+	long     max_bytes;   /* limit of buffered bytes (0 if unlimited) */
+	long     largest;     /* size of the largest entry received */
+	BerValue cookie;      /* paged results cookie */
+	struct timeval timeout; /* time limit of the search (0 if none) */
 } search_data;
 
 
+/* Replica of a replica set */
+typedef struct {
+	int        conn;     /* conn_data reference */
+	int        failures; /* connection failures already accounted */
+	double     ejected;  /* time to try to reinstate the node (0 if in rotation) */
+} node_data;
+
+
+/* Replica set information */
+typedef struct {
+	int        spec;     /* reference to table with hosts and credentials */
+	int        n;        /* number of nodes (node 0 is the provider) */
+	double     retry;    /* seconds an ejected node stays out of rotation */
+	int        turn;     /* counter to break ties between replicas */
+	node_data  nodes[LUALDAP_MAX_REPLICAS + 1];
+} replicas_data;
+
+
+/* Connection of an authenticator */
+typedef struct {
+	conn_data  conn;
+	int        msgid;    /* outstanding bind (-1 if idle) */
+	long       ticket;   /* ticket of the outstanding bind */
+} binder_data;
+
+
+/* Bind sent by an authenticator, kept by the function which returns its
+   result */
+typedef struct {
+	long        ticket;
+	int         state;     /* 0: pending; 1: collected; 2: returned */
+	int         valid;     /* credentials are valid (when collected) */
+	const char *err;       /* error message (NULL if none) */
+} auth_ticket;
+
+
+/* Authenticator information */
+typedef struct {
+	int          spec;     /* reference to table with uri and usetls */
+	int          results;  /* reference to table of pending tickets by number,
+	                          with weak values so tickets whose results are
+	                          never asked for are not kept */
+	int          n;        /* number of connections */
+	int          next;     /* next connection to be tried */
+	long         tickets;  /* number of binds sent */
+	binder_data  binders[LUALDAP_MAX_BINDERS];
+} auth_data;
+
+
+/* Snapshot file mapped in memory */
+typedef struct {
+	unsigned char *data;    /* contents of the file (NULL if closed) */
+	size_t         size;
+	unsigned long  count;   /* number of entries */
+	unsigned long  dir;     /* offset of the directory of entries */
+	unsigned long  nindex;  /* number of indexes */
+	unsigned long  indexes; /* offset of the descriptions of the indexes */
+} snapshot_data;
+
+
 /* LDAP attribute modification structure */
 typedef struct {
-	LDAPMod   *attrs[LUALDAP_MAX_ATTRS + 1];
-	LDAPMod    mods[LUALDAP_MAX_ATTRS];
+	LDAPMod  **attrs;
+	LDAPMod   *mods;
 	int        ai;
-	BerValue  *values[LUALDAP_ARRAY_VALUES_SIZE];
+	int        maxattrs;
+	BerValue **values;
 	int        vi;
-	BerValue   bvals[LUALDAP_MAX_VALUES];
+	int        maxvalues;
+	BerValue  *bvals;
 	int        bi;
+	int        maxbvals;
+	/* buffers used unless larger ones are reserved (see A_reserve) */
+	LDAPMod   *attrs_buf[LUALDAP_MAX_ATTRS + 1];
+	LDAPMod    mods_buf[LUALDAP_MAX_ATTRS];
+	BerValue  *values_buf[LUALDAP_ARRAY_VALUES_SIZE];
+	BerValue   bvals_buf[LUALDAP_MAX_VALUES];
 } attrs_data;
 
 
@@ -99,6 +313,122 @@ static int faildirect (lua_State *L, const char *errmsg) {
 }
 
 
+/*
+** Current time in seconds.
+*/
+static double lualdap_now (void) {
+#ifdef WIN32
+	return GetTickCount () / 1000.0;
+#else
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+
+/* Error of a result not received within the time given to wait for it */
+static const char result_timeout[] = LUALDAP_PREFIX"result timeout expired";
+
+
+/*
+** Fill in the struct timeval with the time to wait for a result, given as
+** an optional argument of the functions which return results.
+** @return NULL (to block) if the argument is not a number.
+*/
+static struct timeval *get_wait_arg (lua_State *L, int arg, struct timeval *st) {
+	double t;
+	if (lua_type (L, arg) != LUA_TNUMBER)
+		return NULL;
+	t = lua_tonumber (L, arg);
+	if (t < 0)
+		t = 0;
+	st->tv_sec = (long)t;
+	st->tv_usec = (long)(1000000 * (t - st->tv_sec));
+	return st;
+}
+
+
+/*
+** Account the outcome of an operation on the connection statistics.
+** @param start Time the request was sent (0 to not sample latency).
+** @param rc LDAP result code of the operation.
+*/
+static void conn_account (conn_data *conn, double start, int rc) {
+	if (LUALDAP_NODE_FAILURE (rc))
+		conn->failures++;
+	else if (start > 0) {
+		double sample = lualdap_now () - start;
+		if (conn->latency == 0)
+			conn->latency = sample;
+		else
+			conn->latency = LUALDAP_LATENCY_WEIGHT * sample +
+				(1 - LUALDAP_LATENCY_WEIGHT) * conn->latency;
+	}
+}
+
+
+/*
+** Get a result of an operation as ldap_result does, telling when it
+** arrived.  Replies already received are collected by a poll which does
+** not wait, so the time they are handed over is taken as their arrival
+** and not the time the caller spends consuming them afterwards.
+** @param arrived Set to the arrival time of the reply (0 if none).
+*/
+static int conn_result (conn_data *conn, int msgid, int all, struct timeval *timeout, LDAPMessage **res, double *arrived) {
+	struct timeval zero;
+	int rc;
+
+	zero.tv_sec = 0;
+	zero.tv_usec = 0;
+	rc = ldap_result (conn->ld, msgid, all, &zero, res);
+	if (rc == 0 && (timeout == NULL || timeout->tv_sec != 0 || timeout->tv_usec != 0))
+		rc = ldap_result (conn->ld, msgid, all, timeout, res);
+	*arrived = (rc > 0) ? lualdap_now () : 0;
+	return rc;
+}
+
+
+/*
+** Initialize a connection structure and bind to the server.
+** @return NULL in case of success or an error message.
+*/
+static const char *conn_open (conn_data *conn, ldap_pchar_t host, ldap_pchar_t who, const char *password, int use_tls) {
+	int err;
+
+	conn->version = 0;
+	conn->latency = 0;
+	conn->failures = 0;
+	conn->tls = use_tls || strncmp (host, "ldaps://", 8) == 0;
+	conn->chasing = 0;
+#ifndef WINLDAP
+	if (strstr (host, "://") != NULL) { /* LDAP URI */
+		if (ldap_initialize (&conn->ld, host) != LDAP_SUCCESS)
+			conn->ld = NULL;
+	} else
+#endif
+	conn->ld = ldap_init (host, LDAP_PORT);
+	if (conn->ld == NULL)
+		return LUALDAP_PREFIX"Error connecting to server";
+	/* Set protocol version */
+	conn->version = LDAP_VERSION3;
+	if (ldap_set_option (conn->ld, LDAP_OPT_PROTOCOL_VERSION, &conn->version)
+		!= LDAP_OPT_SUCCESS)
+		return LUALDAP_PREFIX"Error setting LDAP version";
+	/* Use TLS */
+	if (use_tls) {
+		int rc = ldap_start_tls_s (conn->ld, NULL, NULL);
+		if (rc != LDAP_SUCCESS)
+			return ldap_err2string (rc);
+	}
+	/* Bind to a server */
+	err = ldap_bind_s (conn->ld, who, password, LDAP_AUTH_SIMPLE);
+	if (err != LDAP_SUCCESS)
+		return ldap_err2string (err);
+	return NULL;
+}
+
+
 /*
 ** Get a connection object from the first stack position.
 */
@@ -222,6 +552,13 @@ static void value_error (lua_State *L, const char *name) {
 ** Initialize attributes structure.
 */
 static void A_init (attrs_data *attrs) {
+	attrs->attrs = attrs->attrs_buf;
+	attrs->mods = attrs->mods_buf;
+	attrs->maxattrs = LUALDAP_MAX_ATTRS;
+	attrs->values = attrs->values_buf;
+	attrs->maxvalues = LUALDAP_ARRAY_VALUES_SIZE;
+	attrs->bvals = attrs->bvals_buf;
+	attrs->maxbvals = LUALDAP_MAX_VALUES;
 	attrs->ai = 0;
 	attrs->attrs[0] = NULL;
 	attrs->vi = 0;
@@ -230,13 +567,47 @@ static void A_init (attrs_data *attrs) {
 }
 
 
+/*
+** Make room for the given numbers of modifications (including the
+** terminator) and values on an empty attributes structure, beyond its
+** fixed capacity if needed.  Larger
+** buffers are allocated in a userdata left on top of the stack, which
+** must stay there while the structure is used; otherwise nil is pushed.
+*/
+static void A_reserve (lua_State *L, attrs_data *a, int nattrs, int nvalues) {
+	char *buf;
+	if (nattrs <= LUALDAP_MAX_ATTRS && nvalues <= LUALDAP_MAX_VALUES
+		&& nvalues + nattrs <= LUALDAP_ARRAY_VALUES_SIZE) {
+		lua_pushnil (L);
+		return;
+	}
+	/* each array is a multiple of the size of a pointer */
+	buf = (char *)lua_newuserdata (L, nattrs * sizeof (LDAPMod)
+		+ nvalues * sizeof (BerValue)
+		+ (nattrs + 1) * sizeof (LDAPMod *)
+		+ (nvalues + nattrs) * sizeof (BerValue *)); /* values and NULLs */
+	a->mods = (LDAPMod *)buf;
+	buf += nattrs * sizeof (LDAPMod);
+	a->bvals = (BerValue *)buf;
+	buf += nvalues * sizeof (BerValue);
+	a->attrs = (LDAPMod **)buf;
+	buf += (nattrs + 1) * sizeof (LDAPMod *);
+	a->values = (BerValue **)buf;
+	a->maxattrs = nattrs;
+	a->maxbvals = nvalues;
+	a->maxvalues = nvalues + nattrs;
+	a->attrs[0] = NULL;
+	a->values[0] = NULL;
+}
+
+
 /*
 ** Store the string on top of the stack on the attributes structure.
 ** Increment the bvals counter.
 */
 static BerValue *A_setbval (lua_State *L, attrs_data *a, const char *n) {
 	BerValue *ret = &(a->bvals[a->bi]);
-	if (a->bi >= LUALDAP_MAX_VALUES) {
+	if (a->bi >= a->maxbvals) {
 		luaL_error (L, LUALDAP_PREFIX"too many values");
 		return NULL;
 	} else if (!lua_isstring (L, -1)) {
@@ -255,7 +626,7 @@ static BerValue *A_setbval (lua_State *L, attrs_data *a, const char *n) {
 */
 static BerValue **A_setval (lua_State *L, attrs_data *a, const char *n) {
 	BerValue **ret = &(a->values[a->vi]);
-	if (a->vi >= LUALDAP_ARRAY_VALUES_SIZE) {
+	if (a->vi >= a->maxvalues) {
 		luaL_error (L, LUALDAP_PREFIX"too many values");
 		return NULL;
 	}
@@ -270,7 +641,7 @@ static BerValue **A_setval (lua_State *L, attrs_data *a, const char *n) {
 */
 static BerValue **A_nullval (lua_State *L, attrs_data *a) {
 	BerValue **ret = &(a->values[a->vi]);
-	if (a->vi >= LUALDAP_ARRAY_VALUES_SIZE) {
+	if (a->vi >= a->maxvalues) {
 		luaL_error (L, LUALDAP_PREFIX"too many values");
 		return NULL;
 	}
@@ -315,7 +686,7 @@ static BerValue **A_tab2val (lua_State *L, attrs_data *a, const char *name) {
 ** Set a modification value (which MUST be on top of the stack).
 */
 static void A_setmod (lua_State *L, attrs_data *a, int op, const char *name) {
-	if (a->ai >= LUALDAP_MAX_ATTRS) {
+	if (a->ai >= a->maxattrs) {
 		luaL_error (L, LUALDAP_PREFIX"too many attributes");
 		return;
 	}
@@ -347,7 +718,7 @@ static void A_tab2mod (lua_State *L, attrs_data *a, int tab, int op) {
 ** Terminate the array of attributes.
 */
 static void A_lastattr (lua_State *L, attrs_data *a) {
-	if (a->ai >= LUALDAP_MAX_ATTRS) {
+	if (a->ai >= a->maxattrs) {
 		luaL_error (L, LUALDAP_PREFIX"too many attributes");
 		return;
 	}
@@ -386,39 +757,216 @@ static int table2strarray (lua_State *L, int tab, char *array[], int limit) {
 }
 
 
+/* Operation reported to the trace callback */
+typedef struct {
+	const char *op;
+	int         dn;      /* stack index of the DN (0 if none) */
+	int         params;  /* stack index of the search parameters (0 if none) */
+	int         msgid;
+	int         rc;      /* LDAP result code */
+	long        entries; /* number of entries (-1 if not a search) */
+	double      bytes;   /* size of the entries (-1 if not a search) */
+	double      start;   /* time the request was sent */
+	double      end;     /* time the result was received (0 if now) */
+} trace_info;
+
+
+/*
+** Name of the operation of a result code.
+*/
+static const char *code2op (int code) {
+	switch (code) {
+		case LDAP_RES_ADD:
+			return "add";
+		case LDAP_RES_COMPARE:
+			return "compare";
+		case LDAP_RES_DELETE:
+			return "delete";
+		case LDAP_RES_MODIFY:
+			return "modify";
+		case LDAP_RES_MODDN:
+			return "rename";
+		default:
+			return "search";
+	}
+}
+
+
+/*
+** Copy a field of the table at the given index to the table on top of
+** the stack.
+*/
+static void copy_field (lua_State *L, int from, const char *name) {
+	lua_pushstring (L, name);
+	lua_pushvalue (L, -1);
+	lua_gettable (L, from);
+	lua_rawset (L, -3);
+}
+
+
+/*
+** Store a number at the field of the table on top of the stack.
+*/
+static void set_number (lua_State *L, const char *name, double value) {
+	lua_pushstring (L, name);
+	lua_pushnumber (L, value);
+	lua_rawset (L, -3);
+}
+
+
+/*
+** Call the trace callback of the connection with the description of an
+** operation, if it took at least the threshold.
+** Errors raised by the callback are ignored.
+*/
+static void trace_call (lua_State *L, conn_data *conn, trace_info *t) {
+	double elapsed = 1000 * (((t->end > 0) ? t->end : lualdap_now ()) - t->start);
+	int top = lua_gettop (L);
+	if (conn->trace == LUA_NOREF || elapsed < conn->threshold)
+		return;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->trace);
+	lua_newtable (L);
+	lua_pushliteral (L, "op");
+	lua_pushstring (L, t->op);
+	lua_rawset (L, -3);
+	if (t->params) {
+		copy_field (L, t->params, "base");
+		copy_field (L, t->params, "filter");
+		copy_field (L, t->params, "scope");
+	} else if (t->dn) {
+		lua_pushliteral (L, "dn");
+		lua_pushvalue (L, t->dn);
+		lua_rawset (L, -3);
+	}
+	set_number (L, "msgid", t->msgid);
+	set_number (L, "rc", t->rc);
+	lua_pushliteral (L, "result");
+	lua_pushstring (L, ldap_err2string (t->rc));
+	lua_rawset (L, -3);
+	if (t->entries >= 0) {
+		set_number (L, "entries", t->entries);
+		set_number (L, "bytes", t->bytes);
+	}
+	set_number (L, "start", t->start);
+	set_number (L, "elapsed_ms", elapsed);
+	lua_pcall (L, 1, 0, 0);
+	lua_settop (L, top);
+}
+
+
+/*
+** Push an integer value as a number, if a number can represent it exactly
+** (Large Integers such as the times of Active Directory cannot).
+** @return 1 if the number was pushed; 0 otherwise.
+*/
+static int push_integer (lua_State *L, BerValue *bv) {
+	char buff[64];
+	char *end;
+	double n;
+	if (bv->bv_len == 0 || bv->bv_len >= sizeof (buff))
+		return 0;
+	memcpy (buff, bv->bv_val, bv->bv_len);
+	buff[bv->bv_len] = '\0';
+	n = strtod (buff, &end);
+	if (*end != '\0' || n > LUALDAP_MAX_EXACT_INTEGER || n < -LUALDAP_MAX_EXACT_INTEGER)
+		return 0;
+	lua_pushnumber (L, n);
+	return 1;
+}
+
+
+#ifdef LDAP_CONTROL_POST_READ
+/*
+** Push the value of the attribute returned by the post-read control
+** (RFC 4527), converted to a number when it is an integer which a number
+** represents exactly.
+** @return 1 if a value was pushed; 0 if there is no such control.
+*/
+static int push_postread (lua_State *L, LDAPControl **ctrls) {
+	LDAPControl *ctrl = ldap_control_find (LDAP_CONTROL_POST_READ, ctrls, NULL);
+	BerElement *ber;
+	BerValue dn, type;
+	BerVarray vals = NULL;
+	int ok = 0;
+	if (ctrl == NULL || (ber = ber_init (&ctrl->ldctl_value)) == NULL)
+		return 0;
+	if (ber_scanf (ber, "{m{{m[W]}", &dn, &type, &vals) != LBER_ERROR
+		&& vals != NULL && vals[0].bv_val != NULL) {
+		if (!push_integer (L, &vals[0]))
+			lua_pushlstring (L, vals[0].bv_val, vals[0].bv_len);
+		ok = 1;
+	}
+	ber_bvarray_free (vals);
+	ber_free (ber, 1);
+	return ok;
+}
+#endif
+
+
 /*
 ** Get the result message of an operation.
 ** #1 upvalue == connection
 ** #2 upvalue == msgid
 ** #3 upvalue == result code of the message (ADD, DEL etc.) to be received.
+** #4 upvalue == time the request was sent.
+** #5 upvalue == DN of the operation (only when tracing).
+** #6 upvalue == true if the result carries the new value of an increment.
+** @param #1 Optional number of seconds to wait for the result.
 */
 static int result_message (lua_State *L) {
-	struct timeval *timeout = NULL; /* ??? function parameter ??? */
+	struct timeval st, *timeout = get_wait_arg (L, 1, &st);
 	LDAPMessage *res;
 	int rc;
+	double arrived;
 	conn_data *conn = (conn_data *)lua_touserdata (L, lua_upvalueindex (1));
 	int msgid = (int)lua_tonumber (L, lua_upvalueindex (2));
 	/*int res_code = (int)lua_tonumber (L, lua_upvalueindex (3));*/
+	double start = lua_tonumber (L, lua_upvalueindex (4));
 
 	luaL_argcheck (L, conn->ld, 1, LUALDAP_PREFIX"LDAP connection is closed");
-	rc = ldap_result (conn->ld, msgid, LDAP_MSG_ONE, timeout, &res);
-	if (rc == 0)
-		return faildirect (L, LUALDAP_PREFIX"result timeout expired");
+	rc = conn_result (conn, msgid, LDAP_MSG_ONE, timeout, &res, &arrived);
+	if (rc == 0) /* the result can be waited for again */
+		return faildirect (L, result_timeout);
 	else if (rc < 0) {
+		conn_account (conn, 0, LDAP_SERVER_DOWN);
 		ldap_msgfree (res);
 		return faildirect (L, LUALDAP_PREFIX"result error");
 	} else {
 		int err, ret = 1;
 		char *mdn, *msg;
-		rc = ldap_parse_result (conn->ld, res, &err, &mdn, &msg, NULL, NULL, 1);
+		LDAPControl **ctrls = NULL;
+		rc = ldap_parse_result (conn->ld, res, &err, &mdn, &msg, NULL, &ctrls, 1);
+		conn_account (conn, start, (rc != LDAP_SUCCESS) ? rc : err);
+		if (conn->trace != LUA_NOREF) {
+			trace_info t;
+			t.op = code2op ((int)lua_tonumber (L, lua_upvalueindex (3)));
+			t.dn = lua_isnil (L, lua_upvalueindex (5)) ? 0 : lua_upvalueindex (5);
+			t.params = 0;
+			t.msgid = msgid;
+			t.rc = (rc != LDAP_SUCCESS) ? rc : err;
+			t.entries = -1;
+			t.bytes = -1;
+			t.start = start;
+			t.end = arrived;
+			trace_call (L, conn, &t);
+		}
 		if (rc != LDAP_SUCCESS)
 			return faildirect (L, ldap_err2string (rc));
 		switch (err) {
 			case LDAP_SUCCESS:
 			case LDAP_COMPARE_TRUE:
+#ifdef LDAP_CONTROL_POST_READ
+				/* new value of an increment */
+				if (err == LDAP_SUCCESS && lua_toboolean (L, lua_upvalueindex (6))
+					&& push_postread (L, ctrls))
+					break;
+#endif
 				lua_pushboolean (L, 1);
 				break;
 			case LDAP_COMPARE_FALSE:
+#ifdef LDAP_ASSERTION_FAILED
+			case LDAP_ASSERTION_FAILED:
+#endif
 				lua_pushboolean (L, 0);
 				break;
 			default:
@@ -432,6 +980,8 @@ static int result_message (lua_State *L) {
 		}
 		ldap_memfree (mdn);
 		ldap_memfree (msg);
+		if (ctrls != NULL)
+			ldap_controls_free (ctrls);
 		return ret;
 	}
 }
@@ -441,12 +991,53 @@ static int result_message (lua_State *L) {
 ** Push a function to process the LDAP result.
 */
 static int create_future (lua_State *L, ldap_int_t rc, int conn, ldap_int_t msgid, int code) {
-	if (rc != LDAP_SUCCESS)
+	conn_data *cd = (conn_data *)lua_touserdata (L, conn);
+	if (rc != LDAP_SUCCESS) {
+		conn_account (cd, 0, rc);
 		return faildirect (L, ldap_err2string (rc));
+	}
 	lua_pushvalue (L, conn); /* push connection as #1 upvalue */
 	lua_pushnumber (L, msgid); /* push msgid as #2 upvalue */
 	lua_pushnumber (L, code); /* push code as #3 upvalue */
-	lua_pushcclosure (L, result_message, 3);
+	lua_pushnumber (L, lualdap_now ()); /* push request time as #4 upvalue */
+	if (cd->trace != LUA_NOREF) /* push DN (argument #2) as #5 upvalue */
+		lua_pushvalue (L, 2);
+	else
+		lua_pushnil (L);
+	lua_pushboolean (L, 0); /* push post-read flag as #6 upvalue */
+	lua_pushcclosure (L, result_message, 6);
+	return 1;
+}
+
+
+/*
+** Set the trace callback of a connection.
+** @param #1 LDAP connection.
+** @param #2 Function called with a table describing each operation, or
+**	nil to disable tracing.
+** @param #3 Optional table with the field threshold_ms: minimum elapsed
+**	time of the operations to be reported (default 0).
+** @return True.
+*/
+static int lualdap_set_trace (lua_State *L) {
+	conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUALDAP_CONNECTION_METATABLE);
+	luaL_argcheck (L, conn!=NULL, 1, LUALDAP_PREFIX"LDAP connection expected");
+	luaL_argcheck (L, lua_isnoneornil (L, 2) || lua_isfunction (L, 2), 2,
+		LUALDAP_PREFIX"function expected");
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->trace);
+	conn->trace = LUA_NOREF;
+	conn->threshold = 0;
+	if (lua_istable (L, 3)) {
+		lua_pushliteral (L, "threshold_ms");
+		lua_gettable (L, 3);
+		conn->threshold = lua_tonumber (L, -1);
+		lua_pop (L, 1);
+	}
+	if (lua_isfunction (L, 2)) {
+		lua_pushvalue (L, 2);
+		conn->trace = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	lua_pushboolean (L, 1);
 	return 1;
 }
 
@@ -459,6 +1050,26 @@ static int create_future (lua_State *L, ldap_int_t rc, int conn, ldap_int_t msgi
 static int lualdap_close (lua_State *L) {
 	conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUALDAP_CONNECTION_METATABLE);
 	luaL_argcheck(L, conn!=NULL, 1, LUALDAP_PREFIX"LDAP connection expected");
+	/* drop cached schema */
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->schema);
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->types);
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->trace);
+	conn->schema = conn->types = conn->trace = LUA_NOREF;
+	if (conn->referrals != LUA_NOREF) { /* close connections to referred servers */
+		lua_rawgeti (L, LUA_REGISTRYINDEX, conn->referrals);
+		lua_pushnil (L);
+		while (lua_next (L, -2) != 0) {
+			conn_data *ref = (conn_data *)lua_touserdata (L, -1);
+			if (ref->ld != NULL) {
+				ldap_unbind (ref->ld);
+				ref->ld = NULL;
+			}
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->referrals);
+		conn->referrals = LUA_NOREF;
+	}
 	if (conn->ld == NULL) /* already closed */
 		return 0;
 	ldap_unbind (conn->ld);
@@ -510,6 +1121,38 @@ static int lualdap_compare (lua_State *L) {
 }
 
 
+/*
+** Create an assertion control (RFC 4528): the operation is only performed
+** if the entry matches the given filter.
+** @param filter String with the filter (NULL if no assertion is made).
+** @param ctrls Array of two controls, where the control (or NULL) is
+**	stored, followed by NULL.
+** @return Result code.
+*/
+static int assertion_control (lua_State *L, LDAP *ld, const char *filter, LDAPControl **ctrls) {
+	ctrls[0] = ctrls[1] = NULL;
+	if (filter == NULL)
+		return LDAP_SUCCESS;
+#ifdef LDAP_CONTROL_ASSERT
+	(void)L;
+	return ldap_create_assertion_control (ld, (char *)filter, 1, &ctrls[0]);
+#else
+	(void)ld;
+	return luaL_error (L, LUALDAP_PREFIX"assertion control is not supported");
+#endif
+}
+
+
+/*
+** Release the controls created for an operation.
+*/
+static void controls_free (LDAPControl **ctrls) {
+	int i;
+	for (i = 0; ctrls[i] != NULL; i++)
+		ldap_control_free (ctrls[i]);
+}
+
+
 /*
 ** Delete an entry.
 ** @param #1 LDAP connection.
@@ -519,8 +1162,13 @@ static int lualdap_compare (lua_State *L) {
 static int lualdap_delete (lua_State *L) {
 	conn_data *conn = getconnection (L);
 	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	LDAPControl *ctrls[2];
 	ldap_int_t rc, msgid;
-	rc = ldap_delete_ext (conn->ld, dn, NULL, NULL, &msgid);
+	rc = assertion_control (L, conn->ld, luaL_optstring (L, 3, NULL), ctrls);
+	if (rc == LDAP_SUCCESS) {
+		rc = ldap_delete_ext (conn->ld, dn, (ctrls[0] != NULL) ? ctrls : NULL, NULL, &msgid);
+		controls_free (ctrls);
+	}
 	return create_future (L, rc, 1, msgid, LDAP_RES_DELETE);
 }
 
@@ -554,9 +1202,13 @@ static int op2code (const char *s) {
 static int lualdap_modify (lua_State *L) {
 	conn_data *conn = getconnection (L);
 	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	const char *assertion = NULL;
+	LDAPControl *ctrls[2];
 	attrs_data attrs;
 	ldap_int_t rc, msgid;
 	int param = 3;
+	if (lua_type (L, 3) == LUA_TSTRING) /* assertion */
+		assertion = lua_tostring (L, param++);
 	A_init (&attrs);
 	while (lua_istable (L, param)) {
 		int op;
@@ -570,283 +1222,4991 @@ static int lualdap_modify (lua_State *L) {
 		param++;
 	}
 	A_lastattr (L, &attrs);
-	rc = ldap_modify_ext (conn->ld, dn, attrs.attrs, NULL, NULL, &msgid);
+	rc = assertion_control (L, conn->ld, assertion, ctrls);
+	if (rc == LDAP_SUCCESS) {
+		rc = ldap_modify_ext (conn->ld, dn, attrs.attrs, (ctrls[0] != NULL) ? ctrls : NULL, NULL, &msgid);
+		controls_free (ctrls);
+	}
 	return create_future (L, rc, 1, msgid, LDAP_RES_MODIFY);
 }
 
 
+#ifndef WINLDAP
 /*
-** Change the distinguished name of an entry.
+** Create a post-read control (RFC 4527) requesting the given attribute.
+** @return Result code.
 */
-static int lualdap_rename (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
-	ldap_pchar_t rdn = (ldap_pchar_t) luaL_checkstring (L, 3);
-	ldap_pchar_t par = (ldap_pchar_t) luaL_optlstring (L, 4, NULL, NULL);
-	const int del = luaL_optnumber (L, 5, 0);
-	ldap_int_t msgid;
-	ldap_int_t rc = ldap_rename (conn->ld, dn, rdn, par, del, NULL, NULL, &msgid);
-	return create_future (L, rc, 1, msgid, LDAP_RES_MODDN);
+static int postread_control (char *attr, LDAPControl **ctrl) {
+	char *attrs[2];
+	BerElement *ber = ber_alloc_t (LBER_USE_DER);
+	BerValue bv;
+	int rc;
+	if (ber == NULL)
+		return LDAP_NO_MEMORY;
+	attrs[0] = attr;
+	attrs[1] = NULL;
+	if (ber_printf (ber, "{v}", attrs) == -1 || ber_flatten2 (ber, &bv, 0) == -1)
+		rc = LDAP_ENCODING_ERROR;
+	else
+		rc = ldap_control_create (LDAP_CONTROL_POST_READ, 1, &bv, 1, ctrl);
+	ber_free (ber, 1);
+	return rc;
 }
 
 
 /*
-** Push an attribute value (or a table of values) on top of the stack.
-** @param L lua_State.
-** @param ld LDAP Connection.
-** @param entry Current entry.
-** @param attr Name of entry's attribute to get values from.
-** @return 1 in case of success.
+** Increment an integer attribute (RFC 4525), atomically.
+** @param #1 LDAP connection.
+** @param #2 String with entry's DN.
+** @param #3 String with the attribute name.
+** @param #4 Integer to be added to the value (default is 1).
+** @param #5 String with an assertion filter (optional).
+** @return Function to process the LDAP result, which returns the new value.
 */
-static int push_values (lua_State *L, LDAP *ld, LDAPMessage *entry, char *attr) {
-	int i, n;
-	BerValue **vals = ldap_get_values_len (ld, entry, attr);
-	n = ldap_count_values_len (vals);
-	if (n == 0) /* no values */
-		lua_pushboolean (L, 1);
-	else if (n == 1) /* just one value */
-		lua_pushlstring (L, vals[0]->bv_val, vals[0]->bv_len);
-	else { /* Multiple values */
-		lua_newtable (L);
-		for (i = 0; i < n; i++) {
-			lua_pushlstring (L, vals[i]->bv_val, vals[i]->bv_len);
-			lua_rawseti (L, -2, i+1);
-		}
+static int lualdap_increment (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	char *attr = (char *)luaL_checkstring (L, 3);
+	lua_Number delta = luaL_optnumber (L, 4, 1);
+	LDAPControl *ctrls[3];
+	LDAPMod mod, *mods[2];
+	BerValue bv, *vals[2];
+	char value[32];
+	ldap_int_t rc, msgid;
+
+	luaL_argcheck (L, delta == (long)delta, 4, LUALDAP_PREFIX"integer expected");
+	sprintf (value, "%ld", (long)delta);
+	bv.bv_val = value;
+	bv.bv_len = strlen (value);
+	vals[0] = &bv;
+	vals[1] = NULL;
+	mod.mod_op = LDAP_MOD_INCREMENT | LDAP_MOD_BVALUES;
+	mod.mod_type = attr;
+	mod.mod_bvalues = vals;
+	mods[0] = &mod;
+	mods[1] = NULL;
+	rc = assertion_control (L, conn->ld, luaL_optstring (L, 5, NULL), ctrls);
+	if (rc == LDAP_SUCCESS) {
+		/* the new value is returned with the result */
+		int n = (ctrls[0] != NULL) ? 1 : 0;
+		rc = postread_control (attr, &ctrls[n]);
+		ctrls[n + 1] = NULL;
+		if (rc == LDAP_SUCCESS)
+			rc = ldap_modify_ext (conn->ld, dn, mods, ctrls, NULL, &msgid);
+		controls_free (ctrls);
 	}
-	ldap_value_free_len (vals);
+	if (create_future (L, rc, 1, msgid, LDAP_RES_MODIFY) != 1)
+		return 2;
+	lua_pushboolean (L, 1);
+	lua_setupvalue (L, -2, 6);
 	return 1;
 }
+#endif
 
 
 /*
-** Store entry's attributes and values at the given table.
-** @param entry Current entry.
-** @param tab Absolute stack index of the table.
+** Push a copy of the string in lower case.
 */
-static void set_attribs (lua_State *L, LDAP *ld, LDAPMessage *entry, int tab) {
-	char *attr;
-	BerElement *ber = NULL;
-	for (attr = ldap_first_attribute (ld, entry, &ber);
-		attr != NULL;
-		attr = ldap_next_attribute (ld, entry, ber))
-	{
-		lua_pushstring (L, attr);
-		push_values (L, ld, entry, attr);
-		lua_rawset (L, tab); /* tab[attr] = vals */
-		ldap_memfree (attr);
+static void push_lower (lua_State *L, const char *s) {
+	luaL_Buffer b;
+	luaL_buffinit (L, &b);
+	for (; *s != '\0'; s++) {
+		char c = tolower ((unsigned char)*s);
+		luaL_addlstring (&b, &c, 1);
 	}
-	ber_free (ber, 0); /* don't need to test if (ber == NULL) */
+	luaL_pushresult (&b);
 }
 
 
 /*
-** Get the distinguished name of the given entry and pushes it on the stack.
+** Start a modification whose values are stored next with A_setval and
+** terminated with A_nullval (unless it has no values).
 */
-static void push_dn (lua_State *L, LDAP *ld, LDAPMessage *entry) {
-	char *dn = ldap_get_dn (ld, entry);
-	lua_pushstring (L, dn);
-	ldap_memfree (dn);
+static void A_newmod (lua_State *L, attrs_data *a, int op, const char *name, int novalues) {
+	if (a->ai >= a->maxattrs) {
+		luaL_error (L, LUALDAP_PREFIX"too many attributes");
+		return;
+	}
+	a->mods[a->ai].mod_op = op;
+	a->mods[a->ai].mod_type = (char *)name;
+	a->mods[a->ai].mod_bvalues = novalues ? NULL : &a->values[a->vi];
+	a->attrs[a->ai] = &a->mods[a->ai];
+	a->ai++;
 }
 
 
 /*
-** Release connection reference.
+** Number of values of an attribute (a Boolean, as returned by typed
+** searches, is one value).
 */
-static void search_close (lua_State *L, search_data *search) {
-	luaL_unref (L, LUA_REGISTRYINDEX, search->conn);
-	search->conn = LUA_NOREF;
+static int value_count (lua_State *L, int v) {
+	if (lua_istable (L, v))
+		return luaL_getn (L, v);
+	else if (lua_isstring (L, v) || lua_isboolean (L, v))
+		return 1;
+	else
+		return 0;
 }
 
 
 /*
-** Retrieve next message...
-** @return #1 entry's distinguished name.
-** @return #2 table with entry's attributes and values.
+** Get the type of the values of an attribute.
+** @param types Absolute stack index of the table of types (0 if none).
+** @return The type of the attribute or 0 if it is unknown.
 */
-static int next_message (lua_State *L) {
+static int attr_type (lua_State *L, int types, const char *attr) {
+	char name[LUALDAP_MAX_NAME];
+	int i, type;
+	if (types == 0)
+		return 0;
+	/* lower case name without options */
+	for (i = 0; attr[i] != '\0' && attr[i] != ';'; i++) {
+		if (i >= LUALDAP_MAX_NAME - 1)
+			return 0;
+		name[i] = tolower ((unsigned char)attr[i]);
+	}
+	lua_pushlstring (L, name, i);
+	lua_rawget (L, types);
+	type = (int)lua_tonumber (L, -1);
+	lua_pop (L, 1);
+	return type;
+}
+
+
+/*
+** Convert a number of seconds since the epoch into a GeneralizedTime value
+** in UTC (YYYYMMDDHHMMSS[.ffffff]Z), the inverse of gentime2epoch.
+*/
+static void epoch2gentime (double t, char *buff) {
+	long days = (long)(t / 86400);
+	long sec, usec, z, era, doe, yoe, doy, mp, y, m, d;
+	double rem;
+	if (days * 86400.0 > t)
+		days--;
+	rem = t - days * 86400.0;
+	sec = (long)rem;
+	usec = (long)((rem - sec) * 1000000 + 0.5);
+	if (usec >= 1000000) {
+		usec -= 1000000;
+		if (++sec == 86400) {
+			sec = 0;
+			days++;
+		}
+	}
+	/* civil date of the day (inverse of days_from_civil) */
+	z = days + 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y = yoe + era * 400 + (m <= 2);
+	sprintf (buff, "%04ld%02ld%02ld%02ld%02ld%02ld", y, m, d,
+		sec / 3600, sec / 60 % 60, sec % 60);
+	buff += strlen (buff);
+	if (usec > 0) {
+		int n = sprintf (buff, ".%06ld", usec);
+		while (buff[n - 1] == '0')
+			n--;
+		buff += n;
+	}
+	strcpy (buff, "Z");
+}
+
+
+/*
+** Push the i-th value of an attribute as a string.
+** Booleans and numbers (returned by typed searches) are converted back to
+** their LDAP syntax: numbers of time attributes become GeneralizedTime
+** values; other numbers must be integers.
+** @param type Type of the attribute (0 if unknown).
+** @return 1 if the value is a string; 2 if it was converted to a string;
+**	0 if it is invalid.
+*/
+static int push_value (lua_State *L, int v, int i, int type) {
+	if (lua_istable (L, v))
+		lua_rawgeti (L, v, i);
+	else
+		lua_pushvalue (L, v);
+	if (lua_type (L, -1) == LUA_TSTRING)
+		return 1;
+	else if (lua_isboolean (L, -1)) {
+		int b = lua_toboolean (L, -1);
+		lua_pop (L, 1);
+		lua_pushstring (L, b ? "TRUE" : "FALSE");
+		return 2;
+	} else if (lua_isnumber (L, -1)) {
+		char buff[64];
+		double n = lua_tonumber (L, -1);
+		if ((type & LUALDAP_TYPE_MASK) == LUALDAP_TYPE_TIME) {
+			if (n >= -62167219200.0 && n < 253402300800.0) { /* years 0 to 9999 */
+				epoch2gentime (n, buff);
+				lua_pop (L, 1);
+				lua_pushstring (L, buff);
+				return 2;
+			}
+		} else if (n <= LUALDAP_MAX_EXACT_INTEGER && n >= -LUALDAP_MAX_EXACT_INTEGER) {
+			sprintf (buff, "%.0f", n);
+			if (strtod (buff, NULL) == n) {
+				lua_pop (L, 1);
+				lua_pushstring (L, buff);
+				return 2;
+			}
+		}
+	}
+	return 0;
+}
+
+
+/*
+** Push the set (a table value => true) of the values of an attribute, or
+** nil if it has just a few values, which are compared one by one.
+*/
+static void push_valueset (lua_State *L, int v, int n, int type) {
+	int i;
+	if (n <= LUALDAP_SMALL_SET) {
+		lua_pushnil (L);
+		return;
+	}
+	lua_newtable (L);
+	for (i = 1; i <= n; i++) {
+		if (push_value (L, v, i, type)) {
+			lua_pushboolean (L, 1);
+			lua_rawset (L, -3);
+		} else
+			lua_pop (L, 1);
+	}
+}
+
+
+/*
+** Check if the value on top of the stack is one of the values of an
+** attribute.
+** @param v Stack index of the attribute's values.
+** @param n Number of values.
+** @param set Stack index of the set of values (see push_valueset).
+** @param type Type of the attribute (0 if unknown).
+*/
+static int has_value (lua_State *L, int v, int n, int set, int type) {
+	int i, found = 0;
+	if (!lua_isnil (L, set)) {
+		lua_pushvalue (L, -1);
+		lua_rawget (L, set);
+		found = !lua_isnil (L, -1);
+		lua_pop (L, 1);
+		return found;
+	}
+	for (i = 1; i <= n && !found; i++) {
+		if (push_value (L, v, i, type))
+			found = lua_rawequal (L, -1, -2);
+		lua_pop (L, 1);
+	}
+	return found;
+}
+
+
+/*
+** Store the values of an attribute which are not values of another one
+** (all of them if other is 0) at the current modification.
+** Repeated values are stored once, since servers reject them.
+** Converted values are anchored at the given table, since the
+** modification just points to them.
+** @return Number of values stored.
+*/
+static int A_diffvals (lua_State *L, attrs_data *a, const char *name, int v, int nv, int other, int nother, int set, int anchor, int type) {
+	int i, conv, seen, count = 0;
+	if (nv > LUALDAP_SMALL_SET)
+		lua_newtable (L);
+	else
+		lua_pushnil (L); /* earlier values are compared one by one */
+	seen = lua_gettop (L);
+	for (i = 1; i <= nv; i++) {
+		if ((conv = push_value (L, v, i, type)) == 0) {
+			value_error (L, name);
+			return 0;
+		}
+		if ((other == 0 || !has_value (L, other, nother, set, type))
+			&& !has_value (L, v, i - 1, seen, type)) {
+			if (conv > 1) { /* anchor[value] = true */
+				lua_pushvalue (L, -1);
+				lua_pushboolean (L, 1);
+				lua_rawset (L, anchor);
+			}
+			if (!lua_isnil (L, seen)) {
+				lua_pushvalue (L, -1);
+				lua_pushboolean (L, 1);
+				lua_rawset (L, seen);
+			}
+			A_setval (L, a, name);
+			count++;
+		}
+		lua_pop (L, 1);
+	}
+	lua_pop (L, 1);
+	return count;
+}
+
+
+/*
+** Append the modifications needed to change the values of an attribute.
+** @param old Stack index of the old values (nil if absent).
+** @param new Stack index of the new values.
+** @param anchor Stack index of a table to anchor converted values.
+** @param type Type of the attribute (0 if unknown).
+*/
+static void A_diffmod (lua_State *L, attrs_data *a, const char *name, int old, int new, int anchor, int type) {
+	int nold = value_count (L, old);
+	int nnew = value_count (L, new);
+	int i, oldset, newset, removed, added;
+	if (nnew == 0) {
+		if (nold > 0) /* remove the attribute */
+			A_newmod (L, a, LUALDAP_MOD_DEL, name, 1);
+		return;
+	} else if (nold == 0) { /* new attribute */
+		A_newmod (L, a, LUALDAP_MOD_ADD, name, 0);
+		A_diffvals (L, a, name, new, nnew, 0, 0, 0, anchor, type);
+		A_nullval (L, a);
+		return;
+	}
+	push_valueset (L, old, nold, type);
+	oldset = lua_gettop (L);
+	push_valueset (L, new, nnew, type);
+	newset = lua_gettop (L);
+	/* count the differences */
+	for (removed = 0, i = 1; i <= nold; i++) {
+		if (push_value (L, old, i, type) && !has_value (L, new, nnew, newset, type))
+			removed++;
+		lua_pop (L, 1);
+	}
+	for (added = 0, i = 1; i <= nnew; i++) {
+		if (push_value (L, new, i, type) && !has_value (L, old, nold, oldset, type))
+			added++;
+		lua_pop (L, 1);
+	}
+	if (removed == nold) { /* no value kept: replace them all */
+		A_newmod (L, a, LUALDAP_MOD_REP, name, 0);
+		A_diffvals (L, a, name, new, nnew, 0, 0, 0, anchor, type);
+		A_nullval (L, a);
+	} else {
+		if (removed > 0) {
+			A_newmod (L, a, LUALDAP_MOD_DEL, name, 0);
+			A_diffvals (L, a, name, old, nold, new, nnew, newset, anchor, type);
+			A_nullval (L, a);
+		}
+		if (added > 0) {
+			A_newmod (L, a, LUALDAP_MOD_ADD, name, 0);
+			A_diffvals (L, a, name, new, nnew, old, nold, oldset, anchor, type);
+			A_nullval (L, a);
+		}
+	}
+	lua_pop (L, 2);
+}
+
+
+/*
+** Result of an update which did not need a request.
+*/
+static int unchanged_result (lua_State *L) {
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Update an entry with the minimal set of modifications.
+** Attributes are matched ignoring case; values are compared exactly.
+** Attributes absent from the new table are removed.
+** Typed values are converted back according to the types of the schema,
+** if it was already loaded by a typed search.
+** @param #1 LDAP connection.
+** @param #2 String with entry's DN.
+** @param #3 Table with the current attributes and values.
+** @param #4 Table with the desired attributes and values.
+** @return Function to process the LDAP result.
+*/
+static int lualdap_update (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	attrs_data attrs;
+	ldap_int_t rc, msgid;
+	int names, anchor, types = 0, nattrs, nvalues, i;
+	luaL_checktype (L, 3, LUA_TTABLE);
+	luaL_checktype (L, 4, LUA_TTABLE);
+	lua_settop (L, 4);
+	A_init (&attrs);
+	/* at most two modifications per new attribute and one per removed one,
+	   each value being sent at most once */
+	nattrs = 1;
+	nvalues = 0;
+	for (i = 3; i <= 4; i++) {
+		lua_pushnil (L);
+		while (lua_next (L, i) != 0) {
+			nattrs += (i == 3) ? 1 : 2;
+			nvalues += value_count (L, -1);
+			lua_pop (L, 1);
+		}
+	}
+	A_reserve (L, &attrs, nattrs, nvalues);
+	if (conn->types != LUA_NOREF) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, conn->types);
+		types = lua_gettop (L);
+	}
+	lua_newtable (L); /* lower case name => current name */
+	names = lua_gettop (L);
+	lua_newtable (L);
+	anchor = lua_gettop (L);
+	lua_pushnil (L);
+	while (lua_next (L, 3) != 0) {
+		if ((!lua_isnumber (L, -2)) && (lua_isstring (L, -2))) {
+			push_lower (L, lua_tostring (L, -2));
+			lua_pushvalue (L, -3);
+			lua_rawset (L, names);
+		}
+		lua_pop (L, 1);
+	}
+	/* changed and new attributes */
+	lua_pushnil (L);
+	while (lua_next (L, 4) != 0) {
+		int val = lua_gettop (L);
+		if ((!lua_isnumber (L, -2)) && (lua_isstring (L, -2))) {
+			const char *name = lua_tostring (L, val - 1);
+			push_lower (L, name);
+			lua_pushvalue (L, -1);
+			lua_rawget (L, names);
+			lua_pushvalue (L, -1);
+			if (!lua_isnil (L, -1)) {
+				lua_rawget (L, 3);
+				/* current attribute was seen */
+				lua_pushvalue (L, val + 1);
+				lua_pushnil (L);
+				lua_rawset (L, names);
+			}
+			A_diffmod (L, &attrs, name, val + 3, val, anchor, attr_type (L, types, name));
+			lua_settop (L, val);
+		}
+		lua_pop (L, 1);
+	}
+	/* removed attributes */
+	lua_pushnil (L);
+	while (lua_next (L, names) != 0) {
+		lua_pushvalue (L, -1);
+		lua_rawget (L, 3);
+		if (value_count (L, -1) > 0)
+			A_newmod (L, &attrs, LUALDAP_MOD_DEL, lua_tostring (L, -2), 1);
+		lua_pop (L, 2);
+	}
+	if (attrs.ai == 0) { /* nothing changed */
+		lua_pushcfunction (L, unchanged_result);
+		return 1;
+	}
+	A_lastattr (L, &attrs);
+	rc = ldap_modify_ext (conn->ld, dn, attrs.attrs, NULL, NULL, &msgid);
+	return create_future (L, rc, 1, msgid, LDAP_RES_MODIFY);
+}
+
+
+/*
+** Change the distinguished name of an entry.
+*/
+static int lualdap_rename (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	ldap_pchar_t rdn = (ldap_pchar_t) luaL_checkstring (L, 3);
+	ldap_pchar_t par = (ldap_pchar_t) luaL_optlstring (L, 4, NULL, NULL);
+	const int del = luaL_optnumber (L, 5, 0);
+	ldap_int_t msgid;
+	ldap_int_t rc = ldap_rename (conn->ld, dn, rdn, par, del, NULL, NULL, &msgid);
+	return create_future (L, rc, 1, msgid, LDAP_RES_MODDN);
+}
+
+
+/*
+** Number of days from 1970-01-01 to the given date of the Gregorian calendar.
+*/
+static long days_from_civil (long y, long m, long d) {
+	long era, yoe, doy;
+	y -= (m <= 2);
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+
+/*
+** Read n decimal digits.
+** @return The number read or -1 if there are not enough digits.
+*/
+static long read_digits (const char **s, const char *end, int n) {
+	long v = 0;
+	for (; n > 0; n--, (*s)++) {
+		if (*s >= end || !isdigit ((unsigned char)**s))
+			return -1;
+		v = v * 10 + (**s - '0');
+	}
+	return v;
+}
+
+
+/*
+** Convert a GeneralizedTime value (YYYYMMDDHH[MM[SS]][.fff][Z|+hhmm|-hhmm])
+** into the number of seconds since the epoch.
+** @return 1 in case of success; 0 if the value is malformed.
+*/
+static int gentime2epoch (const char *s, size_t len, double *t) {
+	const char *end = s + len;
+	long y = read_digits (&s, end, 4);
+	long mo = read_digits (&s, end, 2);
+	long d = read_digits (&s, end, 2);
+	long h = read_digits (&s, end, 2);
+	long mi = 0, sec = 0;
+	double frac = 0;
+	if (y < 0 || mo < 1 || mo > 12 || d < 1 || d > 31 || h < 0 || h > 23)
+		return 0;
+	if (s < end && isdigit ((unsigned char)*s)) {
+		if ((mi = read_digits (&s, end, 2)) < 0)
+			return 0;
+		if (s < end && isdigit ((unsigned char)*s))
+			if ((sec = read_digits (&s, end, 2)) < 0)
+				return 0;
+	}
+	if (s < end && (*s == '.' || *s == ',')) {
+		double scale = 0.1;
+		for (s++; s < end && isdigit ((unsigned char)*s); s++, scale /= 10)
+			frac += (*s - '0') * scale;
+	}
+	*t = ((days_from_civil (y, mo, d) * 24 + h) * 60 + mi) * 60.0 + sec + frac;
+	if (s < end && (*s == '+' || *s == '-')) {
+		int sign = (*s++ == '+') ? 1 : -1;
+		long oh = read_digits (&s, end, 2);
+		long om = (s < end) ? read_digits (&s, end, 2) : 0;
+		if (oh < 0 || om < 0)
+			return 0;
+		*t -= sign * (oh * 60 + om) * 60.0;
+	} else if (s < end && *s == 'Z')
+		s++;
+	return s == end;
+}
+
+
+/*
+** Push a value converted according to the given type.
+** Values which cannot be converted are pushed as strings, as are integers
+** which a number cannot represent exactly (such as the Large Integer times
+** of Active Directory).
+*/
+static void push_typed (lua_State *L, BerValue *bv, int type) {
+	double t;
+	switch (type & LUALDAP_TYPE_MASK) {
+		case LUALDAP_TYPE_INTEGER:
+			if (push_integer (L, bv))
+				return;
+			break;
+		case LUALDAP_TYPE_BOOLEAN:
+			if (bv->bv_len == 4 && memcmp (bv->bv_val, "TRUE", 4) == 0) {
+				lua_pushboolean (L, 1);
+				return;
+			} else if (bv->bv_len == 5 && memcmp (bv->bv_val, "FALSE", 5) == 0) {
+				lua_pushboolean (L, 0);
+				return;
+			}
+			break;
+		case LUALDAP_TYPE_TIME:
+			if (gentime2epoch (bv->bv_val, bv->bv_len, &t)) {
+				lua_pushnumber (L, t);
+				return;
+			}
+			break;
+	}
+	lua_pushlstring (L, bv->bv_val, bv->bv_len);
+}
+
+
+/*
+** Count the values of an array terminated by a value with a NULL bv_val.
+*/
+static int count_values (BerValue *vals) {
+	int n = 0;
+	while (vals != NULL && vals[n].bv_val != NULL)
+		n++;
+	return n;
+}
+
+
+/*
+** Push an attribute value (or a table of values) on top of the stack.
+** @param L lua_State.
+** @param vals Array of values terminated by a value with a NULL bv_val.
+** @param type Type of the attribute's values (0 if unknown).
+** @return 1 in case of success.
+*/
+static int push_values (lua_State *L, BerValue *vals, int type) {
+	int i, n = count_values (vals);
+	if (n == 0) /* no values */
+		lua_pushboolean (L, 1);
+	else if (n == 1 && (type == 0 || type & LUALDAP_TYPE_SINGLE)) /* just one value */
+		push_typed (L, &vals[0], type);
+	else { /* Multiple values */
+		lua_newtable (L);
+		for (i = 0; i < n; i++) {
+			push_typed (L, &vals[i], type);
+			lua_rawseti (L, -2, i+1);
+		}
+	}
+	return 1;
+}
+
+
+/*
+** Append the given values to the table on top of the stack.
+*/
+static void append_values (lua_State *L, BerValue *vals, int type) {
+	int i, n = luaL_getn (L, -1);
+	for (i = 0; vals != NULL && vals[i].bv_val != NULL; i++) {
+		push_typed (L, &vals[i], type);
+		lua_rawseti (L, -2, ++n);
+	}
+}
+
+
+#ifndef WINLDAP
+/*
+** Decode the next attribute of an entry.
+** Entries are decoded in a single pass over their BER encoding: each call
+** decodes one attribute description and its values, which point into the
+** message (they are not copied).
+** @param ber Decoding state created by attr_first.
+** @param attr Where to store the attribute description (not
+**	NULL-terminated).
+** @param vals Where to store the array of values, terminated by a value
+**	with a NULL bv_val (to be released with attr_release).
+** @return 1 if an attribute was decoded; 0 at the end of the entry.
+*/
+static int attr_next (LDAP *ld, LDAPMessage *entry, BerElement **ber, BerValue *attr, BerValue **vals) {
+	*vals = NULL;
+	if (*ber == NULL
+		|| ldap_get_attribute_ber (ld, entry, *ber, attr, vals) != LDAP_SUCCESS)
+		return 0;
+	return attr->bv_val != NULL;
+}
+
+
+/*
+** Start decoding the attributes of an entry and decode the first one.
+** @param ber Where to store the decoding state (to be released with
+**	ber_free).
+** @return 1 if an attribute was decoded; 0 if the entry has no attributes.
+*/
+static int attr_first (LDAP *ld, LDAPMessage *entry, BerElement **ber, BerValue *attr, BerValue **vals) {
+	BerValue dn;
+	*ber = NULL;
+	*vals = NULL;
+	if (ldap_get_dn_ber (ld, entry, ber, &dn) != LDAP_SUCCESS)
+		return 0;
+	return attr_next (ld, entry, ber, attr, vals);
+}
+
+
+/*
+** Release an attribute decoded by attr_first or attr_next.
+*/
+static void attr_release (BerValue *attr, BerValue *vals) {
+	(void)attr;
+	ber_memfree (vals);
+}
+#else
+/*
+** WinLDAP has no single pass decoder: the values of each attribute are
+** looked up by name and copied to an array compatible with OpenLDAP's.
+*/
+static int attr_walk (LDAP *ld, LDAPMessage *entry, BerElement **ber, int first, BerValue *attr, BerValue **vals) {
+	char *name = first ? ldap_first_attribute (ld, entry, ber)
+		: ldap_next_attribute (ld, entry, *ber);
+	BerValue **v;
+	size_t size;
+	int i, n;
+	*vals = NULL;
+	if (name == NULL)
+		return 0;
+	attr->bv_val = name;
+	attr->bv_len = strlen (name);
+	v = ldap_get_values_len (ld, entry, name);
+	n = ldap_count_values_len (v);
+	size = (n + 1) * sizeof (BerValue);
+	for (i = 0; i < n; i++)
+		size += v[i]->bv_len;
+	*vals = (BerValue *)malloc (size);
+	if (*vals != NULL) {
+		char *data = (char *)(*vals + n + 1);
+		for (i = 0; i < n; i++) {
+			(*vals)[i].bv_len = v[i]->bv_len;
+			(*vals)[i].bv_val = data;
+			memcpy (data, v[i]->bv_val, v[i]->bv_len);
+			data += v[i]->bv_len;
+		}
+		(*vals)[n].bv_len = 0;
+		(*vals)[n].bv_val = NULL;
+	}
+	ldap_value_free_len (v);
+	return 1;
+}
+
+
+static int attr_first (LDAP *ld, LDAPMessage *entry, BerElement **ber, BerValue *attr, BerValue **vals) {
+	*ber = NULL;
+	return attr_walk (ld, entry, ber, 1, attr, vals);
+}
+
+
+static int attr_next (LDAP *ld, LDAPMessage *entry, BerElement **ber, BerValue *attr, BerValue **vals) {
+	return attr_walk (ld, entry, ber, 0, attr, vals);
+}
+
+
+static void attr_release (BerValue *attr, BerValue *vals) {
+	ldap_memfree (attr->bv_val);
+	free (vals);
+}
+#endif
+
+
+/*
+** Check if an attribute description has a range option (;range=low-high).
+** @param high Where to store the upper bound of the range (-1 if `*').
+** @return Length of the attribute description before the range option or
+**	0 if there is no range option.
+*/
+static size_t range_option (const char *attr, long *high) {
+	const char *opt = strstr (attr, ";range=");
+	const char *dash;
+	if (opt == NULL || (dash = strchr (opt, '-')) == NULL)
+		return 0;
+	if (dash[1] == '*')
+		*high = -1;
+	else
+		*high = strtol (dash + 1, NULL, 10);
+	return opt - attr;
+}
+
+
+/*
+** Append the values of the ranged attribute of an entry returned by a
+** follow-up request to the table on top of the stack.
+** @param high Where to store the upper bound of the range (-1 if `*').
+** @return 1 if the attribute was found; 0 otherwise.
+*/
+static int append_range (lua_State *L, LDAP *ld, LDAPMessage *entry, const char *name, int type, long *high) {
+	char buff[LUALDAP_MAX_NAME + 64];
+	BerElement *ber;
+	BerValue attr, *vals;
+	size_t len = strlen (name);
+	int ok, found = 0;
+	for (ok = attr_first (ld, entry, &ber, &attr, &vals);
+		ok;
+		ok = attr_next (ld, entry, &ber, &attr, &vals))
+	{
+		if (!found && attr.bv_len < sizeof (buff)) {
+			memcpy (buff, attr.bv_val, attr.bv_len);
+			buff[attr.bv_len] = '\0';
+			if (range_option (buff, high) == len && strncmp (buff, name, len) == 0) {
+				append_values (L, vals, type);
+				found = 1;
+			}
+		}
+		attr_release (&attr, vals);
+	}
+	ber_free (ber, 0);
+	return found;
+}
+
+
+/*
+** Fetch the remaining values of an attribute retrieved by ranges and
+** append them to the table on top of the stack.
+** The follow-up base searches are pipelined: a window of requests for the
+** next ranges, with the size of the range already received, is kept on
+** the wire and the replies are consumed in order.
+** @param name Attribute description without the range option.
+** @param high Upper bound of the range already received.
+** @param step Number of values of the range already received.
+** @param type Type of the attribute's values.
+** @param timeout Time limit of each follow-up request (NULL if none).
+** @return NULL in case of success or an error message (the values would
+**	be incomplete).
+*/
+static const char *fetch_ranges (lua_State *L, LDAP *ld, LDAPMessage *entry, const char *name, long high, long step, int type, struct timeval *timeout) {
+	char attr[LUALDAP_MAX_NAME + 64];
+	char *attrs[2];
+	int msgids[LUALDAP_RANGE_WINDOW];
+	long highs[LUALDAP_RANGE_WINDOW];
+	int first = 0, count = 0, done = 0;
+	long next = high + 1; /* first value not yet requested */
+	const char *err = NULL;
+	char *dn;
+
+	if (step <= 0 || strlen (name) >= LUALDAP_MAX_NAME)
+		return LUALDAP_PREFIX"invalid range of values";
+	if ((dn = ldap_get_dn (ld, entry)) == NULL)
+		return LUALDAP_PREFIX"invalid entry";
+	attrs[0] = attr;
+	attrs[1] = NULL;
+	while (!done && err == NULL) {
+		LDAPMessage *res, *e;
+		int i, rc = LDAP_SUCCESS;
+		/* fill the window */
+		for (; count < LUALDAP_RANGE_WINDOW; count++, next += step) {
+			i = (first + count) % LUALDAP_RANGE_WINDOW;
+			sprintf (attr, "%s;range=%ld-%ld", name, next, next + step - 1);
+			rc = ldap_search_ext (ld, dn, LDAP_SCOPE_BASE, "(objectClass=*)",
+				attrs, 0, NULL, NULL, timeout, LDAP_NO_LIMIT, &msgids[i]);
+			if (rc != LDAP_SUCCESS)
+				break;
+			highs[i] = next + step - 1;
+		}
+		if (count == 0) {
+			err = ldap_err2string (rc);
+			break;
+		}
+		/* consume the oldest reply */
+		i = first;
+		first = (first + 1) % LUALDAP_RANGE_WINDOW;
+		count--;
+		res = NULL;
+		rc = ldap_result (ld, msgids[i], LDAP_MSG_ALL, timeout, &res);
+		if (rc == 0) {
+			ldap_abandon_ext (ld, msgids[i], NULL, NULL);
+			err = result_timeout;
+		} else if (rc < 0)
+			err = LUALDAP_PREFIX"result error";
+		else if ((e = ldap_first_entry (ld, res)) == NULL) {
+			int code;
+			if (ldap_parse_result (ld, res, &code, NULL, NULL, NULL, NULL, 0) != LDAP_SUCCESS
+				|| code == LDAP_SUCCESS)
+				err = LUALDAP_PREFIX"missing range of values";
+			else
+				err = ldap_err2string (code);
+		} else if (!append_range (L, ld, e, name, type, &high))
+			err = LUALDAP_PREFIX"missing range of values";
+		else if (high < 0)
+			done = 1; /* last range */
+		else if (high != highs[i]) {
+			/* short range: request again from the next value */
+			for (; count > 0; count--, first = (first + 1) % LUALDAP_RANGE_WINDOW)
+				ldap_abandon_ext (ld, msgids[first], NULL, NULL);
+			next = high + 1;
+		}
+		ldap_msgfree (res);
+	}
+	for (; count > 0; count--, first = (first + 1) % LUALDAP_RANGE_WINDOW)
+		ldap_abandon_ext (ld, msgids[first], NULL, NULL);
+	ldap_memfree (dn);
+	return err;
+}
+
+
+/*
+** Push the values of an attribute retrieved by ranges (;range=low-high)
+** on top of the stack, fetching the remaining ranges.
+** @param name Attribute description without the range option.
+** @param high Upper bound of the range (-1 if `*').
+** @param vals Values of the range.
+** @param timeout Time limit of each follow-up request (NULL if none).
+** @return NULL in case of success or an error message.
+*/
+static const char *push_ranges (lua_State *L, LDAP *ld, LDAPMessage *entry, const char *name, long high, BerValue *vals, int type, struct timeval *timeout) {
+	lua_newtable (L);
+	append_values (L, vals, type);
+	if (high >= 0)
+		return fetch_ranges (L, ld, entry, name, high, count_values (vals), type, timeout);
+	return NULL;
+}
+
+
+/*
+** Store entry's attributes and values at the given table.
+** Attributes retrieved by ranges (;range=low-high) are completed with
+** follow-up requests and stored under the name without the range option.
+** @param entry Current entry.
+** @param tab Absolute stack index of the table.
+** @param types Absolute stack index of the table of types (0 if values
+**	should not be decoded).
+** @param timeout Time limit of the follow-up requests (NULL if none).
+** @return NULL in case of success or an error message (when the remaining
+**	values of a ranged attribute could not be retrieved).
+*/
+static const char *set_attribs (lua_State *L, LDAP *ld, LDAPMessage *entry, int tab, int types, struct timeval *timeout) {
+	BerElement *ber;
+	BerValue attr, *vals;
+	const char *err = NULL;
+	int ok;
+	for (ok = attr_first (ld, entry, &ber, &attr, &vals);
+		ok;
+		ok = attr_next (ld, entry, &ber, &attr, &vals))
+	{
+		const char *name;
+		long high;
+		size_t len;
+		lua_pushlstring (L, attr.bv_val, attr.bv_len);
+		name = lua_tostring (L, -1);
+		len = range_option (name, &high);
+		if (len > 0) {
+			lua_pushlstring (L, name, len);
+			lua_replace (L, -2);
+			name = lua_tostring (L, -1);
+			err = push_ranges (L, ld, entry, name, high, vals, attr_type (L, types, name), timeout);
+		} else
+			push_values (L, vals, attr_type (L, types, name));
+		attr_release (&attr, vals);
+		if (err != NULL) {
+			lua_pop (L, 2);
+			break;
+		}
+		lua_rawset (L, tab); /* tab[attr] = vals */
+	}
+	ber_free (ber, 0); /* don't need to test if (ber == NULL) */
+	return err;
+}
+
+
+#ifndef WINLDAP
+/*
+** Compare two AVAs by attribute type and value, ignoring case.
+*/
+static int ava_cmp (LDAPAVA *a, LDAPAVA *b) {
+	ber_len_t i;
+	for (i = 0; i < a->la_attr.bv_len && i < b->la_attr.bv_len; i++) {
+		int d = tolower ((unsigned char)a->la_attr.bv_val[i]) -
+			tolower ((unsigned char)b->la_attr.bv_val[i]);
+		if (d != 0)
+			return d;
+	}
+	if (a->la_attr.bv_len != b->la_attr.bv_len)
+		return (a->la_attr.bv_len < b->la_attr.bv_len) ? -1 : 1;
+	for (i = 0; i < a->la_value.bv_len && i < b->la_value.bv_len; i++) {
+		int d = tolower ((unsigned char)a->la_value.bv_val[i]) -
+			tolower ((unsigned char)b->la_value.bv_val[i]);
+		if (d != 0)
+			return d;
+	}
+	if (a->la_value.bv_len != b->la_value.bv_len)
+		return (a->la_value.bv_len < b->la_value.bv_len) ? -1 : 1;
+	return 0;
+}
+
+
+/*
+** Normalize a DN: LDAPv3 string representation, in lower case, with the
+** AVAs of multi-valued RDNs sorted.
+** @return Normalized DN (to be released with ldap_memfree) or NULL if the
+**	DN is invalid.
+*/
+static char *dn_normalize (const char *str) {
+	LDAPDN dn;
+	char *out, *c;
+	int i, j, k;
+	if (ldap_str2dn (str, &dn, LDAP_DN_FORMAT_LDAP) != LDAP_SUCCESS)
+		return NULL;
+	for (i = 0; dn != NULL && dn[i] != NULL; i++) {
+		LDAPRDN rdn = dn[i];
+		for (j = 1; rdn[j] != NULL; j++) { /* insertion sort */
+			LDAPAVA *ava = rdn[j];
+			for (k = j; k > 0 && ava_cmp (rdn[k-1], ava) > 0; k--)
+				rdn[k] = rdn[k-1];
+			rdn[k] = ava;
+		}
+	}
+	if (ldap_dn2str (dn, &out, LDAP_DN_FORMAT_LDAPV3) != LDAP_SUCCESS)
+		out = NULL;
+	ldap_dnfree (dn);
+	for (c = out; c != NULL && *c != '\0'; c++)
+		*c = tolower ((unsigned char)*c);
+	return out;
+}
+
+
+/*
+** Find the RDNs of a normalized DN.
+** @param n Where to store the number of RDNs.
+** @return Array with the offset of each RDN followed by the length of
+**	the DN plus one (to be released with free).
+*/
+static size_t *dn_split (const char *dn, int *n) {
+	size_t len = strlen (dn), i;
+	size_t *offsets = (size_t *)malloc ((len / 2 + 2) * sizeof (size_t));
+	*n = 0;
+	if (offsets == NULL)
+		return NULL;
+	if (len > 0) {
+		offsets[(*n)++] = 0;
+		for (i = 0; i < len; i++) {
+			if (dn[i] == '\\')
+				i++; /* skip escaped character */
+			else if (dn[i] == ',')
+				offsets[(*n)++] = i + 1;
+		}
+	}
+	offsets[*n] = len + 1;
+	return offsets;
+}
+
+
+/*
+** Get a normalized DN from the given stack position.
+** @return Normalized DN (to be released with ldap_memfree).
+*/
+static char *checknormdn (lua_State *L, int arg) {
+	char *dn = dn_normalize (luaL_checkstring (L, arg));
+	if (dn == NULL)
+		luaL_argerror (L, arg, LUALDAP_PREFIX"invalid DN");
+	return dn;
+}
+
+
+/*
+** Compare two normalized DNs, RDN by RDN, from the root.
+** @return A negative number, zero or a positive number.
+*/
+static int dn_compare (const char *a, const char *b) {
+	int na, nb, d = 0;
+	size_t *oa = dn_split (a, &na);
+	size_t *ob = dn_split (b, &nb);
+	int i = na - 1, j = nb - 1;
+	if (oa == NULL || ob == NULL)
+		d = strcmp (a, b);
+	else
+		for (; d == 0 && i >= 0 && j >= 0; i--, j--) {
+			size_t la = oa[i+1] - oa[i] - 1;
+			size_t lb = ob[j+1] - ob[j] - 1;
+			d = memcmp (a + oa[i], b + ob[j], (la < lb) ? la : lb);
+			if (d == 0 && la != lb)
+				d = (la < lb) ? -1 : 1;
+		}
+	if (d == 0 && oa != NULL && ob != NULL)
+		d = na - nb;
+	free (oa);
+	free (ob);
+	return d;
+}
+
+
+/*
+** Parse a DN.
+** @param #1 String with the DN.
+** @return Array of RDNs; each RDN is a table of values indexed by the lower
+**	case attribute type.
+*/
+static int lualdap_dn_parse (lua_State *L) {
+	LDAPDN dn;
+	int i, j;
+	if (ldap_str2dn (luaL_checkstring (L, 1), &dn, LDAP_DN_FORMAT_LDAP) != LDAP_SUCCESS)
+		return luaL_argerror (L, 1, LUALDAP_PREFIX"invalid DN");
+	lua_newtable (L);
+	for (i = 0; dn != NULL && dn[i] != NULL; i++) {
+		lua_newtable (L);
+		for (j = 0; dn[i][j] != NULL; j++) {
+			LDAPAVA *ava = dn[i][j];
+			ber_len_t k;
+			luaL_Buffer b;
+			luaL_buffinit (L, &b);
+			for (k = 0; k < ava->la_attr.bv_len; k++) {
+				char c = tolower ((unsigned char)ava->la_attr.bv_val[k]);
+				luaL_addlstring (&b, &c, 1);
+			}
+			luaL_pushresult (&b);
+			lua_pushlstring (L, ava->la_value.bv_val, ava->la_value.bv_len);
+			lua_rawset (L, -3);
+		}
+		lua_rawseti (L, -2, i+1);
+	}
+	ldap_dnfree (dn);
+	return 1;
+}
+
+
+/*
+** Normalize a DN.
+** @param #1 String with the DN.
+** @return String with the normalized DN.
+*/
+static int lualdap_dn_normalize (lua_State *L) {
+	char *dn = checknormdn (L, 1);
+	lua_pushstring (L, dn);
+	ldap_memfree (dn);
+	return 1;
+}
+
+
+/*
+** Get the DN of the parent of an entry.
+** @param #1 String with the DN.
+** @return String with the parent's DN or nil if the DN is empty.
+*/
+static int lualdap_dn_parent (lua_State *L) {
+	LDAPDN dn;
+	char *parent;
+	int rc;
+	if (ldap_str2dn (luaL_checkstring (L, 1), &dn, LDAP_DN_FORMAT_LDAP) != LDAP_SUCCESS)
+		return luaL_argerror (L, 1, LUALDAP_PREFIX"invalid DN");
+	if (dn == NULL) { /* root */
+		lua_pushnil (L);
+		return 1;
+	} else if (dn[1] == NULL) { /* child of the root */
+		ldap_dnfree (dn);
+		lua_pushliteral (L, "");
+		return 1;
+	}
+	rc = ldap_dn2str (&dn[1], &parent, LDAP_DN_FORMAT_LDAPV3);
+	ldap_dnfree (dn);
+	if (rc != LDAP_SUCCESS)
+		return luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (rc));
+	lua_pushstring (L, parent);
+	ldap_memfree (parent);
+	return 1;
+}
+
+
+/*
+** Check if an entry is below another one on the directory tree.
+** @param #1 String with the DN of the entry.
+** @param #2 String with the DN of the ancestor.
+** @return true if the entry is a descendant (other than itself) of the
+**	ancestor; false otherwise.
+*/
+static int lualdap_dn_is_descendant (lua_State *L) {
+	const char *s = luaL_checkstring (L, 2);
+	char *dn = checknormdn (L, 1);
+	char *anc = dn_normalize (s);
+	size_t ld = strlen (dn), la;
+	int i, n, ret = 0;
+	size_t *offsets;
+	if (anc == NULL) {
+		ldap_memfree (dn);
+		return luaL_argerror (L, 2, LUALDAP_PREFIX"invalid DN");
+	}
+	la = strlen (anc);
+	offsets = dn_split (dn, &n);
+	if (la == 0) /* root is the ancestor of every entry */
+		ret = (ld > 0);
+	else if (offsets != NULL && ld > la && strcmp (dn + ld - la, anc) == 0)
+		for (i = 1; i < n; i++)
+			if (offsets[i] == ld - la)
+				ret = 1;
+	free (offsets);
+	ldap_memfree (dn);
+	ldap_memfree (anc);
+	lua_pushboolean (L, ret);
+	return 1;
+}
+
+
+/*
+** Compare two DNs.
+** DNs are ordered RDN by RDN from the root, so that every entry comes
+** right before its descendants.
+** @param #1 String with a DN.
+** @param #2 String with another DN.
+** @return -1, 0 or 1 if the first DN is lesser than, equal to or greater
+**	than the second.
+*/
+static int lualdap_dn_compare (lua_State *L) {
+	const char *s = luaL_checkstring (L, 2);
+	char *a = checknormdn (L, 1);
+	char *b = dn_normalize (s);
+	int d;
+	if (b == NULL) {
+		ldap_memfree (a);
+		return luaL_argerror (L, 2, LUALDAP_PREFIX"invalid DN");
+	}
+	d = dn_compare (a, b);
+	ldap_memfree (a);
+	ldap_memfree (b);
+	lua_pushnumber (L, (d < 0) ? -1 : (d > 0));
+	return 1;
+}
+#endif
+
+
+/*
+** Get the distinguished name of the given entry and pushes it on the stack.
+** @param normalize Boolean indicating if the DN should be normalized.
+*/
+static void push_dn (lua_State *L, LDAP *ld, LDAPMessage *entry, int normalize) {
+	char *dn = ldap_get_dn (ld, entry);
+#ifndef WINLDAP
+	if (normalize && dn != NULL) {
+		char *norm = dn_normalize (dn);
+		if (norm != NULL) {
+			ldap_memfree (dn);
+			dn = norm;
+		}
+	}
+#else
+	(void)normalize;
+#endif
+	lua_pushstring (L, dn);
+	ldap_memfree (dn);
+}
+
+
+/*
+** Convert a string to one of the possible scopes of the search.
+*/
+static int string2scope (lua_State *L, const char *s) {
+	if ((s == NULL) || (*s == '\0'))
+		return LDAP_SCOPE_DEFAULT;
+	switch (*s) {
+		case 'b':
+			return LDAP_SCOPE_BASE;
+		case 'o':
+			return LDAP_SCOPE_ONELEVEL;
+		case 's':
+			return LDAP_SCOPE_SUBTREE;
+		default:
+			return luaL_error (L, LUALDAP_PREFIX"invalid search scope `%s'", s);
+	}
+}
+
+
+/*
+** Fill in the attrs array, according to the attrs parameter.
+*/
+static int get_attrs_param (lua_State *L, char *attrs[]) {
+	lua_pushstring (L, "attrs");
+	lua_gettable (L, 2);
+	if (lua_isstring (L, -1)) {
+		attrs[0] = (char *)lua_tostring (L, -1);
+		attrs[1] = NULL;
+	} else if (!lua_istable (L, -1))
+		attrs[0] = NULL;
+	else
+		if (table2strarray (L, lua_gettop (L), attrs, LUALDAP_MAX_ATTRS))
+			return 0;
+	return 1;
+}
+
+
+/*
+** Fill in the struct timeval, according to the timeout parameter.
+*/
+static struct timeval *get_timeout_param (lua_State *L, struct timeval *st) {
+	double t = numbertabparam (L, "timeout", 0);
+	st->tv_sec = (long)t;
+	st->tv_usec = (long)(1000000 * (t - st->tv_sec));
+	if (st->tv_sec == 0 && st->tv_usec == 0)
+		return NULL;
+	else
+		return st;
+}
+
+
+/*
+** Size of the encoding of a search entry.
+*/
+static long message_size (LDAP *ld, LDAPMessage *msg) {
+#ifndef WINLDAP
+	BerElement *ber = NULL;
+	BerValue dn;
+	ber_len_t len = 0;
+	if (ldap_msgtype (msg) == LDAP_RES_SEARCH_ENTRY
+		&& ldap_get_dn_ber (ld, msg, &ber, &dn) == LDAP_SUCCESS)
+		ber_get_option (ber, LBER_OPT_TOTAL_BYTES, &len);
+	ber_free (ber, 0);
+	return (long)len;
+#else
+	(void)ld; (void)msg;
+	return 0;
+#endif
+}
+
+
+/*
+** Release the messages received.
+*/
+static void search_release (search_data *search) {
+	if (search->res != NULL)
+		ldap_msgfree (search->res);
+	search->res = search->cur = NULL;
+	search->entries = 0;
+}
+
+
+/*
+** Report a finished search to the trace callback.
+** The search is timed until its result was received, not until it was
+** consumed, so a slow consumer does not make the search look expensive.
+** @param rc Result code of the search.
+*/
+static void search_trace (lua_State *L, conn_data *conn, search_data *search, int rc) {
+	trace_info t;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, search->params);
+	t.op = "search";
+	t.dn = 0;
+	t.params = lua_gettop (L);
+	t.msgid = search->msgid;
+	t.rc = rc;
+	t.entries = search->count;
+	t.bytes = search->total;
+	t.start = search->begin;
+	t.end = search->ended;
+	trace_call (L, conn, &t);
+	lua_pop (L, 1);
+	search->reported = 1;
+}
+
+
+/*
+** Disable the chasing of referrals by libldap on a connection while a
+** search chases them itself, so references are returned instead.
+** The previous setting is restored by chase_end when the last of these
+** searches is closed.
+*/
+static void chase_begin (conn_data *conn) {
+#ifndef WINLDAP
+	if (conn->chasing++ == 0) {
+		if (ldap_get_option (conn->ld, LDAP_OPT_REFERRALS, &conn->auto_referrals) != LDAP_OPT_SUCCESS)
+			conn->auto_referrals = 0;
+		ldap_set_option (conn->ld, LDAP_OPT_REFERRALS, LDAP_OPT_OFF);
+	}
+#endif
+}
+
+
+/*
+** Restore the chasing of referrals by libldap when no search of the
+** connection chases them itself anymore.
+*/
+static void chase_end (conn_data *conn) {
+#ifndef WINLDAP
+	if (conn->chasing > 0 && --conn->chasing == 0 && conn->ld != NULL)
+		ldap_set_option (conn->ld, LDAP_OPT_REFERRALS,
+			conn->auto_referrals ? LDAP_OPT_ON : LDAP_OPT_OFF);
+#endif
+}
+
+
+/*
+** Release connection reference and the messages received.
+** Pending continuation searches are closed too.
+** A traced search closed before its result was consumed is reported as
+** cancelled.
+*/
+static void search_close (lua_State *L, search_data *search) {
+	if (search->conn != LUA_NOREF) {
+		conn_data *conn;
+		lua_rawgeti (L, LUA_REGISTRYINDEX, search->conn);
+		conn = (conn_data *)lua_touserdata (L, -1);
+		if (conn->trace != LUA_NOREF && search->params != LUA_NOREF
+			&& !search->reported && search->begin > 0)
+			search_trace (L, conn, search, LDAP_USER_CANCELLED);
+		if (search->chase != LUA_NOREF)
+			chase_end (conn);
+		lua_pop (L, 1);
+	}
+	luaL_unref (L, LUA_REGISTRYINDEX, search->conn);
+	search->conn = LUA_NOREF;
+	luaL_unref (L, LUA_REGISTRYINDEX, search->params);
+	search->params = LUA_NOREF;
+	luaL_unref (L, LUA_REGISTRYINDEX, search->chase);
+	search->chase = LUA_NOREF;
+	if (search->chased != LUA_NOREF) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, search->chased);
+		lua_pushnil (L);
+		while (lua_next (L, -2) != 0) {
+			search_data *s = (search_data *)lua_touserdata (L, -2);
+			if (s->conn != LUA_NOREF)
+				search_close (L, s);
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+		luaL_unref (L, LUA_REGISTRYINDEX, search->chased);
+		search->chased = LUA_NOREF;
+	}
+	search_release (search);
+#ifndef WINLDAP
+	ber_memfree (search->cookie.bv_val);
+#endif
+	search->cookie.bv_val = NULL;
+	search->cookie.bv_len = 0;
+}
+
+
+/*
+** Receive the messages of a search which already arrived, waiting for
+** at least one.
+** Since libldap only reads from the connection when asked for a result,
+** messages are not read while the buffered ones are being consumed.
+** @param timeout Maximum time to wait (NULL to wait indefinitely).
+** @return NULL in case of success or an error message.
+*/
+static const char *search_receive (conn_data *conn, search_data *search, struct timeval *timeout) {
+	LDAPMessage *res, *msg;
+	double arrived;
+	int sized, rc = conn_result (conn, search->msgid, LDAP_MSG_RECEIVED, timeout, &res, &arrived);
+	if (rc == 0)
+		return result_timeout;
+	else if (rc == -1) {
+		conn_account (conn, 0, LDAP_SERVER_DOWN);
+		return LUALDAP_PREFIX"result error";
+	}
+	/* the first reply measures the server's latency */
+	conn_account (conn, search->start, LDAP_SUCCESS);
+	search->start = 0;
+	search_release (search);
+	search->res = search->cur = res;
+	/* sizes are needed only to bound the buffer and to trace the search */
+	sized = search->max_bytes > 0 || conn->trace != LUA_NOREF;
+	for (msg = res; msg != NULL; msg = ldap_next_message (conn->ld, msg))
+		if (ldap_msgtype (msg) == LDAP_RES_SEARCH_ENTRY) {
+			search->entries++;
+			if (sized) {
+				long size = message_size (conn->ld, msg);
+				search->total += size;
+				if (size > search->largest)
+					search->largest = size;
+			}
+		} else if (ldap_msgtype (msg) == LDAP_RES_SEARCH_RESULT)
+			search->ended = arrived;
+	return NULL;
+}
+
+
+/*
+** Number of entries to request on the next page of a search with bounded
+** buffering.  The limit of bytes assumes entries as large as the largest
+** one already received (the first page of such searches has one entry).
+*/
+static int page_size (search_data *search) {
+	long n = search->max_entries;
+	if (search->max_bytes > 0) {
+		long m = (search->largest > 0) ? search->max_bytes / search->largest : 1;
+		if (n == 0 || m < n)
+			n = m;
+	}
+	return (n < 1) ? 1 : (int)n;
+}
+
+
+#ifdef LDAP_CONTROL_X_DEREF
+/*
+** Create a dereference control according to the deref parameter: a table
+** of attributes (whose values are DNs) to lists of attributes of the
+** referenced entries.
+** The table MUST be at position 2.
+** @return Result code.
+*/
+static int deref_control (lua_State *L, LDAP *ld, LDAPControl **ctrl) {
+	LDAPDerefSpec ds[LUALDAP_MAX_DEREF + 1];
+	char *attrs[LUALDAP_MAX_DEREF][LUALDAP_MAX_ATTRS];
+	int n = 0, tab;
+
+	*ctrl = NULL;
+	strgettable (L, "deref");
+	if (lua_isnil (L, -1))
+		return LDAP_SUCCESS;
+	else if (!lua_istable (L, -1))
+		return option_error (L, "deref", "table");
+	tab = lua_gettop (L);
+	lua_pushnil (L);
+	while (lua_next (L, tab) != 0) {
+		int key = lua_gettop (L) - 1;
+		if (n >= LUALDAP_MAX_DEREF)
+			return luaL_error (L, LUALDAP_PREFIX"too many dereferenced attributes");
+		if (lua_isnumber (L, key) || !lua_isstring (L, key))
+			return luaL_error (L, LUALDAP_PREFIX"invalid dereferenced attribute");
+		table2strarray (L, key + 1, attrs[n], LUALDAP_MAX_ATTRS);
+		ds[n].derefAttr = (char *)lua_tostring (L, key);
+		ds[n].attributes = attrs[n];
+		n++;
+		lua_settop (L, key);
+	}
+	ds[n].derefAttr = NULL;
+	ds[n].attributes = NULL;
+	return ldap_create_deref_control (ld, ds, 1, ctrl);
+}
+
+
+/*
+** Store the entries referenced by the attributes of an entry, returned
+** with the dereference control, at the given table: the attributes of
+** the entry referenced by the value dn of the attribute attr are stored
+** at tab["attr;deref"][dn].
+** @param types Absolute stack index of the table of types (0 if values
+**	should not be decoded).
+*/
+static void set_deref (lua_State *L, LDAP *ld, LDAPMessage *entry, int tab, int types) {
+	LDAPControl **ctrls = NULL, *ctrl;
+	LDAPDerefRes *drs = NULL, *dr;
+
+	if (ldap_get_entry_controls (ld, entry, &ctrls) != LDAP_SUCCESS || ctrls == NULL)
+		return;
+	ctrl = ldap_control_find (LDAP_CONTROL_X_DEREF, ctrls, NULL);
+	if (ctrl != NULL && ldap_parse_derefresponse_control (ld, ctrl, &drs) == LDAP_SUCCESS) {
+		for (dr = drs; dr != NULL; dr = dr->next) {
+			LDAPDerefVal *dv;
+			lua_pushstring (L, dr->derefAttr);
+			lua_pushliteral (L, ";deref");
+			lua_concat (L, 2);
+			lua_pushvalue (L, -1);
+			lua_rawget (L, tab);
+			if (lua_isnil (L, -1)) { /* first referenced entry */
+				lua_pop (L, 1);
+				lua_newtable (L);
+				lua_pushvalue (L, -2);
+				lua_pushvalue (L, -2);
+				lua_rawset (L, tab);
+			}
+			lua_pushlstring (L, dr->derefVal.bv_val, dr->derefVal.bv_len);
+			lua_newtable (L);
+			for (dv = dr->attrVals; dv != NULL; dv = dv->next) {
+				lua_pushstring (L, dv->type);
+				push_values (L, dv->vals, attr_type (L, types, dv->type));
+				lua_rawset (L, -3);
+			}
+			lua_rawset (L, -3);
+			lua_pop (L, 2);
+		}
+		ldap_derefresponse_free (drs);
+	}
+	ldap_controls_free (ctrls);
+}
+#endif
+
+
+#ifdef LDAP_CONTROL_VALUESRETURNFILTER
+/*
+** Create a matched values control (RFC 3876) according to the
+** matched_values parameter: a filter selecting the values of the
+** attributes to be returned.
+** The table MUST be at position 2.
+** @return Result code.
+*/
+static int matched_values_control (lua_State *L, LDAPControl **ctrl) {
+	const char *filter = strtabparam (L, "matched_values", NULL);
+	BerElement *ber;
+	BerValue bv;
+	int rc;
+
+	*ctrl = NULL;
+	if (filter == NULL)
+		return LDAP_SUCCESS;
+	ber = ber_alloc_t (LBER_USE_DER);
+	if (ber == NULL)
+		return LDAP_NO_MEMORY;
+	if (ldap_put_vrFilter (ber, filter) == -1)
+		rc = LDAP_FILTER_ERROR;
+	else if (ber_flatten2 (ber, &bv, 0) == -1)
+		rc = LDAP_ENCODING_ERROR;
+	else
+		rc = ldap_control_create (LDAP_CONTROL_VALUESRETURNFILTER, 1, &bv, 1, ctrl);
+	ber_free (ber, 1);
+	return rc;
+}
+#endif
+
+
+/*
+** Check if the controls requested by the parameters are supported.
+** The table MUST be at position 2.
+*/
+static void check_controls (lua_State *L) {
+#ifndef LDAP_CONTROL_VALUESRETURNFILTER
+	if (strtabparam (L, "matched_values", NULL) != NULL)
+		luaL_error (L, LUALDAP_PREFIX"matched values control is not supported");
+#else
+	(void)L;
+#endif
+}
+
+
+/*
+** Send a search request with the parameters of the table at position 2.
+** Searches with bounded buffering request a page of results (RFC 2696),
+** continuing from the search's cookie.
+** @return Result code of the request.
+*/
+static int search_send (lua_State *L, conn_data *conn, search_data *search) {
+	ldap_pchar_t base;
+	ldap_pchar_t filter;
+	char *attrs[LUALDAP_MAX_ATTRS];
+	LDAPControl *ctrls[4];
+	int scope, attrsonly, msgid, rc, sizelimit, n = 0;
+	struct timeval st, *timeout;
+
+	get_attrs_param (L, attrs);
+	attrsonly = booltabparam (L, "attrsonly", 0);
+	base = (ldap_pchar_t) strtabparam (L, "base", NULL);
+	filter = (ldap_pchar_t) strtabparam (L, "filter", NULL);
+	scope = string2scope (L, strtabparam (L, "scope", NULL));
+	sizelimit = longtabparam (L, "sizelimit", LDAP_NO_LIMIT);
+	timeout = get_timeout_param (L, &st);
+	ctrls[0] = ctrls[1] = ctrls[2] = ctrls[3] = NULL;
+#ifdef LDAP_CONTROL_VALUESRETURNFILTER
+	rc = matched_values_control (L, &ctrls[n]);
+	if (rc != LDAP_SUCCESS)
+		return rc;
+	if (ctrls[n] != NULL)
+		n++;
+#endif
+#ifdef LDAP_CONTROL_X_DEREF
+	if (search->deref) {
+		rc = deref_control (L, conn->ld, &ctrls[n]);
+		if (rc != LDAP_SUCCESS) {
+			while (n > 0)
+				ldap_control_free (ctrls[--n]);
+			return rc;
+		}
+		n++;
+	}
+#endif
+#ifndef WINLDAP
+	if (search->paged) {
+		rc = ldap_create_page_control (conn->ld, page_size (search),
+			&search->cookie, 0, &ctrls[n]);
+		if (rc != LDAP_SUCCESS) {
+			while (n > 0)
+				ldap_control_free (ctrls[--n]);
+			return rc;
+		}
+		n++;
+	}
+#endif
+
+	rc = ldap_search_ext (conn->ld, base, scope, filter, attrs, attrsonly,
+		(n > 0) ? ctrls : NULL, NULL, timeout, sizelimit, &msgid);
+	while (n > 0)
+		ldap_control_free (ctrls[--n]);
+	if (rc == LDAP_SUCCESS) {
+		search->msgid = msgid;
+		search->timeout = st;
+		search->start = lualdap_now ();
+		search->ended = 0;
+		if (search->begin == 0)
+			search->begin = search->start;
+	} else
+		conn_account (conn, 0, rc);
+	return rc;
+}
+
+
+/*
+** Request the next page of a search with bounded buffering.
+** @param msg Result message of the current page.
+** @return 1 if the next page was requested; 0 if the search is done.
+*/
+static int next_page (lua_State *L, conn_data *conn, search_data *search, LDAPMessage *msg) {
+#ifndef WINLDAP
+	LDAPControl **ctrls = NULL, *ctrl;
+	int err, rc, more = 0;
+	if (!search->paged)
+		return 0;
+	rc = ldap_parse_result (conn->ld, msg, &err, NULL, NULL, NULL, &ctrls, 0);
+	ber_memfree (search->cookie.bv_val);
+	search->cookie.bv_val = NULL;
+	search->cookie.bv_len = 0;
+	if (rc == LDAP_SUCCESS && err == LDAP_SUCCESS
+		&& (ctrl = ldap_control_find (LDAP_CONTROL_PAGEDRESULTS, ctrls, NULL)) != NULL) {
+		ber_int_t count;
+		if (ldap_parse_pageresponse_control (conn->ld, ctrl, &count, &search->cookie) == LDAP_SUCCESS)
+			more = (search->cookie.bv_len > 0);
+	}
+	if (ctrls != NULL)
+		ldap_controls_free (ctrls);
+	if (!more)
+		return 0;
+	/* the parameters MUST be at position 2 */
+	lua_settop (L, 1);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, search->params);
+	rc = search_send (L, conn, search);
+	if (rc != LDAP_SUCCESS)
+		return luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (rc));
+	return 1;
+#else
+	(void)L; (void)conn; (void)search; (void)msg;
+	return 0;
+#endif
+}
+
+
+#ifdef LDAP_RES_SEARCH_REFERENCE
+/*
+** Push the URLs of a continuation reference: the first one, nil (in place
+** of the attributes of an entry) and the list of all of them.
+*/
+static void push_reference (lua_State *L, char **refs) {
+	int i;
+	lua_pushstring (L, refs[0]);
+	lua_pushnil (L);
+	lua_newtable (L);
+	for (i = 0; refs[i] != NULL; i++) {
+		lua_pushstring (L, refs[i]);
+		lua_rawseti (L, -2, i + 1);
+	}
+}
+#endif
+
+
+/*
+** Check if a continuation search has messages to be consumed, receiving
+** the ones which already arrived without waiting.
+*/
+static int search_ready (lua_State *L, search_data *search) {
+	struct timeval zero;
+	conn_data *conn;
+	if (search->conn == LUA_NOREF || search->cur != NULL)
+		return 1;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, search->conn);
+	conn = (conn_data *)lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	if (conn->ld == NULL)
+		return 1;
+	zero.tv_sec = zero.tv_usec = 0;
+	search_receive (conn, search, &zero);
+	return search->cur != NULL;
+}
+
+
+/*
+** Get the next result of the continuation searches of a search, which are
+** stored at the chased table as search object = iterator.
+** Searches with messages already received are consumed first.
+** @param wait Boolean indicating if it should wait for a message.
+** @return Number of values pushed (the results of a continuation search's
+**	iterator); 0 if all continuation searches are done; -1 if no message
+**	was received and wait is false.
+*/
+static int next_chased (lua_State *L, search_data *search, int wait) {
+	int tab, top = lua_gettop (L);
+	if (search->chased == LUA_NOREF)
+		return wait ? 0 : -1;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, search->chased);
+	tab = lua_gettop (L);
+	for (;;) {
+		search_data *s;
+		int n;
+		lua_pushnil (L);
+		while (lua_next (L, tab) != 0) {
+			if (search_ready (L, (search_data *)lua_touserdata (L, -2)))
+				break;
+			lua_pop (L, 1);
+		}
+		if (lua_gettop (L) == tab) { /* no message received */
+			if (!wait) {
+				lua_settop (L, top);
+				return -1;
+			}
+			lua_pushnil (L);
+			if (lua_next (L, tab) == 0) { /* all done */
+				luaL_unref (L, LUA_REGISTRYINDEX, search->chased);
+				search->chased = LUA_NOREF;
+				lua_settop (L, top);
+				return 0;
+			}
+		}
+		s = (search_data *)lua_touserdata (L, tab + 1);
+		if (s->conn != LUA_NOREF)
+			lua_call (L, 0, LUA_MULTRET);
+		else
+			lua_pop (L, 1);
+		n = lua_gettop (L) - tab - 1;
+		if (n > 0 && !lua_isnil (L, tab + 2))
+			return n;
+		/* continuation search done or failed */
+		lua_pushvalue (L, tab + 1);
+		lua_pushnil (L);
+		lua_rawset (L, tab);
+		if (s->conn != LUA_NOREF)
+			search_close (L, s);
+		if (n > 1) /* nil, error message */
+			return n;
+		lua_settop (L, tab);
+	}
+}
+
+
+#ifndef WINLDAP
+/*
+** Convert a scope of search to the string accepted by the scope parameter.
+*/
+static const char *scope2string (int scope) {
+	switch (scope) {
+		case LDAP_SCOPE_BASE:
+			return "base";
+		case LDAP_SCOPE_ONELEVEL:
+			return "onelevel";
+		default:
+			return "subtree";
+	}
+}
+
+
+/*
+** Get a connection to the server of a referral URL, opening it with the
+** credentials of the chase_referrals option unless it is cached at the
+** referring connection, and push it on the stack.
+** URLs without a host refer to the referring connection itself.
+** @param conn_index Stack index of the referring connection.
+** @param chase Stack index of the chase_referrals option.
+** @return 1 in case of success; 0 (and nothing pushed) otherwise.
+*/
+static int referral_conn (lua_State *L, int conn_index, int chase, LDAPURLDesc *lud) {
+	conn_data *conn = (conn_data *)lua_touserdata (L, conn_index);
+	conn_data *ref;
+	const char *who = NULL, *password = NULL;
+	int top = lua_gettop (L), cache, url, secure, use_tls;
+
+	if (lud->lud_host == NULL || *lud->lud_host == '\0') {
+		lua_pushvalue (L, conn_index);
+		return 1;
+	}
+	if (lua_istable (L, chase)) {
+		lua_pushliteral (L, "who");
+		lua_gettable (L, chase);
+		who = lua_tostring (L, -1);
+		lua_pushliteral (L, "password");
+		lua_gettable (L, chase);
+		password = lua_tostring (L, -1);
+	}
+	/* the referred server is reached as securely as the referring one,
+	   and credentials are never sent to it in clear text */
+	secure = strcmp (lud->lud_scheme, "ldaps") == 0 || strcmp (lud->lud_scheme, "ldapi") == 0;
+	use_tls = conn->tls && !secure;
+	if ((who != NULL || password != NULL) && !secure && !use_tls) {
+		lua_settop (L, top);
+		return 0;
+	}
+	if (conn->referrals == LUA_NOREF) {
+		lua_newtable (L);
+		conn->referrals = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->referrals);
+	cache = lua_gettop (L);
+	lua_pushfstring (L, strchr (lud->lud_host, ':') ? "%s://[%s]" : "%s://%s",
+		lud->lud_scheme, lud->lud_host);
+	if (lud->lud_port > 0) {
+		lua_pushfstring (L, ":%d", lud->lud_port);
+		lua_concat (L, 2);
+	}
+	url = lua_gettop (L);
+	/* connections are cached by server and identity */
+	lua_pushvalue (L, url);
+	lua_pushliteral (L, " ");
+	lua_pushstring (L, (who != NULL) ? who : "");
+	lua_concat (L, 3);
+	lua_pushvalue (L, -1);
+	lua_rawget (L, cache);
+	ref = (conn_data *)lua_touserdata (L, -1);
+	if (ref == NULL || ref->ld == NULL) {
+		lua_pop (L, 1);
+		ref = (conn_data *)lua_newuserdata (L, sizeof (conn_data));
+		lualdap_setmeta (L, LUALDAP_CONNECTION_METATABLE);
+		ref->schema = ref->types = ref->trace = ref->referrals = LUA_NOREF;
+		if (conn_open (ref, lua_tostring (L, url), who, password, use_tls) != NULL) {
+			lua_settop (L, top);
+			return 0;
+		}
+		/* continuation searches are followed one hop only */
+		ldap_set_option (ref->ld, LDAP_OPT_REFERRALS, LDAP_OPT_OFF);
+		lua_pushvalue (L, url + 1);
+		lua_pushvalue (L, -2);
+		lua_rawset (L, cache);
+	}
+	lua_replace (L, top + 1);
+	lua_settop (L, top + 1);
+	return 1;
+}
+
+
+/*
+** Follow a continuation reference: send the search, with the base, scope
+** and filter given by the URL, to the server of the first URL which can
+** be reached, and store the new search at the chased table.
+** Continuation searches don't chase referrals themselves.
+** @param conn_index Stack index of the referring connection.
+** @return 1 if the reference is being followed; 0 otherwise.
+*/
+static int chase_reference (lua_State *L, search_data *search, int conn_index, char **refs) {
+	int i, top = lua_gettop (L), chase = top + 1, params = top + 2;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, search->chase);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, search->params);
+	for (i = 0; refs[i] != NULL; i++) {
+		LDAPURLDesc *lud;
+		int copy, scope;
+		if (ldap_url_parse (refs[i], &lud) != LDAP_URL_SUCCESS)
+			continue;
+		if (!referral_conn (L, conn_index, chase, lud)) {
+			ldap_free_urldesc (lud);
+			continue;
+		}
+		lua_pushliteral (L, "search");
+		lua_gettable (L, -2);
+		lua_insert (L, -2);
+		/* copy of the parameters */
+		lua_newtable (L);
+		copy = lua_gettop (L);
+		lua_pushnil (L);
+		while (lua_next (L, params) != 0) {
+			lua_pushvalue (L, -2);
+			lua_insert (L, -2);
+			lua_rawset (L, copy);
+		}
+		lua_pushliteral (L, "chase_referrals");
+		lua_pushnil (L);
+		lua_rawset (L, copy);
+		if (lud->lud_dn != NULL && *lud->lud_dn != '\0') {
+			lua_pushliteral (L, "base");
+			lua_pushstring (L, lud->lud_dn);
+			lua_rawset (L, copy);
+		}
+		lua_pushliteral (L, "scope");
+		lua_rawget (L, copy);
+		scope = lud->lud_scope;
+		if (scope == LDAP_SCOPE_DEFAULT && lua_isstring (L, -1) && *lua_tostring (L, -1) == 'o')
+			scope = LDAP_SCOPE_BASE; /* the children of the referred entry */
+		lua_pop (L, 1);
+		if (scope != LDAP_SCOPE_DEFAULT) {
+			lua_pushliteral (L, "scope");
+			lua_pushstring (L, scope2string (scope));
+			lua_rawset (L, copy);
+		}
+		if (lud->lud_filter != NULL) {
+			lua_pushliteral (L, "filter");
+			lua_pushstring (L, lud->lud_filter);
+			lua_rawset (L, copy);
+		}
+		ldap_free_urldesc (lud);
+		if (lua_pcall (L, 2, 2, 0) == 0 && lua_isuserdata (L, -1)) {
+			if (search->chased == LUA_NOREF) {
+				lua_newtable (L);
+				search->chased = luaL_ref (L, LUA_REGISTRYINDEX);
+			}
+			lua_rawgeti (L, LUA_REGISTRYINDEX, search->chased);
+			lua_insert (L, -3);
+			lua_insert (L, -2); /* chased, search, iterator */
+			lua_rawset (L, -3);
+			lua_settop (L, top);
+			return 1;
+		}
+		lua_settop (L, params);
+	}
+	lua_settop (L, top);
+	return 0;
+}
+#endif
+
+
+/*
+** Retrieve next message...
+** @param #1 Optional number of seconds to wait for the next message (when
+**	it is not a number, as in a generic for, it blocks).
+** @return #1 entry's distinguished name.
+** @return #2 table with entry's attributes and values.
+*/
+static int next_message (lua_State *L) {
 	search_data *search = getsearch (L);
 	conn_data *conn;
-	struct timeval *timeout = NULL; /* ??? function parameter ??? */
-	LDAPMessage *res;
-	int rc;
-	int ret;
+	struct timeval st, *timeout = get_wait_arg (L, 1, &st);
+	int ret = -1;
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, search->conn);
+	conn = (conn_data *)lua_touserdata (L, -1); /* get connection */
+	luaL_argcheck (L, conn->ld, 1, LUALDAP_PREFIX"LDAP connection is closed");
+
+	while (ret < 0) {
+		LDAPMessage *msg;
+		if (search->done) { /* continuation searches pending */
+			if ((ret = next_chased (L, search, 1)) == 0)
+				search_close (L, search);
+			continue;
+		}
+		if (search->cur == NULL) {
+			const char *err;
+			if (search->chased != LUA_NOREF && (ret = next_chased (L, search, 0)) >= 0)
+				continue;
+			err = search_receive (conn, search, timeout);
+			if (err == result_timeout) /* the search can be resumed */
+				return faildirect (L, err);
+			if (err != NULL) {
+				if (conn->trace != LUA_NOREF && search->params != LUA_NOREF)
+					search_trace (L, conn, search, LDAP_SERVER_DOWN);
+				return faildirect (L, err);
+			}
+		}
+		msg = search->cur;
+		search->cur = ldap_next_message (conn->ld, msg);
+		switch (ldap_msgtype (msg)) {
+			case LDAP_RES_SEARCH_ENTRY: {
+				LDAPMessage *entry = ldap_first_entry (conn->ld, msg);
+				const char *errmsg;
+				int types = 0;
+				search->entries--;
+				search->count++;
+				if (search->typed) {
+					lua_rawgeti (L, LUA_REGISTRYINDEX, conn->types);
+					types = lua_gettop (L);
+				}
+				push_dn (L, conn->ld, entry, search->normalize);
+				lua_newtable (L);
+				errmsg = set_attribs (L, conn->ld, entry, lua_gettop (L), types,
+					(search->timeout.tv_sec > 0 || search->timeout.tv_usec > 0) ? &search->timeout : NULL);
+				if (errmsg != NULL)
+					return faildirect (L, errmsg);
+#ifdef LDAP_CONTROL_X_DEREF
+				if (search->deref)
+					set_deref (L, conn->ld, entry, lua_gettop (L), types);
+#endif
+				if (types)
+					lua_remove (L, types);
+				ret = 2; /* two return values */
+				break;
+			}
+/*No reference to LDAP_RES_SEARCH_REFERENCE on MSDN. Maybe there is a replacement to it?*/
+#ifdef LDAP_RES_SEARCH_REFERENCE
+			case LDAP_RES_SEARCH_REFERENCE: {
+				char **refs = NULL;
+				if (ldap_parse_reference (conn->ld, msg, &refs, NULL, 0) != LDAP_SUCCESS
+					|| refs == NULL || refs[0] == NULL) {
+					ldap_memvfree ((void **)refs);
+					break;
+				}
+#ifndef WINLDAP
+				if (search->chase != LUA_NOREF) {
+					int chased;
+					lua_rawgeti (L, LUA_REGISTRYINDEX, search->conn);
+					chased = chase_reference (L, search, lua_gettop (L), refs);
+					lua_pop (L, 1);
+					if (chased) {
+						ldap_memvfree ((void **)refs);
+						break;
+					}
+				}
+#endif
+				push_reference (L, refs);
+				ldap_memvfree ((void **)refs);
+				ret = 3; /* URL, nil and list of URLs */
+				break;
+			}
+#endif
+			case LDAP_RES_SEARCH_RESULT:
+				if (next_page (L, conn, search, msg))
+					break;
+				if (conn->trace != LUA_NOREF && search->params != LUA_NOREF) {
+					int err;
+					if (ldap_parse_result (conn->ld, msg, &err, NULL, NULL, NULL, NULL, 0) != LDAP_SUCCESS)
+						err = LDAP_DECODING_ERROR;
+					search_trace (L, conn, search, err);
+				}
+				if (search->chased != LUA_NOREF) {
+					/* return the entries of the continuation searches */
+					search_release (search);
+					search->done = 1;
+					break;
+				}
+				/* last message => nil */
+				/* close search object to avoid reuse */
+				search_close (L, search);
+				ret = 0;
+				break;
+			default:
+				return luaL_error (L, LUALDAP_PREFIX"error on search result chain");
+		}
+	}
+	return ret;
+}
+
+
+/*
+** Close the search object.
+*/
+static int lualdap_search_close (lua_State *L) {
+	search_data *search = (search_data *)luaL_checkudata (L, 1, LUALDAP_SEARCH_METATABLE);
+	luaL_argcheck (L, search!=NULL, 1, LUALDAP_PREFIX"LDAP search expected");
+	if (search->conn == LUA_NOREF)
+		return 0;
+	search_close (L, search);
+	lua_pushnumber (L, 1);
+	return 1;
+}
+
+
+/*
+** Get the amount of search results buffered.
+** @param #1 Search object.
+** @return #1 Number of entries received and not yet consumed.
+** @return #2 Size of these entries (in bytes).
+*/
+static int lualdap_search_buffered (lua_State *L) {
+	search_data *search = (search_data *)luaL_checkudata (L, 1, LUALDAP_SEARCH_METATABLE);
+	double bytes = 0;
+	luaL_argcheck (L, search!=NULL, 1, LUALDAP_PREFIX"LDAP search expected");
+	if (search->conn != LUA_NOREF && search->cur != NULL) {
+		conn_data *conn;
+		LDAPMessage *msg;
+		lua_rawgeti (L, LUA_REGISTRYINDEX, search->conn);
+		conn = (conn_data *)lua_touserdata (L, -1);
+		lua_pop (L, 1);
+		if (conn->ld != NULL)
+			for (msg = search->cur; msg != NULL; msg = ldap_next_message (conn->ld, msg))
+				bytes += message_size (conn->ld, msg);
+	}
+	lua_pushnumber (L, search->entries);
+	lua_pushnumber (L, bytes);
+	return 2;
+}
+
+
+/*
+** Create a search object and leaves it on top of the stack.
+*/
+static search_data *create_search (lua_State *L, int conn_index, int msgid) {
+	search_data *search = (search_data *)lua_newuserdata (L, sizeof (search_data));
+	lualdap_setmeta (L, LUALDAP_SEARCH_METATABLE);
+	search->conn = LUA_NOREF;
+	search->msgid = msgid;
+	search->typed = 0;
+	search->normalize = 0;
+	search->deref = 0;
+	search->params = LUA_NOREF;
+	search->paged = 0;
+	search->chase = search->chased = LUA_NOREF;
+	search->done = 0;
+	search->begin = 0;
+	search->ended = 0;
+	search->reported = 0;
+	search->count = 0;
+	search->total = 0;
+	search->res = search->cur = NULL;
+	search->entries = search->largest = 0;
+	search->max_entries = search->max_bytes = 0;
+	search->cookie.bv_val = NULL;
+	search->cookie.bv_len = 0;
+	search->timeout.tv_sec = 0;
+	search->timeout.tv_usec = 0;
+	search->start = lualdap_now ();
+	lua_pushvalue (L, conn_index);
+	search->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	return search;
+}
+
+
+#ifndef WINLDAP
+/*
+** Get the type of the values of the given syntax.
+*/
+static int syntax2type (const char *oid) {
+	if (oid == NULL)
+		return LUALDAP_TYPE_STRING;
+	else if (strcmp (oid, "1.3.6.1.4.1.1466.115.121.1.27") == 0 /* Integer */
+		|| strcmp (oid, "1.2.840.113556.1.4.906") == 0) /* AD Large Integer */
+		return LUALDAP_TYPE_INTEGER;
+	else if (strcmp (oid, "1.3.6.1.4.1.1466.115.121.1.7") == 0) /* Boolean */
+		return LUALDAP_TYPE_BOOLEAN;
+	else if (strcmp (oid, "1.3.6.1.4.1.1466.115.121.1.24") == 0) /* GeneralizedTime */
+		return LUALDAP_TYPE_TIME;
+	else
+		return LUALDAP_TYPE_STRING;
+}
+
+
+/*
+** Store the description of an attribute type (on top of the stack) at the
+** given table under each of its names and its OID, in lower case.
+*/
+static void set_attrtype (lua_State *L, LDAPAttributeType *at, int tab) {
+	char **name;
+	for (name = at->at_names; name != NULL && *name != NULL; name++) {
+		push_lower (L, *name);
+		lua_pushvalue (L, -2);
+		lua_rawset (L, tab);
+	}
+	lua_pushstring (L, at->at_oid);
+	lua_pushvalue (L, -2);
+	lua_rawset (L, tab);
+	lua_pop (L, 1);
+}
+
+
+/*
+** Parse the attribute types of the subschema subentry.
+** Syntaxes inherited from superior types are resolved.
+** @param tab Absolute stack index of the table of attribute types.
+** @param types Absolute stack index of the table of values' types.
+*/
+static void parse_attrtypes (lua_State *L, LDAP *ld, LDAPMessage *entry, int tab, int types) {
+	BerValue **vals = ldap_get_values_len (ld, entry, "attributeTypes");
+	int i, n = ldap_count_values_len (vals);
+
+	for (i = 0; i < n; i++) {
+		int code;
+		const char *errp;
+		LDAPAttributeType *at = ldap_str2attributetype (vals[i]->bv_val, &code,
+			&errp, LDAP_SCHEMA_ALLOW_ALL);
+		if (at == NULL)
+			continue;
+		lua_newtable (L);
+		lua_pushliteral (L, "oid");
+		lua_pushstring (L, at->at_oid);
+		lua_rawset (L, -3);
+		if (at->at_names != NULL && at->at_names[0] != NULL) {
+			lua_pushliteral (L, "name");
+			lua_pushstring (L, at->at_names[0]);
+			lua_rawset (L, -3);
+		}
+		if (at->at_syntax_oid != NULL) {
+			lua_pushliteral (L, "syntax");
+			lua_pushstring (L, at->at_syntax_oid);
+			lua_rawset (L, -3);
+		}
+		if (at->at_sup_oid != NULL) {
+			lua_pushliteral (L, "sup");
+			lua_pushstring (L, at->at_sup_oid);
+			lua_rawset (L, -3);
+		}
+		lua_pushliteral (L, "single_value");
+		lua_pushboolean (L, at->at_single_value);
+		lua_rawset (L, -3);
+		set_attrtype (L, at, tab);
+		ldap_attributetype_free (at);
+	}
+	ldap_value_free_len (vals);
+
+	/* resolve syntaxes and build the table of values' types */
+	lua_pushnil (L);
+	while (lua_next (L, tab) != 0) {
+		int depth, type;
+		const char *syntax = NULL;
+		lua_pushvalue (L, -1);
+		for (depth = 0; depth < LUALDAP_MAX_SUP && lua_istable (L, -1); depth++) {
+			lua_pushliteral (L, "syntax");
+			lua_rawget (L, -2);
+			if (lua_isstring (L, -1)) {
+				syntax = lua_tostring (L, -1);
+				lua_pop (L, 1);
+				break;
+			}
+			lua_pop (L, 1);
+			/* follow superior type */
+			lua_pushliteral (L, "sup");
+			lua_rawget (L, -2);
+			if (lua_isstring (L, -1)) {
+				push_lower (L, lua_tostring (L, -1));
+				lua_rawget (L, tab);
+				lua_remove (L, -2);
+			}
+			lua_remove (L, -2);
+		}
+		if (syntax != NULL) {
+			lua_pushliteral (L, "syntax");
+			lua_pushstring (L, syntax);
+			lua_rawset (L, -4);
+		}
+		lua_pop (L, 1);
+		type = syntax2type (syntax);
+		lua_pushliteral (L, "single_value");
+		lua_rawget (L, -2);
+		if (lua_toboolean (L, -1))
+			type |= LUALDAP_TYPE_SINGLE;
+		lua_pop (L, 2);
+		lua_pushvalue (L, -1);
+		lua_pushnumber (L, type);
+		lua_rawset (L, types);
+	}
+}
+#endif
+
+
+/*
+** Fetch the root DSE and the subschema subentry and cache them on the
+** connection.  Nothing is done if the schema is already cached.
+** @return NULL in case of success or an error message.
+*/
+static const char *schema_load (lua_State *L, conn_data *conn) {
+#ifdef WINLDAP
+	(void)L; (void)conn;
+	return LUALDAP_PREFIX"schema is not supported with WinLDAP";
+#else
+	char *all[3];
+	char *subschema[2];
+	LDAPMessage *res, *entry;
+	const char *err;
+	char *dn;
+	int rc, schema, tab, types;
+
+	if (conn->schema != LUA_NOREF)
+		return NULL;
+	all[0] = (char *)"*";
+	all[1] = (char *)"+";
+	all[2] = NULL;
+	subschema[0] = (char *)"attributeTypes";
+	subschema[1] = NULL;
+	lua_newtable (L);
+	schema = lua_gettop (L);
+	/* root DSE */
+	rc = ldap_search_ext_s (conn->ld, "", LDAP_SCOPE_BASE, "(objectClass=*)",
+		all, 0, NULL, NULL, NULL, LDAP_NO_LIMIT, &res);
+	conn_account (conn, 0, rc);
+	if (rc != LDAP_SUCCESS) {
+		ldap_msgfree (res);
+		lua_pop (L, 1);
+		return ldap_err2string (rc);
+	}
+	entry = ldap_first_entry (conn->ld, res);
+	lua_pushliteral (L, "rootdse");
+	lua_newtable (L);
+	if (entry != NULL && (err = set_attribs (L, conn->ld, entry, lua_gettop (L), 0, NULL)) != NULL) {
+		ldap_msgfree (res);
+		lua_pop (L, 3);
+		return err;
+	}
+	lua_rawset (L, schema);
+	ldap_msgfree (res);
+	/* subschema subentry */
+	lua_pushliteral (L, "rootdse");
+	lua_rawget (L, schema);
+	lua_pushliteral (L, "subschemaSubentry");
+	lua_rawget (L, -2);
+	lua_remove (L, -2);
+	dn = (char *)lua_tostring (L, -1);
+	if (dn == NULL) { /* assume the default location */
+		lua_pop (L, 1);
+		lua_pushliteral (L, "cn=Subschema");
+		dn = (char *)lua_tostring (L, -1);
+	}
+	rc = ldap_search_ext_s (conn->ld, dn, LDAP_SCOPE_BASE,
+		"(objectClass=subschema)", subschema, 0, NULL, NULL, NULL,
+		LDAP_NO_LIMIT, &res);
+	conn_account (conn, 0, rc);
+	if (rc != LDAP_SUCCESS) {
+		ldap_msgfree (res);
+		lua_pop (L, 2);
+		return ldap_err2string (rc);
+	}
+	lua_pushliteral (L, "subschemasubentry");
+	lua_insert (L, -2);
+	lua_rawset (L, schema);
+	lua_pushliteral (L, "attributetypes");
+	lua_newtable (L);
+	tab = lua_gettop (L);
+	lua_newtable (L);
+	types = lua_gettop (L);
+	entry = ldap_first_entry (conn->ld, res);
+	if (entry != NULL)
+		parse_attrtypes (L, conn->ld, entry, tab, types);
+	ldap_msgfree (res);
+	conn->types = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_rawset (L, schema);
+	conn->schema = luaL_ref (L, LUA_REGISTRYINDEX);
+	return NULL;
+#endif
+}
+
+
+/*
+** Get the schema of the directory.
+** The root DSE and the subschema subentry are fetched once per connection.
+** @param #1 LDAP connection.
+** @return Table with fields rootdse (table of attributes of the root DSE),
+**	subschemasubentry (DN of the subschema subentry) and attributetypes
+**	(table of attribute types indexed by lower case names and OIDs).
+*/
+static int lualdap_schema (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	const char *err = schema_load (L, conn);
+	if (err != NULL)
+		return faildirect (L, err);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->schema);
+	return 1;
+}
+
+
+/*
+** Perform a search operation.
+** @return #1 Function to iterate over the result entries.
+** @return #2 Search object.
+** @return #3 nil as first entry.
+** The search result is defined as an upvalue of the iterator.
+*/
+static int lualdap_search (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	int rc, typed, normalize, deref, chase, udata;
+	long max_entries, max_bytes;
+	search_data *search;
+
+	if (!lua_istable (L, 2))
+		return luaL_error (L, LUALDAP_PREFIX"no search specification");
+	/* get other parameters */
+	typed = booltabparam (L, "typed", 0);
+	if (typed) {
+		const char *err = schema_load (L, conn);
+		if (err != NULL)
+			return luaL_error (L, LUALDAP_PREFIX"%s", err);
+	}
+	normalize = booltabparam (L, "normalizedn", 0);
+#ifdef WINLDAP
+	if (normalize)
+		return luaL_error (L, LUALDAP_PREFIX"DN normalization is not supported with WinLDAP");
+#endif
+	strgettable (L, "deref");
+	deref = !lua_isnil (L, -1);
+#ifndef LDAP_CONTROL_X_DEREF
+	if (deref)
+		return luaL_error (L, LUALDAP_PREFIX"dereference control is not supported");
+#endif
+	strgettable (L, "chase_referrals");
+	if (!lua_isnil (L, -1) && !lua_isboolean (L, -1) && !lua_istable (L, -1))
+		return option_error (L, "chase_referrals", "boolean or table");
+	chase = lua_toboolean (L, -1);
+#ifdef WINLDAP
+	if (chase)
+		return luaL_error (L, LUALDAP_PREFIX"referral chasing is not supported with WinLDAP");
+#endif
+	check_controls (L);
+	max_entries = longtabparam (L, "max_buffered_entries", 0);
+	max_bytes = longtabparam (L, "max_buffered_bytes", 0);
+#ifdef WINLDAP
+	if (max_entries > 0 || max_bytes > 0)
+		return luaL_error (L, LUALDAP_PREFIX"bounded buffering is not supported with WinLDAP");
+#endif
+
+	search = create_search (L, 1, 0);
+	udata = lua_gettop (L);
+	search->typed = typed;
+	search->normalize = normalize;
+	search->deref = deref;
+	if (max_entries > 0 || max_bytes > 0) {
+		search->max_entries = (max_entries > 0) ? max_entries : 0;
+		search->max_bytes = (max_bytes > 0) ? max_bytes : 0;
+		search->paged = 1;
+	}
+	if (chase) {
+		strgettable (L, "chase_referrals");
+		search->chase = luaL_ref (L, LUA_REGISTRYINDEX);
+		chase_begin (conn);
+	}
+	if (search->paged || search->chase != LUA_NOREF || conn->trace != LUA_NOREF) {
+		lua_pushvalue (L, 2);
+		search->params = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	rc = search_send (L, conn, search);
+	if (rc != LDAP_SUCCESS) {
+		search_close (L, search);
+		return luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (rc));
+	}
+
+	lua_pushvalue (L, udata);
+	lua_pushcclosure (L, next_message, 1);
+	lua_pushvalue (L, udata);
+	return 2;
+}
+
+
+/*
+** Compare an attribute description with a string ignoring case.
+*/
+static int namecaseeq (BerValue *name, const char *s) {
+	ber_len_t i;
+	for (i = 0; i < name->bv_len; i++)
+		if (s[i] == '\0' || tolower ((unsigned char)name->bv_val[i]) != tolower ((unsigned char)s[i]))
+			return 0;
+	return s[i] == '\0';
+}
+
+
+/*
+** Check if an attribute description returned without its range option
+** is the requested one, whose own range option is ignored.
+*/
+static int requested_eq (BerValue *name, const char *req) {
+	long high;
+	size_t len = range_option (req, &high);
+	ber_len_t i;
+	if (len == 0)
+		return namecaseeq (name, req);
+	if (name->bv_len != len)
+		return 0;
+	for (i = 0; i < len; i++)
+		if (tolower ((unsigned char)name->bv_val[i]) != tolower ((unsigned char)req[i]))
+			return 0;
+	return 1;
+}
+
+
+/*
+** Store the DN and the values of the requested attributes of an entry at
+** the given row of the columns.  Missing attributes are stored as false.
+** Attributes retrieved by ranges are completed as by set_attribs.
+** @param attrs NULL-terminated array of requested attributes.
+** @param cols Absolute stack index of the DN column; the columns of the
+**	attributes follow it, in the order of attrs.
+** @param types Absolute stack index of the table of types (0 if values
+**	should not be decoded).
+** @param timeout Time limit of the follow-up requests (NULL if none).
+** @return NULL in case of success or an error message (when the remaining
+**	values of a ranged attribute could not be retrieved).
+*/
+static const char *set_row (lua_State *L, LDAP *ld, LDAPMessage *entry, char *attrs[], int cols, int row, int types, struct timeval *timeout) {
+	char seen[LUALDAP_MAX_ATTRS];
+	BerElement *ber;
+	BerValue attr, *vals;
+	const char *err = NULL;
+	int j, ok;
+
+	for (j = 0; attrs[j] != NULL; j++)
+		seen[j] = 0;
+	push_dn (L, ld, entry, 0);
+	lua_rawseti (L, cols, row);
+	for (ok = attr_first (ld, entry, &ber, &attr, &vals);
+		ok;
+		ok = attr_next (ld, entry, &ber, &attr, &vals))
+	{
+		BerValue name = attr;
+		long high = 0;
+		size_t len;
+		lua_pushlstring (L, attr.bv_val, attr.bv_len);
+		len = range_option (lua_tostring (L, -1), &high);
+		if (len > 0) {
+			name.bv_len = len;
+			lua_pushlstring (L, attr.bv_val, len);
+			lua_replace (L, -2);
+		}
+		for (j = 0; attrs[j] != NULL; j++)
+			if (!seen[j] && requested_eq (&name, attrs[j])) {
+				if (len > 0)
+					err = push_ranges (L, ld, entry, lua_tostring (L, -1), high, vals,
+						attr_type (L, types, attrs[j]), timeout);
+				else
+					push_values (L, vals, attr_type (L, types, attrs[j]));
+				if (err != NULL)
+					lua_pop (L, 1);
+				else
+					lua_rawseti (L, cols + 1 + j, row);
+				seen[j] = 1;
+				break;
+			}
+		lua_pop (L, 1);
+		attr_release (&attr, vals);
+		if (err != NULL)
+			break;
+	}
+	ber_free (ber, 0);
+	for (j = 0; err == NULL && attrs[j] != NULL; j++)
+		if (!seen[j]) {
+			lua_pushboolean (L, 0);
+			lua_rawseti (L, cols + 1 + j, row);
+		}
+	return err;
+}
+
+
+/*
+** Perform a search operation collecting the result in columns.
+** The messages are retrieved in batches (all the messages already
+** received at each call to ldap_result).
+** @param #2 Table with the same parameters of search; attrs is mandatory.
+** @return #1 Table with one array per requested attribute, indexed by the
+**	attribute name, plus an array of DNs, indexed by `dn'.
+** @return #2 Number of entries.
+*/
+static int lualdap_search_columns (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t base;
+	ldap_pchar_t filter;
+	char *attrs[LUALDAP_MAX_ATTRS];
+	LDAPControl *ctrls[2];
+	int scope, msgid, rc, sizelimit, cols, j, n, types = 0, rows = 0, done = 0;
+	int err = LDAP_SUCCESS;
+	struct timeval st, *timeout;
+	double start, begin, ended = 0, bytes = 0;
+
+	if (!lua_istable (L, 2))
+		return luaL_error (L, LUALDAP_PREFIX"no search specification");
+	if (!get_attrs_param (L, attrs))
+		return 2;
+	if (attrs[0] == NULL)
+		return luaL_error (L, LUALDAP_PREFIX"no attributes requested");
+	/* get other parameters */
+	if (booltabparam (L, "typed", 0)) {
+		const char *msg = schema_load (L, conn);
+		if (msg != NULL)
+			return luaL_error (L, LUALDAP_PREFIX"%s", msg);
+		lua_rawgeti (L, LUA_REGISTRYINDEX, conn->types);
+		types = lua_gettop (L);
+	}
+	base = (ldap_pchar_t) strtabparam (L, "base", NULL);
+	filter = (ldap_pchar_t) strtabparam (L, "filter", NULL);
+	scope = string2scope (L, strtabparam (L, "scope", NULL));
+	sizelimit = longtabparam (L, "sizelimit", LDAP_NO_LIMIT);
+	timeout = get_timeout_param (L, &st);
+	check_controls (L);
+	ctrls[0] = ctrls[1] = NULL;
+#ifdef LDAP_CONTROL_VALUESRETURNFILTER
+	rc = matched_values_control (L, &ctrls[0]);
+	if (rc != LDAP_SUCCESS)
+		return luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (rc));
+#endif
+
+	start = begin = lualdap_now ();
+	rc = ldap_search_ext (conn->ld, base, scope, filter, attrs, 0,
+		(ctrls[0] != NULL) ? ctrls : NULL, NULL, timeout, sizelimit, &msgid);
+	if (ctrls[0] != NULL)
+		ldap_control_free (ctrls[0]);
+	if (rc != LDAP_SUCCESS) {
+		conn_account (conn, 0, rc);
+		return luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (rc));
+	}
+
+	/* create the DN column and one column per attribute */
+	for (n = 0; attrs[n] != NULL; n++)
+		;
+	luaL_checkstack (L, n + 4, LUALDAP_PREFIX"too many attributes");
+	cols = lua_gettop (L) + 1;
+	for (j = 0; j <= n; j++)
+		lua_newtable (L);
+
+	while (!done) {
+		LDAPMessage *res, *msg;
+		double arrived;
+		rc = conn_result (conn, msgid, LDAP_MSG_RECEIVED, NULL, &res, &arrived);
+		if (rc == 0)
+			return faildirect (L, result_timeout);
+		else if (rc == -1) {
+			conn_account (conn, 0, LDAP_SERVER_DOWN);
+			return faildirect (L, LUALDAP_PREFIX"result error");
+		}
+		/* the first reply measures the server's latency */
+		conn_account (conn, start, LDAP_SUCCESS);
+		start = 0;
+		for (msg = ldap_first_message (conn->ld, res);
+			msg != NULL;
+			msg = ldap_next_message (conn->ld, msg))
+		{
+			switch (ldap_msgtype (msg)) {
+				case LDAP_RES_SEARCH_ENTRY: {
+					const char *errmsg = set_row (L, conn->ld, msg, attrs, cols, ++rows, types, timeout);
+					if (errmsg != NULL) {
+						ldap_msgfree (res);
+						ldap_abandon_ext (conn->ld, msgid, NULL, NULL);
+						return faildirect (L, errmsg);
+					}
+					if (conn->trace != LUA_NOREF)
+						bytes += message_size (conn->ld, msg);
+					break;
+				}
+				case LDAP_RES_SEARCH_RESULT:
+					if (ldap_parse_result (conn->ld, msg, &err, NULL, NULL,
+						NULL, NULL, 0) != LDAP_SUCCESS)
+						err = LDAP_DECODING_ERROR;
+					ended = arrived;
+					done = 1;
+					break;
+			}
+		}
+		ldap_msgfree (res);
+	}
+	if (conn->trace != LUA_NOREF) {
+		trace_info t;
+		t.op = "search";
+		t.dn = 0;
+		t.params = 2;
+		t.msgid = msgid;
+		t.rc = err;
+		t.entries = rows;
+		t.bytes = bytes;
+		t.start = begin;
+		t.end = ended;
+		trace_call (L, conn, &t);
+	}
+	if (err != LDAP_SUCCESS && err != LDAP_SIZELIMIT_EXCEEDED)
+		return faildirect (L, ldap_err2string (err));
+
+	/* result table */
+	lua_newtable (L);
+	lua_pushliteral (L, "dn");
+	lua_pushvalue (L, cols);
+	lua_rawset (L, -3);
+	for (j = 0; attrs[j] != NULL; j++) {
+		lua_pushstring (L, attrs[j]);
+		lua_pushvalue (L, cols + 1 + j);
+		lua_rawset (L, -3);
+	}
+	lua_pushnumber (L, rows);
+	return 2;
+}
+
+
+#ifndef WINLDAP
+/*
+** Snapshots are files with the entries of a subtree and hash indexes on
+** some of their attributes, which are mapped in memory and looked up
+** without being parsed.  Numbers are 32-bit little-endian integers (so
+** files are limited to 4GB) and strings are stored as their length
+** followed by their bytes.  The file is made of:
+**	header: magic, number of entries, offset of the directory, number of
+**		indexes and offset of their descriptions;
+**	records: normalized DN, DN, number of attributes and, for each one,
+**		its name, number of values and values;
+**	directory: offsets of the records, sorted by normalized DN;
+**	names of the indexed attributes;
+**	slots of each index: hash of a value and offset of the record with
+**		it (0 if the slot is empty), with linear probing;
+**	descriptions of the indexes: offset of the name, number of slots (a
+**		power of two) and offset of the slots.
+*/
+#define LUALDAP_SNAPSHOT_MAGIC  "LuaLDAP\001"
+#define LUALDAP_SNAPSHOT_HEADER 24
+#define LUALDAP_SNAPSHOT_MAX    0xFFFFFFFFUL
+
+
+/* Buffer of bytes to be written */
+typedef struct {
+	unsigned char *p;
+	size_t         len;
+	size_t         size;
+} snap_buf;
+
+
+/* Entry of the directory being built */
+typedef struct {
+	char          *ndn; /* normalized DN (to be released with ldap_memfree) */
+	unsigned long  off; /* offset of the record */
+} snap_dir;
+
+
+/* Slot of an index being built */
+typedef struct {
+	unsigned long  hash;
+	unsigned long  off;
+} snap_slot;
+
+
+/* Snapshot being written */
+typedef struct {
+	FILE          *fp;
+	unsigned long  off;     /* size written */
+	snap_buf       buf;
+	snap_dir      *dir;
+	long           n;       /* number of entries */
+	long           ndir;    /* size of dir */
+	int            nindex;
+	char          *index[LUALDAP_MAX_INDEXES + 1];
+	snap_slot     *slots[LUALDAP_MAX_INDEXES];
+	long           nslots[LUALDAP_MAX_INDEXES];
+	long           sizes[LUALDAP_MAX_INDEXES];
+} snap_writer;
+
+
+static void put_u32 (unsigned char *p, unsigned long v) {
+	p[0] = (unsigned char)(v & 0xFF);
+	p[1] = (unsigned char)((v >> 8) & 0xFF);
+	p[2] = (unsigned char)((v >> 16) & 0xFF);
+	p[3] = (unsigned char)((v >> 24) & 0xFF);
+}
+
+
+static unsigned long get_u32 (const unsigned char *p) {
+	return (unsigned long)p[0] | ((unsigned long)p[1] << 8)
+		| ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+
+/*
+** Hash of an indexed value (FNV-1a), ignoring case.
+*/
+static unsigned long snap_hash (const char *s, size_t len) {
+	unsigned long h = 2166136261UL;
+	size_t i;
+	for (i = 0; i < len; i++)
+		h = ((h ^ (unsigned char)tolower ((unsigned char)s[i])) * 16777619UL) & 0xFFFFFFFFUL;
+	return h;
+}
+
+
+/*
+** Append bytes to a buffer.
+** @return 1 in case of success; 0 if out of memory.
+*/
+static int buf_put (snap_buf *b, const void *p, size_t len) {
+	if (b->len + len > b->size) {
+		size_t size = (b->size > 0) ? 2 * b->size : 4096;
+		unsigned char *q;
+		while (size < b->len + len)
+			size *= 2;
+		q = (unsigned char *)realloc (b->p, size);
+		if (q == NULL)
+			return 0;
+		b->p = q;
+		b->size = size;
+	}
+	memcpy (b->p + b->len, p, len);
+	b->len += len;
+	return 1;
+}
+
+
+static int buf_u32 (snap_buf *b, unsigned long v) {
+	unsigned char p[4];
+	put_u32 (p, v);
+	return buf_put (b, p, 4);
+}
+
+
+static int buf_str (snap_buf *b, const char *s, size_t len) {
+	return buf_u32 (b, (unsigned long)len) && buf_put (b, s, len);
+}
+
+
+/*
+** Write the buffer to the file and empty it.
+** @return NULL in case of success or an error message.
+*/
+static const char *snap_flush (snap_writer *w) {
+	if (w->buf.len > LUALDAP_SNAPSHOT_MAX - w->off)
+		return LUALDAP_PREFIX"snapshot too large";
+	if (w->buf.len > 0 && fwrite (w->buf.p, 1, w->buf.len, w->fp) != w->buf.len)
+		return LUALDAP_PREFIX"error writing snapshot file";
+	w->off += (unsigned long)w->buf.len;
+	w->buf.len = 0;
+	return NULL;
+}
+
+
+/*
+** Add a value of an entry to an index, unless the entry already has a
+** value with the same hash.
+** @return 1 in case of success; 0 if out of memory.
+*/
+static int snap_index (snap_writer *w, int i, unsigned long hash, unsigned long off) {
+	long k;
+	for (k = w->nslots[i] - 1; k >= 0 && w->slots[i][k].off == off; k--)
+		if (w->slots[i][k].hash == hash)
+			return 1;
+	if (w->nslots[i] == w->sizes[i]) {
+		long size = (w->sizes[i] > 0) ? 2 * w->sizes[i] : 1024;
+		snap_slot *slots = (snap_slot *)realloc (w->slots[i], size * sizeof (snap_slot));
+		if (slots == NULL)
+			return 0;
+		w->slots[i] = slots;
+		w->sizes[i] = size;
+	}
+	w->slots[i][w->nslots[i]].hash = hash;
+	w->slots[i][w->nslots[i]].off = off;
+	w->nslots[i]++;
+	return 1;
+}
+
+
+/*
+** Append the attributes of an entry to a buffer: their number and, for
+** each one, its name, number of values and values.  The values of the
+** indexed attributes of a snapshot are added to its indexes.
+** @param w Snapshot being written (NULL if none).
+** @return 1 in case of success; 0 if out of memory.
+*/
+static int buf_attrs (snap_buf *b, LDAP *ld, LDAPMessage *entry, snap_writer *w) {
+	BerElement *ber;
+	BerValue attr, *vals;
+	size_t pos = b->len;
+	unsigned long nattrs = 0;
+	int ok, mem = buf_u32 (b, 0);
+	for (ok = attr_first (ld, entry, &ber, &attr, &vals);
+		ok;
+		ok = attr_next (ld, entry, &ber, &attr, &vals))
+	{
+		int i, j, n = count_values (vals);
+		mem = mem && buf_str (b, attr.bv_val, attr.bv_len)
+			&& buf_u32 (b, (unsigned long)n);
+		for (j = 0; j < n; j++)
+			mem = mem && buf_str (b, vals[j].bv_val, vals[j].bv_len);
+		if (w != NULL)
+			for (i = 0; i < w->nindex; i++)
+				if (namecaseeq (&attr, w->index[i]))
+					for (j = 0; j < n; j++)
+						mem = mem && snap_index (w, i, snap_hash (vals[j].bv_val, vals[j].bv_len), w->off);
+		nattrs++;
+		attr_release (&attr, vals);
+	}
+	ber_free (ber, 0);
+	if (mem)
+		put_u32 (b->p + pos, nattrs);
+	return mem;
+}
+
+
+/*
+** Write the record of an entry.
+** @return NULL in case of success or an error message.
+*/
+static const char *snap_entry (snap_writer *w, LDAP *ld, LDAPMessage *entry) {
+	char *dn = ldap_get_dn (ld, entry), *ndn;
+	int mem;
+
+	ndn = (dn != NULL) ? dn_normalize (dn) : NULL;
+	if (ndn == NULL) {
+		ldap_memfree (dn);
+		return LUALDAP_PREFIX"invalid DN on search result";
+	}
+	if (w->n == w->ndir) {
+		long size = (w->ndir > 0) ? 2 * w->ndir : 1024;
+		snap_dir *d = (snap_dir *)realloc (w->dir, size * sizeof (snap_dir));
+		if (d == NULL) {
+			ldap_memfree (dn);
+			ldap_memfree (ndn);
+			return LUALDAP_PREFIX"out of memory";
+		}
+		w->dir = d;
+		w->ndir = size;
+	}
+	w->dir[w->n].ndn = ndn;
+	w->dir[w->n].off = w->off;
+	w->n++;
+	mem = buf_str (&w->buf, ndn, strlen (ndn)) && buf_str (&w->buf, dn, strlen (dn));
+	ldap_memfree (dn);
+	if (!mem || !buf_attrs (&w->buf, ld, entry, w))
+		return LUALDAP_PREFIX"out of memory";
+	return snap_flush (w);
+}
+
+
+static int snap_dircmp (const void *a, const void *b) {
+	return strcmp (((const snap_dir *)a)->ndn, ((const snap_dir *)b)->ndn);
+}
+
+
+/*
+** Write the directory, the indexes and the header of the snapshot.
+** @return NULL in case of success or an error message.
+*/
+static const char *snap_finish (snap_writer *w) {
+	unsigned long dir, names[LUALDAP_MAX_INDEXES], offs[LUALDAP_MAX_INDEXES];
+	unsigned long counts[LUALDAP_MAX_INDEXES], indexes;
+	unsigned char header[LUALDAP_SNAPSHOT_HEADER];
+	const char *err;
+	long k;
+	int i;
+
+	qsort (w->dir, (size_t)w->n, sizeof (snap_dir), snap_dircmp);
+	dir = w->off;
+	for (k = 0; k < w->n; k++)
+		if (!buf_u32 (&w->buf, w->dir[k].off))
+			return LUALDAP_PREFIX"out of memory";
+	for (i = 0; i < w->nindex; i++) {
+		names[i] = w->off + (unsigned long)w->buf.len;
+		if (!buf_str (&w->buf, w->index[i], strlen (w->index[i])))
+			return LUALDAP_PREFIX"out of memory";
+	}
+	if ((err = snap_flush (w)) != NULL)
+		return err;
+	for (i = 0; i < w->nindex; i++) {
+		unsigned long n = 2, mask;
+		unsigned char *slots;
+		while (n < 2 * (unsigned long)w->nslots[i])
+			n *= 2;
+		mask = n - 1;
+		slots = (unsigned char *)calloc (n, 8);
+		if (slots == NULL)
+			return LUALDAP_PREFIX"out of memory";
+		for (k = 0; k < w->nslots[i]; k++) {
+			unsigned long j = w->slots[i][k].hash & mask;
+			while (get_u32 (slots + 8 * j + 4) != 0)
+				j = (j + 1) & mask;
+			put_u32 (slots + 8 * j, w->slots[i][k].hash);
+			put_u32 (slots + 8 * j + 4, w->slots[i][k].off);
+		}
+		offs[i] = w->off;
+		counts[i] = n;
+		w->buf.len = 0;
+		if (!buf_put (&w->buf, slots, 8 * n))
+			err = LUALDAP_PREFIX"out of memory";
+		free (slots);
+		if (err != NULL || (err = snap_flush (w)) != NULL)
+			return err;
+	}
+	indexes = w->off;
+	for (i = 0; i < w->nindex; i++)
+		if (!buf_u32 (&w->buf, names[i]) || !buf_u32 (&w->buf, counts[i])
+			|| !buf_u32 (&w->buf, offs[i]))
+			return LUALDAP_PREFIX"out of memory";
+	if ((err = snap_flush (w)) != NULL)
+		return err;
+	memcpy (header, LUALDAP_SNAPSHOT_MAGIC, 8);
+	put_u32 (header + 8, (unsigned long)w->n);
+	put_u32 (header + 12, dir);
+	put_u32 (header + 16, (unsigned long)w->nindex);
+	put_u32 (header + 20, indexes);
+	if (fseek (w->fp, 0, SEEK_SET) != 0
+		|| fwrite (header, 1, sizeof (header), w->fp) != sizeof (header))
+		return LUALDAP_PREFIX"error writing snapshot file";
+	return NULL;
+}
+
+
+/*
+** Write the entries of a search to a snapshot.
+** Entries are written as they arrive; only their normalized DNs and the
+** hashes of their indexed values are kept in memory.
+** @return NULL in case of success or an error message.
+*/
+static const char *snap_write (snap_writer *w, LDAP *ld, int msgid) {
+	unsigned char header[LUALDAP_SNAPSHOT_HEADER];
+	const char *err = NULL;
+	int done = 0;
+
+	memset (header, 0, sizeof (header));
+	if (fwrite (header, 1, sizeof (header), w->fp) != sizeof (header))
+		return LUALDAP_PREFIX"error writing snapshot file";
+	w->off = sizeof (header);
+	while (!done) {
+		LDAPMessage *res;
+		if (ldap_result (ld, msgid, LDAP_MSG_ONE, NULL, &res) == -1)
+			return LUALDAP_PREFIX"result error";
+		switch (ldap_msgtype (res)) {
+			case LDAP_RES_SEARCH_ENTRY:
+				err = snap_entry (w, ld, ldap_first_entry (ld, res));
+				break;
+			case LDAP_RES_SEARCH_RESULT: {
+				int rc;
+				if (ldap_parse_result (ld, res, &rc, NULL, NULL, NULL, NULL, 0) != LDAP_SUCCESS)
+					rc = LDAP_DECODING_ERROR;
+				if (rc != LDAP_SUCCESS)
+					err = ldap_err2string (rc);
+				done = 1;
+				break;
+			}
+			default: /* references are not followed */
+				break;
+		}
+		ldap_msgfree (res);
+		if (err != NULL) {
+			if (!done)
+				ldap_abandon_ext (ld, msgid, NULL, NULL);
+			return err;
+		}
+	}
+	return snap_finish (w);
+}
+
+
+/*
+** Release the memory used to write a snapshot and close its file.
+** @return 1 in case of success; 0 if the file could not be closed.
+*/
+static int snap_release (snap_writer *w) {
+	long k;
+	int i, ok = 1;
+	if (w->fp != NULL)
+		ok = (fclose (w->fp) == 0);
+	for (k = 0; k < w->n; k++)
+		ldap_memfree (w->dir[k].ndn);
+	free (w->dir);
+	free (w->buf.p);
+	for (i = 0; i < w->nindex; i++)
+		free (w->slots[i]);
+	return ok;
+}
+
+
+#ifdef WIN32
+#define snap_getpid() GetCurrentProcessId ()
+#else
+#define snap_getpid() getpid ()
+#endif
+
+static int snap_serial = 0;
+
+
+/*
+** Create a new file, failing if it already exists.
+*/
+static FILE *snap_create (const char *name) {
+#ifdef WIN32
+	FILE *fp = fopen (name, "rb");
+	if (fp != NULL) {
+		fclose (fp);
+		return NULL;
+	}
+	return fopen (name, "wb");
+#else
+	FILE *fp;
+	int fd = open (name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd < 0)
+		return NULL;
+	fp = fdopen (fd, "wb");
+	if (fp == NULL)
+		close (fd);
+	return fp;
+#endif
+}
+
+
+/*
+** Write the entries of a subtree to a snapshot file.
+** @param #1 LDAP connection.
+** @param #2 Table with the search parameters and the fields path (name
+**	of the file) and index (attribute or list of attributes to index).
+** @return #1 Number of entries written.
+*/
+static int lualdap_snapshot (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	char *attrs[LUALDAP_MAX_ATTRS];
+	ldap_pchar_t base, filter;
+	const char *path, *tmp, *err;
+	int rc, scope, sizelimit, msgid, ok;
+	struct timeval st, *timeout;
+	snap_writer w;
+
+	if (!lua_istable (L, 2))
+		return luaL_error (L, LUALDAP_PREFIX"no snapshot specification");
+	path = strtabparam (L, "path", NULL);
+	if (path == NULL)
+		return luaL_error (L, LUALDAP_PREFIX"no snapshot path");
+	memset (&w, 0, sizeof (w));
+	strgettable (L, "index");
+	if (!lua_isnil (L, -1)) {
+		table2strarray (L, lua_gettop (L), w.index, LUALDAP_MAX_INDEXES + 1);
+		while (w.index[w.nindex] != NULL)
+			w.nindex++;
+	}
+	get_attrs_param (L, attrs);
+	base = (ldap_pchar_t) strtabparam (L, "base", NULL);
+	filter = (ldap_pchar_t) strtabparam (L, "filter", NULL);
+	scope = string2scope (L, strtabparam (L, "scope", NULL));
+	sizelimit = longtabparam (L, "sizelimit", LDAP_NO_LIMIT);
+	timeout = get_timeout_param (L, &st);
+	/* write to a temporary file, which replaces the snapshot when done;
+	   its name is unique so concurrent writers don't share it */
+	tmp = lua_pushfstring (L, "%s.%d.%d.tmp", path, (int)snap_getpid (), ++snap_serial);
+
+	rc = ldap_search_ext (conn->ld, base, scope, filter, attrs, 0, NULL, NULL,
+		timeout, sizelimit, &msgid);
+	if (rc != LDAP_SUCCESS)
+		return faildirect (L, ldap_err2string (rc));
+	w.fp = snap_create (tmp);
+	if (w.fp == NULL) {
+		ldap_abandon_ext (conn->ld, msgid, NULL, NULL);
+		return faildirect (L, LUALDAP_PREFIX"error opening snapshot file");
+	}
+	err = snap_write (&w, conn->ld, msgid);
+	ok = snap_release (&w);
+	if (err == NULL && !ok)
+		err = LUALDAP_PREFIX"error writing snapshot file";
+#ifdef WIN32
+	if (err == NULL)
+		remove (path);
+#endif
+	if (err == NULL && rename (tmp, path) != 0)
+		err = LUALDAP_PREFIX"error renaming snapshot file";
+	if (err != NULL) {
+		remove (tmp);
+		return faildirect (L, err);
+	}
+	lua_pushnumber (L, (lua_Number)w.n);
+	return 1;
+}
+
+
+/*
+** Get a snapshot object from the first stack position.
+*/
+static snapshot_data *getsnapshot (lua_State *L) {
+	snapshot_data *snap = (snapshot_data *)luaL_checkudata (L, 1, LUALDAP_SNAPSHOT_METATABLE);
+	luaL_argcheck (L, snap!=NULL, 1, LUALDAP_PREFIX"LDAP snapshot expected");
+	luaL_argcheck (L, snap->data!=NULL, 1, LUALDAP_PREFIX"LDAP snapshot is closed");
+	return snap;
+}
+
+
+/*
+** Read a number of a snapshot.
+** @return 1 in case of success; 0 if it is beyond the end of the file.
+*/
+static int snap_u32 (snapshot_data *snap, unsigned long off, unsigned long *v) {
+	if (off > snap->size || snap->size - off < 4)
+		return 0;
+	*v = get_u32 (snap->data + off);
+	return 1;
+}
+
+
+/*
+** Read a string of a snapshot (which is not copied).
+** @return Offset after the string; 0 if it is beyond the end of the file.
+*/
+static unsigned long snap_str (snapshot_data *snap, unsigned long off, const char **s, unsigned long *len) {
+	if (!snap_u32 (snap, off, len) || snap->size - off - 4 < *len)
+		return 0;
+	*s = (const char *)snap->data + off + 4;
+	return off + 4 + *len;
+}
+
+
+/*
+** Compare the normalized DN of a record with the given one.
+*/
+static int snap_cmpdn (snapshot_data *snap, unsigned long off, const char *ndn, size_t len) {
+	const char *s;
+	unsigned long n;
+	int c;
+	if (!snap_str (snap, off, &s, &n))
+		return 1;
+	c = memcmp (s, ndn, (n < len) ? n : len);
+	if (c != 0)
+		return c;
+	return (n < len) ? -1 : (n > len);
+}
+
+
+/*
+** Push the DN and the table of attributes of a record.
+** @return Number of values pushed.
+*/
+static int snap_push (lua_State *L, snapshot_data *snap, unsigned long off) {
+	const char *s;
+	unsigned long len, nattrs, nvals, i, j;
+	if (!(off = snap_str (snap, off, &s, &len)) /* skip normalized DN */
+		|| !(off = snap_str (snap, off, &s, &len))
+		|| !snap_u32 (snap, off, &nattrs))
+		return luaL_error (L, LUALDAP_PREFIX"corrupted snapshot");
+	lua_pushlstring (L, s, len);
+	lua_newtable (L);
+	off += 4;
+	for (i = 0; i < nattrs; i++) {
+		if (!(off = snap_str (snap, off, &s, &len)) || !snap_u32 (snap, off, &nvals))
+			return luaL_error (L, LUALDAP_PREFIX"corrupted snapshot");
+		off += 4;
+		lua_pushlstring (L, s, len);
+		if (nvals == 0) /* no values */
+			lua_pushboolean (L, 1);
+		else if (nvals > 1)
+			lua_newtable (L);
+		for (j = 0; j < nvals; j++) {
+			if (!(off = snap_str (snap, off, &s, &len)))
+				return luaL_error (L, LUALDAP_PREFIX"corrupted snapshot");
+			lua_pushlstring (L, s, len);
+			if (nvals > 1)
+				lua_rawseti (L, -2, (int)j + 1);
+		}
+		lua_rawset (L, -3);
+	}
+	return 2;
+}
+
+
+/*
+** Compare two strings of the given length ignoring case.
+*/
+static int snap_caseeq (const char *a, const char *b, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++)
+		if (tolower ((unsigned char)a[i]) != tolower ((unsigned char)b[i]))
+			return 0;
+	return 1;
+}
+
+
+/*
+** Check if a record has the given value (ignoring case) of an attribute.
+*/
+static int snap_match (snapshot_data *snap, unsigned long off, const char *attr, const char *value, size_t vlen) {
+	const char *s;
+	unsigned long len, nattrs, nvals, i, j;
+	size_t alen = strlen (attr);
+	if (!(off = snap_str (snap, off, &s, &len))
+		|| !(off = snap_str (snap, off, &s, &len))
+		|| !snap_u32 (snap, off, &nattrs))
+		return 0;
+	off += 4;
+	for (i = 0; i < nattrs; i++) {
+		int found;
+		if (!(off = snap_str (snap, off, &s, &len)) || !snap_u32 (snap, off, &nvals))
+			return 0;
+		off += 4;
+		found = (len == alen && snap_caseeq (s, attr, alen));
+		for (j = 0; j < nvals; j++) {
+			if (!(off = snap_str (snap, off, &s, &len)))
+				return 0;
+			if (found && len == vlen && snap_caseeq (s, value, vlen))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+** Look up an entry of a snapshot by its DN.
+** @param #1 Snapshot object.
+** @param #2 String with the DN.
+** @return #1 String with the DN of the entry (as stored) or nil.
+** @return #2 Table with the entry's attributes and values.
+*/
+static int snapshot_get (lua_State *L) {
+	snapshot_data *snap = getsnapshot (L);
+	char *ndn = checknormdn (L, 2);
+	size_t len = strlen (ndn);
+	unsigned long lo = 0, hi = snap->count, off = 0;
+	while (lo < hi) {
+		unsigned long mid = lo + (hi - lo) / 2, rec;
+		int c;
+		snap_u32 (snap, snap->dir + 4 * mid, &rec);
+		c = snap_cmpdn (snap, rec, ndn, len);
+		if (c == 0) {
+			off = rec;
+			break;
+		} else if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	ldap_memfree (ndn);
+	if (off == 0)
+		return 0;
+	return snap_push (L, snap, off);
+}
+
+
+/*
+** Retrieve the next entry with the value of the indexed attribute.
+** The upvalues are the snapshot, the attribute, the value, its hash, the
+** offset of the slots of the index, their number and the next one.
+** @return #1 String with the DN of the entry.
+** @return #2 Table with the entry's attributes and values.
+*/
+static int snapshot_next (lua_State *L) {
+	snapshot_data *snap = (snapshot_data *)lua_touserdata (L, lua_upvalueindex (1));
+	const char *attr = lua_tostring (L, lua_upvalueindex (2));
+	const char *value = lua_tostring (L, lua_upvalueindex (3));
+	size_t vlen = lua_strlen (L, lua_upvalueindex (3));
+	unsigned long hash = (unsigned long)lua_tonumber (L, lua_upvalueindex (4));
+	unsigned long slots = (unsigned long)lua_tonumber (L, lua_upvalueindex (5));
+	unsigned long mask = (unsigned long)lua_tonumber (L, lua_upvalueindex (6)) - 1;
+	unsigned long j = (unsigned long)lua_tonumber (L, lua_upvalueindex (7)), i;
+
+	luaL_argcheck (L, snap->data!=NULL, 1, LUALDAP_PREFIX"LDAP snapshot is closed");
+	for (i = 0; i <= mask; i++) {
+		unsigned long h, off;
+		snap_u32 (snap, slots + 8 * j, &h);
+		snap_u32 (snap, slots + 8 * j + 4, &off);
+		if (off == 0) /* empty slot */
+			break;
+		j = (j + 1) & mask;
+		if (h == hash && snap_match (snap, off, attr, value, vlen)) {
+			lua_pushnumber (L, (lua_Number)j);
+			lua_replace (L, lua_upvalueindex (7));
+			return snap_push (L, snap, off);
+		}
+	}
+	/* stay at the empty slot, which ends the iteration */
+	lua_pushnumber (L, (lua_Number)j);
+	lua_replace (L, lua_upvalueindex (7));
+	return 0;
+}
+
+
+/*
+** Look up the entries of a snapshot by the value of an indexed attribute
+** (compared ignoring case).
+** @param #1 Snapshot object.
+** @param #2 String with the attribute name.
+** @param #3 String with the value.
+** @return #1 Iterator over the DNs and the tables of attributes of the
+**	entries with the value.
+*/
+static int snapshot_find (lua_State *L) {
+	snapshot_data *snap = getsnapshot (L);
+	const char *attr = luaL_checkstring (L, 2);
+	const char *value = luaL_checkstring (L, 3);
+	size_t vlen = lua_strlen (L, 3);
+	unsigned long i, name, slots, n, hash;
+	for (i = 0; i < snap->nindex; i++) {
+		const char *s;
+		unsigned long len, desc = snap->indexes + 12 * i;
+		snap_u32 (snap, desc, &name);
+		if (snap_str (snap, name, &s, &len) && len == strlen (attr)
+			&& snap_caseeq (s, attr, len))
+			break;
+	}
+	if (i == snap->nindex)
+		return luaL_error (L, LUALDAP_PREFIX"attribute `%s' is not indexed", attr);
+	snap_u32 (snap, snap->indexes + 12 * i + 4, &n);
+	snap_u32 (snap, snap->indexes + 12 * i + 8, &slots);
+	if (n == 0 || (n & (n - 1)) != 0 || slots > snap->size || (snap->size - slots) / 8 < n)
+		return luaL_error (L, LUALDAP_PREFIX"corrupted snapshot");
+	hash = snap_hash (value, vlen);
+	lua_settop (L, 3);
+	lua_pushnumber (L, (lua_Number)hash);
+	lua_pushnumber (L, (lua_Number)slots);
+	lua_pushnumber (L, (lua_Number)n);
+	lua_pushnumber (L, (lua_Number)(hash & (n - 1)));
+	lua_pushcclosure (L, snapshot_next, 7);
+	return 1;
+}
+
+
+/*
+** Close a snapshot, releasing its memory.
+** @param #1 Snapshot object.
+** @return 1 in case of success; nothing when already closed.
+*/
+static int snapshot_close (lua_State *L) {
+	snapshot_data *snap = (snapshot_data *)luaL_checkudata (L, 1, LUALDAP_SNAPSHOT_METATABLE);
+	luaL_argcheck (L, snap!=NULL, 1, LUALDAP_PREFIX"LDAP snapshot expected");
+	if (snap->data == NULL)
+		return 0;
+#ifndef WIN32
+	munmap ((void *)snap->data, snap->size);
+#else
+	free (snap->data);
+#endif
+	snap->data = NULL;
+	lua_pushnumber (L, 1);
+	return 1;
+}
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_snapshot_tostring (lua_State *L) {
+	char buff[100];
+	snapshot_data *snap = (snapshot_data *)lua_touserdata (L, 1);
+	if (snap->data == NULL)
+		strcpy (buff, "closed");
+	else
+		sprintf (buff, "%p", (void *)snap);
+	lua_pushfstring (L, "%s (%s)", LUALDAP_SNAPSHOT_METATABLE, buff);
+	return 1;
+}
+
+
+/*
+** Map a snapshot file in memory (the whole file is read where mmap is not
+** available).
+** @return NULL in case of success or an error message.
+*/
+static const char *snap_map (snapshot_data *snap, const char *path) {
+#ifndef WIN32
+	struct stat st;
+	void *data;
+	int fd = open (path, O_RDONLY);
+	if (fd == -1)
+		return LUALDAP_PREFIX"error opening snapshot file";
+	if (fstat (fd, &st) != 0 || st.st_size < LUALDAP_SNAPSHOT_HEADER) {
+		close (fd);
+		return LUALDAP_PREFIX"invalid snapshot file";
+	}
+	data = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (data == MAP_FAILED)
+		return LUALDAP_PREFIX"error mapping snapshot file";
+	snap->data = (unsigned char *)data;
+	snap->size = (size_t)st.st_size;
+#else
+	long size;
+	FILE *fp = fopen (path, "rb");
+	if (fp == NULL)
+		return LUALDAP_PREFIX"error opening snapshot file";
+	if (fseek (fp, 0, SEEK_END) != 0 || (size = ftell (fp)) < LUALDAP_SNAPSHOT_HEADER
+		|| fseek (fp, 0, SEEK_SET) != 0) {
+		fclose (fp);
+		return LUALDAP_PREFIX"invalid snapshot file";
+	}
+	snap->data = (unsigned char *)malloc ((size_t)size);
+	if (snap->data == NULL) {
+		fclose (fp);
+		return LUALDAP_PREFIX"out of memory";
+	}
+	snap->size = (size_t)size;
+	if (fread (snap->data, 1, snap->size, fp) != snap->size) {
+		fclose (fp);
+		return LUALDAP_PREFIX"error reading snapshot file";
+	}
+	fclose (fp);
+#endif
+	return NULL;
+}
+
+
+/*
+** Open a snapshot written by conn:snapshot.
+** @param #1 String with the name of the file.
+** @return #1 Userdata with snapshot structure.
+*/
+static int lualdap_open_snapshot (lua_State *L) {
+	const char *path = luaL_checkstring (L, 1);
+	snapshot_data *snap = (snapshot_data *)lua_newuserdata (L, sizeof (snapshot_data));
+	const char *err;
+
+	lualdap_setmeta (L, LUALDAP_SNAPSHOT_METATABLE);
+	snap->data = NULL;
+	snap->size = 0;
+	err = snap_map (snap, path);
+	if (err != NULL)
+		return faildirect (L, err);
+	snap->count = get_u32 (snap->data + 8);
+	snap->dir = get_u32 (snap->data + 12);
+	snap->nindex = get_u32 (snap->data + 16);
+	snap->indexes = get_u32 (snap->data + 20);
+	if (memcmp (snap->data, LUALDAP_SNAPSHOT_MAGIC, 8) != 0
+		|| snap->dir > snap->size || (snap->size - snap->dir) / 4 < snap->count
+		|| snap->indexes > snap->size || (snap->size - snap->indexes) / 12 < snap->nindex)
+		return faildirect (L, LUALDAP_PREFIX"invalid snapshot file");
+	return 1;
+}
+#endif
+
+
+#ifdef LUALDAP_MUX
+/*
+** A multiplexer is shared by all the Lua states of the process, which
+** find it by its name.  It owns a few connections, used only by its I/O
+** thread: operations submitted by any state are put on a queue, sent by
+** the thread, and their results received with ldap_result (LDAP_RES_ANY)
+** and decoded into C memory, so that the submitting state converts them
+** to Lua values.  The entries of a search are stored each one as its size
+** followed by a record in the format of snapshots, with an empty
+** normalized DN.  The mutex of a multiplexer protects its queue and the
+** state of its requests; mux_list_lock protects the list of multiplexers
+** and their reference counts.
+** Requests fail when their deadline passes: the I/O thread abandons them,
+** and a state which still waits stops waiting.
+** The entries of a search are kept in C memory until the request object
+** is released, so the size of a result is only bounded by the sizelimit
+** of the search.
+*/
+
+/* Operation submitted to a multiplexer */
+typedef struct mux_request {
+	struct mux_request *next;  /* queue or list of requests sent */
+	int            code;       /* LDAP_RES_SEARCH_RESULT or LDAP_RES_COMPARE */
+	char          *dn;         /* base of the search or DN of the entry compared */
+	char          *filter;
+	char          *attrs[LUALDAP_MAX_ATTRS];
+	int            scope;
+	int            attrsonly;
+	int            sizelimit;
+	struct timeval timeout;    /* time limit of the search (0 if none) */
+	char          *attr;       /* attribute compared */
+	BerValue       value;      /* value compared */
+	double         deadline;   /* time when the request fails (0 if never) */
+	int            conn;       /* connection the request was sent on */
+	int            msgid;
+	int            nomem;      /* entries were lost for lack of memory */
+	int            done;       /* result received */
+	int            abandoned;  /* no state waits for the result */
+	int            rc;         /* result code */
+	char          *msg;        /* diagnostic message of the server */
+	snap_buf       res;        /* entries received */
+	pthread_cond_t cond;       /* signaled when done */
+} mux_request;
+
+
+/* Shared multiplexer */
+typedef struct mux_data {
+	struct mux_data *next;     /* list of multiplexers */
+	char            *name;
+	int              refs;     /* handles and requests of all states */
+	char            *uri;
+	char            *who;
+	char            *password;
+	int              use_tls;
+	double           timeout;  /* default time given to the requests */
+	int              n;        /* number of connections */
+	int              next_conn;/* connection of the next request */
+	conn_data        conns[LUALDAP_MAX_MUX_CONNECTIONS];
+	mux_request     *queue;    /* requests submitted and not sent */
+	mux_request     *last;
+	mux_request     *sent;     /* requests sent (used only by the I/O thread) */
+	long             pending;  /* number of requests without result */
+	long             submitted;/* number of requests submitted */
+	int              stop;     /* the I/O thread must finish */
+	int              started;  /* the I/O thread is running */
+	int              creating; /* its connections are being opened */
+	const char      *err;      /* error opening them */
+	int              wakeup[2];/* pipe which wakes up the I/O thread */
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+} mux_data;
+
+
+/* Multiplexer object of a Lua state */
+typedef struct {
+	mux_data      *mux;  /* NULL if closed */
+} mux_handle;
+
+
+/* Request object of a Lua state */
+typedef struct {
+	mux_data      *mux;  /* NULL if released */
+	mux_request   *req;
+	unsigned long  off;  /* offset of the next entry to be returned */
+} mux_ticket;
+
+
+static mux_data *mux_list = NULL;
+static pthread_mutex_t mux_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mux_list_cond = PTHREAD_COND_INITIALIZER; /* a multiplexer was created */
+
+
+static char *mux_strdup (const char *s, size_t len) {
+	char *p = (char *)malloc (len + 1);
+	if (p != NULL) {
+		memcpy (p, s, len);
+		p[len] = '\0';
+	}
+	return p;
+}
+
+
+static void mux_request_free (mux_request *req) {
+	int i;
+	for (i = 0; req->attrs[i] != NULL; i++)
+		free (req->attrs[i]);
+	free (req->dn);
+	free (req->filter);
+	free (req->attr);
+	free (req->value.bv_val);
+	free (req->msg);
+	free (req->res.p);
+	pthread_cond_destroy (&req->cond);
+	free (req);
+}
+
+
+/*
+** Finish a request and wake up the state waiting for it.  The request is
+** released if no state waits for it.
+*/
+static void mux_complete (mux_data *mux, mux_request *req, int rc) {
+	pthread_mutex_lock (&mux->lock);
+	req->rc = rc;
+	req->done = 1;
+	mux->pending--;
+	if (req->abandoned)
+		mux_request_free (req);
+	else
+		pthread_cond_signal (&req->cond);
+	pthread_mutex_unlock (&mux->lock);
+}
+
+
+static void mux_wakeup (mux_data *mux) {
+	ssize_t n = write (mux->wakeup[1], "", 1);
+	(void)n; /* the pipe is only full when the thread is already awake */
+}
+
+
+/*
+** Open (or reopen) a connection of a multiplexer.
+** @return NULL in case of success or an error message.
+*/
+static const char *mux_connect (mux_data *mux, int i) {
+	conn_data *conn = &mux->conns[i];
+	const char *err;
+	if (conn->ld != NULL)
+		ldap_unbind (conn->ld);
+	err = conn_open (conn, mux->uri, mux->who, mux->password, mux->use_tls);
+	if (err != NULL && conn->ld != NULL) {
+		ldap_unbind (conn->ld);
+		conn->ld = NULL;
+	}
+	return err;
+}
+
+
+/*
+** Fail the requests sent on a broken connection and close it; it is
+** reopened when the next request is sent.
+*/
+static void mux_fail (mux_data *mux, int i, int rc) {
+	mux_request **p = &mux->sent;
+	while (*p != NULL) {
+		mux_request *req = *p;
+		if (req->conn == i) {
+			*p = req->next;
+			mux_complete (mux, req, rc);
+		} else
+			p = &req->next;
+	}
+	ldap_unbind (mux->conns[i].ld);
+	mux->conns[i].ld = NULL;
+}
+
+
+/*
+** Send a request on the next available connection (in the I/O thread).
+*/
+static void mux_send (mux_data *mux, mux_request *req) {
+	int i = 0, k, rc;
+	LDAP *ld;
+	for (k = 0; k < mux->n; k++) {
+		i = (mux->next_conn + k) % mux->n;
+		if (mux->conns[i].ld != NULL || mux_connect (mux, i) == NULL)
+			break;
+	}
+	if (k == mux->n) {
+		mux_complete (mux, req, LDAP_SERVER_DOWN);
+		return;
+	}
+	mux->next_conn = (i + 1) % mux->n;
+	ld = mux->conns[i].ld;
+	if (req->code == LDAP_RES_SEARCH_RESULT)
+		rc = ldap_search_ext (ld, req->dn, req->scope, req->filter, req->attrs,
+			req->attrsonly, NULL, NULL,
+			(req->timeout.tv_sec > 0 || req->timeout.tv_usec > 0) ? &req->timeout : NULL,
+			req->sizelimit, &req->msgid);
+	else
+		rc = ldap_compare_ext (ld, req->dn, req->attr, &req->value, NULL, NULL, &req->msgid);
+	if (rc != LDAP_SUCCESS) {
+		mux_complete (mux, req, rc);
+		if (LUALDAP_NODE_FAILURE (rc))
+			mux_fail (mux, i, rc);
+		return;
+	}
+	req->conn = i;
+	req->next = mux->sent;
+	mux->sent = req;
+}
+
+
+/*
+** Store an entry of a search.
+** @return 1 in case of success; 0 if out of memory.
+*/
+static int mux_entry (mux_request *req, LDAP *ld, LDAPMessage *entry) {
+	snap_buf *b = &req->res;
+	size_t start = b->len;
+	char *dn = ldap_get_dn (ld, entry);
+	int mem = buf_u32 (b, 0) && buf_str (b, "", 0)
+		&& buf_str (b, (dn != NULL) ? dn : "", (dn != NULL) ? strlen (dn) : 0);
+	ldap_memfree (dn);
+	if (!mem || !buf_attrs (b, ld, entry, NULL)) {
+		b->len = start;
+		return 0;
+	}
+	put_u32 (b->p + start, (unsigned long)(b->len - start - 4));
+	return 1;
+}
+
+
+/*
+** Process a message received on a connection (in the I/O thread).
+*/
+static void mux_dispatch (mux_data *mux, int i, LDAPMessage *msg) {
+	LDAP *ld = mux->conns[i].ld;
+	int msgid = ldap_msgid (msg);
+	mux_request **p, *req;
+	for (p = &mux->sent; *p != NULL; p = &(*p)->next)
+		if ((*p)->conn == i && (*p)->msgid == msgid)
+			break;
+	req = *p;
+	if (req != NULL)
+		switch (ldap_msgtype (msg)) {
+			case LDAP_RES_SEARCH_ENTRY:
+				if (!req->nomem && !mux_entry (req, ld, msg))
+					req->nomem = 1;
+				break;
+			case LDAP_RES_SEARCH_RESULT:
+			case LDAP_RES_COMPARE: {
+				int err;
+				char *text = NULL;
+				int rc = ldap_parse_result (ld, msg, &err, NULL, &text, NULL, NULL, 0);
+				if (rc == LDAP_SUCCESS) {
+					rc = req->nomem ? LDAP_NO_MEMORY : err;
+					if (text != NULL)
+						req->msg = mux_strdup (text, strlen (text));
+				}
+				ldap_memfree (text);
+				*p = req->next;
+				mux_complete (mux, req, rc);
+				break;
+			}
+			default: /* references are not chased */
+				break;
+		}
+	ldap_msgfree (msg);
+}
+
+
+/*
+** Receive all the messages available on a connection (in the I/O thread).
+*/
+static void mux_receive (mux_data *mux, int i) {
+	struct timeval zero;
+	LDAPMessage *msg;
+	int rc;
+	zero.tv_sec = 0;
+	zero.tv_usec = 0;
+	while ((rc = ldap_result (mux->conns[i].ld, LDAP_RES_ANY, LDAP_MSG_ONE, &zero, &msg)) > 0)
+		mux_dispatch (mux, i, msg);
+	if (rc < 0)
+		mux_fail (mux, i, LDAP_SERVER_DOWN);
+}
+
+
+/*
+** Fail the requests sent whose deadline passed, abandoning them on the
+** server (in the I/O thread).
+** @return Milliseconds until the next deadline; -1 if there is none.
+*/
+static int mux_expire (mux_data *mux) {
+	mux_request **p = &mux->sent;
+	double now = lualdap_now (), next = 0;
+	while (*p != NULL) {
+		mux_request *req = *p;
+		if (req->deadline > 0 && req->deadline <= now) {
+			*p = req->next;
+			ldap_abandon_ext (mux->conns[req->conn].ld, req->msgid, NULL, NULL);
+			mux_complete (mux, req, LDAP_TIMEOUT);
+		} else {
+			if (req->deadline > 0 && (next == 0 || req->deadline < next))
+				next = req->deadline;
+			p = &req->next;
+		}
+	}
+	if (next == 0)
+		return -1;
+	if (next - now > 3600)
+		return 3600000;
+	return (int)((next - now) * 1000) + 1;
+}
+
+
+/*
+** Body of the I/O thread: send the queued requests, then wait for
+** messages on the connections, for new requests or for the next deadline.
+*/
+static void *mux_loop (void *arg) {
+	mux_data *mux = (mux_data *)arg;
+	struct pollfd fds[LUALDAP_MAX_MUX_CONNECTIONS + 1];
+	int conns[LUALDAP_MAX_MUX_CONNECTIONS + 1];
+	for (;;) {
+		mux_request *queue;
+		char buff[64];
+		int i, fd, wait, nfds = 1;
+		pthread_mutex_lock (&mux->lock);
+		if (mux->stop) {
+			pthread_mutex_unlock (&mux->lock);
+			break;
+		}
+		queue = mux->queue;
+		mux->queue = mux->last = NULL;
+		pthread_mutex_unlock (&mux->lock);
+		while (queue != NULL) {
+			mux_request *req = queue;
+			queue = req->next;
+			mux_send (mux, req);
+		}
+		wait = mux_expire (mux);
+		fds[0].fd = mux->wakeup[0];
+		fds[0].events = POLLIN;
+		for (i = 0; i < mux->n; i++)
+			if (mux->conns[i].ld != NULL
+				&& ldap_get_option (mux->conns[i].ld, LDAP_OPT_DESC, &fd) == LDAP_OPT_SUCCESS
+				&& fd >= 0) {
+				fds[nfds].fd = fd;
+				fds[nfds].events = POLLIN;
+				conns[nfds++] = i;
+			}
+		if (poll (fds, nfds, wait) < 0)
+			continue; /* interrupted */
+		if (fds[0].revents != 0)
+			while (read (mux->wakeup[0], buff, sizeof (buff)) > 0)
+				;
+		for (i = 1; i < nfds; i++)
+			if (fds[i].revents != 0)
+				mux_receive (mux, conns[i]);
+	}
+	return NULL;
+}
+
+
+/*
+** Stop the I/O thread, fail the remaining requests and release a
+** multiplexer.
+*/
+static void mux_destroy (mux_data *mux) {
+	int i;
+	if (mux->started) {
+		pthread_mutex_lock (&mux->lock);
+		mux->stop = 1;
+		pthread_mutex_unlock (&mux->lock);
+		mux_wakeup (mux);
+		pthread_join (mux->thread, NULL);
+	}
+	while (mux->queue != NULL) {
+		mux_request *req = mux->queue;
+		mux->queue = req->next;
+		mux_complete (mux, req, LDAP_SERVER_DOWN);
+	}
+	while (mux->sent != NULL) {
+		mux_request *req = mux->sent;
+		mux->sent = req->next;
+		mux_complete (mux, req, LDAP_SERVER_DOWN);
+	}
+	for (i = 0; i < mux->n; i++)
+		if (mux->conns[i].ld != NULL)
+			ldap_unbind (mux->conns[i].ld);
+	if (mux->wakeup[0] != -1) {
+		close (mux->wakeup[0]);
+		close (mux->wakeup[1]);
+	}
+	pthread_mutex_destroy (&mux->lock);
+	free (mux->name);
+	free (mux->uri);
+	free (mux->who);
+	free (mux->password);
+	free (mux);
+}
+
+
+/*
+** Create a multiplexer, without opening its connections.
+** @return NULL in case of success or an error message.
+*/
+static const char *mux_create (mux_data **pmux, const char *name, const char *uri, const char *who, const char *password, int use_tls, double timeout, int n) {
+	mux_data *mux = (mux_data *)malloc (sizeof (mux_data));
+	const char *err = NULL;
+	int i;
+	*pmux = NULL;
+	if (mux == NULL)
+		return LUALDAP_PREFIX"out of memory";
+	memset (mux, 0, sizeof (mux_data));
+	mux->refs = 1;
+	mux->use_tls = use_tls;
+	mux->timeout = timeout;
+	mux->n = n;
+	mux->wakeup[0] = mux->wakeup[1] = -1;
+	pthread_mutex_init (&mux->lock, NULL);
+	for (i = 0; i < n; i++) {
+		mux->conns[i].ld = NULL;
+		mux->conns[i].schema = LUA_NOREF;
+		mux->conns[i].types = LUA_NOREF;
+		mux->conns[i].trace = LUA_NOREF;
+		mux->conns[i].referrals = LUA_NOREF;
+	}
+	mux->name = mux_strdup (name, strlen (name));
+	mux->uri = mux_strdup (uri, strlen (uri));
+	if (who != NULL)
+		mux->who = mux_strdup (who, strlen (who));
+	if (password != NULL)
+		mux->password = mux_strdup (password, strlen (password));
+	if (mux->name == NULL || mux->uri == NULL || (who != NULL && mux->who == NULL)
+		|| (password != NULL && mux->password == NULL))
+		err = LUALDAP_PREFIX"out of memory";
+	else if (pipe (mux->wakeup) != 0) {
+		mux->wakeup[0] = mux->wakeup[1] = -1;
+		err = LUALDAP_PREFIX"error creating pipe";
+	} else {
+		fcntl (mux->wakeup[0], F_SETFL, O_NONBLOCK);
+		fcntl (mux->wakeup[1], F_SETFL, O_NONBLOCK);
+	}
+	if (err != NULL) {
+		mux_destroy (mux);
+		return err;
+	}
+	*pmux = mux;
+	return NULL;
+}
+
+
+/*
+** Open the connections of a multiplexer and start its I/O thread.
+** @return NULL in case of success or an error message.
+*/
+static const char *mux_start (mux_data *mux) {
+	const char *err = NULL;
+	int i;
+	for (i = 0; err == NULL && i < mux->n; i++)
+		err = mux_connect (mux, i);
+	if (err == NULL) {
+		if (pthread_create (&mux->thread, NULL, mux_loop, mux) != 0)
+			err = LUALDAP_PREFIX"error creating thread";
+		else
+			mux->started = 1;
+	}
+	return err;
+}
+
+
+/*
+** Drop a reference to a multiplexer, destroying it with the last one.
+*/
+static void mux_release (mux_data *mux) {
+	mux_data **p;
+	int refs;
+	pthread_mutex_lock (&mux_list_lock);
+	refs = --mux->refs;
+	if (refs == 0)
+		for (p = &mux_list; *p != NULL; p = &(*p)->next)
+			if (*p == mux) {
+				*p = mux->next;
+				break;
+			}
+	pthread_mutex_unlock (&mux_list_lock);
+	if (refs == 0)
+		mux_destroy (mux);
+}
+
+
+/*
+** Get a multiplexer from the first stack position.
+*/
+static mux_data *getmux (lua_State *L) {
+	mux_handle *h = (mux_handle *)luaL_checkudata (L, 1, LUALDAP_MUX_METATABLE);
+	luaL_argcheck (L, h!=NULL, 1, LUALDAP_PREFIX"LDAP multiplexer expected");
+	luaL_argcheck (L, h->mux, 1, LUALDAP_PREFIX"LDAP multiplexer is closed");
+	return h->mux;
+}
+
+
+/*
+** Push a request object and create its request.
+*/
+static mux_ticket *mux_ticket_new (lua_State *L, mux_data *mux, int code) {
+	mux_ticket *t = (mux_ticket *)lua_newuserdata (L, sizeof (mux_ticket));
+	mux_request *req;
+	lualdap_setmeta (L, LUALDAP_TICKET_METATABLE);
+	t->mux = NULL;
+	t->req = NULL;
+	t->off = 0;
+	req = (mux_request *)malloc (sizeof (mux_request));
+	if (req == NULL)
+		luaL_error (L, LUALDAP_PREFIX"out of memory");
+	memset (req, 0, sizeof (mux_request));
+	req->code = code;
+	req->msgid = -1;
+	pthread_cond_init (&req->cond, NULL);
+	pthread_mutex_lock (&mux_list_lock);
+	mux->refs++;
+	pthread_mutex_unlock (&mux_list_lock);
+	t->mux = mux;
+	t->req = req;
+	return t;
+}
+
+
+/*
+** Submit the request of a request object to its multiplexer.
+*/
+static void mux_submit (lua_State *L, mux_ticket *t, int mem) {
+	mux_data *mux = t->mux;
+	mux_request *req = t->req;
+	if (!mem) {
+		pthread_mutex_lock (&mux->lock);
+		req->done = 1;
+		pthread_mutex_unlock (&mux->lock);
+		luaL_error (L, LUALDAP_PREFIX"out of memory");
+	}
+	pthread_mutex_lock (&mux->lock);
+	req->next = NULL;
+	if (mux->last != NULL)
+		mux->last->next = req;
+	else
+		mux->queue = req;
+	mux->last = req;
+	if (req->timeout.tv_sec > 0 || req->timeout.tv_usec > 0)
+		req->deadline = lualdap_now () + req->timeout.tv_sec + req->timeout.tv_usec / 1000000.0;
+	else if (mux->timeout > 0)
+		req->deadline = lualdap_now () + mux->timeout;
+	mux->pending++;
+	mux->submitted++;
+	pthread_mutex_unlock (&mux->lock);
+	mux_wakeup (mux);
+}
+
+
+/*
+** Wait for the result of the request of a request object, until its
+** deadline.
+** @return 1 if the result arrived; 0 if the deadline passed.
+*/
+static int mux_wait (mux_ticket *t) {
+	mux_request *req = t->req;
+	int done;
+	pthread_mutex_lock (&t->mux->lock);
+	if (req->deadline > 0) {
+		struct timespec ts;
+		ts.tv_sec = (time_t)req->deadline;
+		ts.tv_nsec = (long)((req->deadline - ts.tv_sec) * 1000000000.0);
+		while (!req->done
+			&& pthread_cond_timedwait (&req->cond, &t->mux->lock, &ts) != ETIMEDOUT)
+			;
+	} else
+		while (!req->done)
+			pthread_cond_wait (&req->cond, &t->mux->lock);
+	done = req->done;
+	pthread_mutex_unlock (&t->mux->lock);
+	return done;
+}
+
+
+/*
+** Release a request object: its request is freed now if it is finished or
+** by the I/O thread when its result arrives.
+** @return 1 in case of success; nothing when already released.
+*/
+static int mux_ticket_release (lua_State *L) {
+	mux_ticket *t = (mux_ticket *)luaL_checkudata (L, 1, LUALDAP_TICKET_METATABLE);
+	mux_data *mux;
+	if (t == NULL || t->mux == NULL)
+		return 0;
+	mux = t->mux;
+	pthread_mutex_lock (&mux->lock);
+	if (t->req->done)
+		mux_request_free (t->req);
+	else
+		t->req->abandoned = 1;
+	pthread_mutex_unlock (&mux->lock);
+	t->mux = NULL;
+	t->req = NULL;
+	mux_release (mux);
+	lua_pushnumber (L, 1);
+	return 1;
+}
+
+
+/*
+** Release the request object at the first upvalue.
+*/
+static void ticket_release (lua_State *L) {
+	lua_pushcfunction (L, mux_ticket_release);
+	lua_pushvalue (L, lua_upvalueindex (1));
+	lua_call (L, 1, 0);
+}
+
+
+/*
+** Iterator over the entries of a search submitted to a multiplexer.  The
+** first call waits for the result.  After the entries, a failed search
+** returns nil followed by an error message.
+** #1 upvalue == request object.
+*/
+static int mux_next (lua_State *L) {
+	mux_ticket *t = (mux_ticket *)lua_touserdata (L, lua_upvalueindex (1));
+	snapshot_data res;
+	unsigned long len;
+	int n;
+	if (t->req == NULL)
+		return 0;
+	if (!mux_wait (t)) {
+		ticket_release (L);
+		return faildirect (L, ldap_err2string (LDAP_TIMEOUT));
+	}
+	if (t->off >= t->req->res.len) {
+		if (t->req->rc == LDAP_SUCCESS) {
+			ticket_release (L);
+			return 0;
+		}
+		/* failed search (or no answer from the server) */
+		lua_pushnil (L);
+		lua_pushliteral (L, LUALDAP_PREFIX);
+		lua_pushstring (L, (t->req->msg != NULL) ? t->req->msg : "");
+		lua_pushliteral (L, " ");
+		lua_pushstring (L, ldap_err2string (t->req->rc));
+		lua_concat (L, 4);
+		ticket_release (L);
+		return 2;
+	}
+	res.data = t->req->res.p;
+	res.size = t->req->res.len;
+	len = get_u32 (res.data + t->off);
+	n = snap_push (L, &res, t->off + 4);
+	t->off += 4 + len;
+	return n;
+}
+
+
+/*
+** Get the result of a comparison submitted to a multiplexer, waiting for
+** it.
+** #1 upvalue == request object.
+*/
+static int mux_compare_result (lua_State *L) {
+	mux_ticket *t = (mux_ticket *)lua_touserdata (L, lua_upvalueindex (1));
+	int ret = 1;
+	if (t->req == NULL)
+		return faildirect (L, LUALDAP_PREFIX"result already received");
+	if (!mux_wait (t)) {
+		ticket_release (L);
+		return faildirect (L, ldap_err2string (LDAP_TIMEOUT));
+	}
+	switch (t->req->rc) {
+		case LDAP_COMPARE_TRUE:
+			lua_pushboolean (L, 1);
+			break;
+		case LDAP_COMPARE_FALSE:
+			lua_pushboolean (L, 0);
+			break;
+		default:
+			lua_pushnil (L);
+			lua_pushliteral (L, LUALDAP_PREFIX);
+			lua_pushstring (L, (t->req->msg != NULL) ? t->req->msg : "");
+			lua_pushliteral (L, " ");
+			lua_pushstring (L, ldap_err2string (t->req->rc));
+			lua_concat (L, 4);
+			ret = 2;
+	}
+	ticket_release (L);
+	return ret;
+}
+
+
+/*
+** Submit a search to a multiplexer.
+** @param #1 LDAP multiplexer.
+** @param #2 Table with the search parameters base, scope, filter, attrs,
+**	attrsonly, sizelimit and timeout (as in conn:search).
+** @return #1 Iterator over the DNs and attributes of the entries, which
+**	waits for the result on its first call.
+*/
+static int mux_search (lua_State *L) {
+	mux_data *mux = getmux (L);
+	char *attrs[LUALDAP_MAX_ATTRS];
+	const char *base, *filter;
+	struct timeval st, *timeout;
+	int scope, attrsonly, sizelimit, i, mem;
+	mux_ticket *t;
+	mux_request *req;
+
+	if (!lua_istable (L, 2))
+		return luaL_error (L, LUALDAP_PREFIX"no search specification");
+	get_attrs_param (L, attrs);
+	attrsonly = booltabparam (L, "attrsonly", 0);
+	base = strtabparam (L, "base", NULL);
+	filter = strtabparam (L, "filter", NULL);
+	scope = string2scope (L, strtabparam (L, "scope", NULL));
+	sizelimit = longtabparam (L, "sizelimit", LDAP_NO_LIMIT);
+	timeout = get_timeout_param (L, &st);
+
+	t = mux_ticket_new (L, mux, LDAP_RES_SEARCH_RESULT);
+	req = t->req;
+	req->scope = scope;
+	req->attrsonly = attrsonly;
+	req->sizelimit = sizelimit;
+	if (timeout != NULL)
+		req->timeout = *timeout;
+	mem = 1;
+	if (base != NULL)
+		mem = (req->dn = mux_strdup (base, strlen (base))) != NULL;
+	if (filter != NULL)
+		mem = mem && (req->filter = mux_strdup (filter, strlen (filter))) != NULL;
+	for (i = 0; mem && attrs[i] != NULL; i++)
+		mem = (req->attrs[i] = mux_strdup (attrs[i], strlen (attrs[i]))) != NULL;
+	mux_submit (L, t, mem);
+	lua_pushcclosure (L, mux_next, 1);
+	return 1;
+}
+
+
+/*
+** Submit a comparison to a multiplexer.
+** @param #1 LDAP multiplexer.
+** @param #2 String with entry's DN.
+** @param #3 String with attribute's name.
+** @param #4 String with attribute's value.
+** @return Function to get the result, which waits for it.
+*/
+static int mux_compare (lua_State *L) {
+	mux_data *mux = getmux (L);
+	const char *dn = luaL_checkstring (L, 2);
+	const char *attr = luaL_checkstring (L, 3);
+	const char *value = luaL_checkstring (L, 4);
+	size_t len = lua_strlen (L, 4);
+	mux_ticket *t = mux_ticket_new (L, mux, LDAP_RES_COMPARE);
+	mux_request *req = t->req;
+	req->dn = mux_strdup (dn, strlen (dn));
+	req->attr = mux_strdup (attr, strlen (attr));
+	req->value.bv_val = mux_strdup (value, len);
+	req->value.bv_len = len;
+	mux_submit (L, t, req->dn != NULL && req->attr != NULL && req->value.bv_val != NULL);
+	lua_pushcclosure (L, mux_compare_result, 1);
+	return 1;
+}
+
+
+/*
+** Get the activity of a multiplexer.
+** @param #1 LDAP multiplexer.
+** @return #1 Table with the fields connections (number of connections),
+**	pending (requests waiting for their result) and submitted (requests
+**	submitted by all states).
+*/
+static int mux_stats (lua_State *L) {
+	mux_data *mux = getmux (L);
+	long pending, submitted;
+	pthread_mutex_lock (&mux->lock);
+	pending = mux->pending;
+	submitted = mux->submitted;
+	pthread_mutex_unlock (&mux->lock);
+	lua_newtable (L);
+	set_number (L, "connections", mux->n);
+	set_number (L, "pending", pending);
+	set_number (L, "submitted", submitted);
+	return 1;
+}
+
+
+/*
+** Release the multiplexer of a Lua state; the shared multiplexer is
+** destroyed when no state uses it.
+** @return 1 in case of success; nothing when already closed.
+*/
+static int mux_close (lua_State *L) {
+	mux_handle *h = (mux_handle *)luaL_checkudata (L, 1, LUALDAP_MUX_METATABLE);
+	luaL_argcheck (L, h!=NULL, 1, LUALDAP_PREFIX"LDAP multiplexer expected");
+	if (h->mux == NULL)
+		return 0;
+	mux_release (h->mux);
+	h->mux = NULL;
+	lua_pushnumber (L, 1);
+	return 1;
+}
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_mux_tostring (lua_State *L) {
+	mux_handle *h = (mux_handle *)lua_touserdata (L, 1);
+	if (h->mux == NULL)
+		lua_pushfstring (L, "%s (closed)", LUALDAP_MUX_METATABLE);
+	else
+		lua_pushfstring (L, "%s (%s)", LUALDAP_MUX_METATABLE, h->mux->name);
+	return 1;
+}
+
+
+/*
+** Get the shared multiplexer with the given name, creating it if needed.
+** @param #1 String with the name of the multiplexer.
+** @param #2 Table with the fields uri (the server, as an LDAP URI or a
+**	host name), who, password, usetls, connections (number of
+**	connections) and timeout (seconds given to each request); only used
+**	to create the multiplexer.
+** @return #1 Userdata with multiplexer structure.
+*/
+static int lualdap_mux (lua_State *L) {
+	const char *name = luaL_checkstring (L, 1);
+	const char *uri = NULL, *who = NULL, *password = NULL, *err = NULL;
+	int use_tls = 0, n = LUALDAP_MUX_CONNECTIONS, create = 0;
+	double timeout = LUALDAP_MUX_TIMEOUT;
+	mux_handle *h;
+	mux_data *mux;
+
+	if (!lua_isnoneornil (L, 2)) {
+		luaL_checktype (L, 2, LUA_TTABLE);
+		uri = strtabparam (L, "uri", NULL);
+		if (uri == NULL)
+			return luaL_error (L, LUALDAP_PREFIX"no uri given");
+		who = strtabparam (L, "who", NULL);
+		password = strtabparam (L, "password", NULL);
+		use_tls = booltabparam (L, "usetls", 0);
+		n = (int)longtabparam (L, "connections", LUALDAP_MUX_CONNECTIONS);
+		if (n < 1 || n > LUALDAP_MAX_MUX_CONNECTIONS)
+			return luaL_error (L, LUALDAP_PREFIX"invalid number of connections");
+		strgettable (L, "timeout");
+		if (!lua_isnil (L, -1)) {
+			if (!lua_isnumber (L, -1) || lua_tonumber (L, -1) < 0)
+				return option_error (L, "timeout", "non-negative number");
+			timeout = lua_tonumber (L, -1);
+		}
+		lua_pop (L, 1);
+	}
+	h = (mux_handle *)lua_newuserdata (L, sizeof (mux_handle));
+	lualdap_setmeta (L, LUALDAP_MUX_METATABLE);
+	h->mux = NULL;
+
+	pthread_mutex_lock (&mux_list_lock);
+	for (mux = mux_list; mux != NULL; mux = mux->next)
+		if (strcmp (mux->name, name) == 0)
+			break;
+	if (mux != NULL) {
+		/* wait for a concurrent state which is creating it */
+		mux->refs++;
+		while (mux->creating)
+			pthread_cond_wait (&mux_list_cond, &mux_list_lock);
+		err = mux->err;
+	} else if (uri == NULL)
+		err = LUALDAP_PREFIX"unknown multiplexer";
+	else {
+		/* the multiplexer is listed before its connections are opened,
+		   so that concurrent states do not create another one with the
+		   same name, nor wait for the lock meanwhile */
+		err = mux_create (&mux, name, uri, who, password, use_tls, timeout, n);
+		if (mux != NULL) {
+			mux->creating = create = 1;
+			mux->next = mux_list;
+			mux_list = mux;
+		}
+	}
+	pthread_mutex_unlock (&mux_list_lock);
+	if (create) {
+		err = mux_start (mux);
+		pthread_mutex_lock (&mux_list_lock);
+		if (err != NULL) {
+			mux_data **p;
+			for (p = &mux_list; *p != NULL; p = &(*p)->next)
+				if (*p == mux) {
+					*p = mux->next;
+					break;
+				}
+			mux->err = err;
+		}
+		mux->creating = 0;
+		pthread_cond_broadcast (&mux_list_cond);
+		pthread_mutex_unlock (&mux_list_lock);
+	}
+	if (err != NULL) {
+		if (mux != NULL)
+			mux_release (mux);
+		return faildirect (L, err);
+	}
+	h->mux = mux;
+	return 1;
+}
+#endif
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_conn_tostring (lua_State *L) {
+	char buff[100];
+	conn_data *conn = (conn_data *)lua_touserdata (L, 1);
+	if (conn->ld == NULL)
+		strcpy (buff, "closed");
+	else
+		sprintf (buff, "%p", conn);
+	lua_pushfstring (L, "%s (%s)", LUALDAP_CONNECTION_METATABLE, buff);
+	return 1;
+}
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_search_tostring (lua_State *L) {
+	char buff[100];
+	search_data *search = (search_data *)lua_touserdata (L, 1);
+	luaL_argcheck (L,search->conn!=LUA_NOREF,1,LUALDAP_PREFIX"LDAP search is closed");
+	if (search->conn == LUA_NOREF)
+		strcpy (buff, "closed");
+	else
+		sprintf (buff, "%p", search);
+	lua_pushfstring (L, "%s (%s)", LUALDAP_SEARCH_METATABLE, buff);
+	return 1;
+}
+
+
+/*
+** Get a replica set object from the first stack position.
+*/
+static replicas_data *getreplicas (lua_State *L) {
+	replicas_data *rs = (replicas_data *)luaL_checkudata (L, 1, LUALDAP_REPLICAS_METATABLE);
+	luaL_argcheck (L, rs!=NULL, 1, LUALDAP_PREFIX"LDAP replica set expected");
+	luaL_argcheck (L, rs->spec!=LUA_NOREF, 1, LUALDAP_PREFIX"LDAP replica set is closed");
+	return rs;
+}
+
+
+/*
+** Get the connection of a node.
+** The connection is kept alive by the registry reference of the node.
+*/
+static conn_data *node_conn (lua_State *L, node_data *node) {
+	conn_data *conn;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, node->conn);
+	conn = (conn_data *)lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	return conn;
+}
 
-	lua_rawgeti (L, LUA_REGISTRYINDEX, search->conn);
-	conn = (conn_data *)lua_touserdata (L, -1); /* get connection */
 
-	rc = ldap_result (conn->ld, search->msgid, LDAP_MSG_ONE, timeout, &res);
-	if (rc == 0)
-		return faildirect (L, LUALDAP_PREFIX"result timeout expired");
-	else if (rc == -1)
-		return faildirect (L, LUALDAP_PREFIX"result error");
-	else if (rc == LDAP_RES_SEARCH_RESULT) { /* last message => nil */
-		/* close search object to avoid reuse */
-		search_close (L, search);
-		ret = 0;
-	} else {
-		LDAPMessage *msg = ldap_first_message (conn->ld, res);
-		switch (ldap_msgtype (msg)) {
-			case LDAP_RES_SEARCH_ENTRY: {
-				LDAPMessage *entry = ldap_first_entry (conn->ld, msg);
-				push_dn (L, conn->ld, entry);
-				lua_newtable (L);
-				set_attribs (L, conn->ld, entry, lua_gettop (L));
-				ret = 2; /* two return values */
-				break;
+/*
+** (Re)open the connection of the i-th node of a replica set.
+** In case of failure the node is ejected.
+** @return NULL in case of success or an error message.
+*/
+static const char *node_open (lua_State *L, replicas_data *rs, int i) {
+	node_data *node = &rs->nodes[i];
+	conn_data *conn = node_conn (L, node);
+	const char *err;
+
+	if (conn->ld != NULL) {
+		ldap_unbind (conn->ld);
+		conn->ld = NULL;
+	}
+	lua_rawgeti (L, LUA_REGISTRYINDEX, rs->spec);
+	lua_rawgeti (L, -1, i+1);
+	lua_pushliteral (L, "who");
+	lua_rawget (L, -3);
+	lua_pushliteral (L, "password");
+	lua_rawget (L, -4);
+	lua_pushliteral (L, "usetls");
+	lua_rawget (L, -5);
+	err = conn_open (conn, (ldap_pchar_t) lua_tostring (L, -4),
+		(ldap_pchar_t) lua_tostring (L, -3), lua_tostring (L, -2),
+		lua_toboolean (L, -1));
+	lua_pop (L, 5);
+	if (err != NULL) {
+		if (conn->ld != NULL) {
+			ldap_unbind (conn->ld);
+			conn->ld = NULL;
+		}
+		node->ejected = lualdap_now () + rs->retry;
+	} else
+		node->ejected = 0;
+	node->failures = conn->failures;
+	return err;
+}
+
+
+/*
+** Check the state of the i-th node of a replica set.
+** A node whose connection failed since the last check is ejected and an
+** ejected node is reinstated when its retry time has come.
+** @return The node's connection or NULL if it is not in rotation.
+*/
+static conn_data *node_check (lua_State *L, replicas_data *rs, int i) {
+	node_data *node = &rs->nodes[i];
+	conn_data *conn;
+
+	if (node->conn == LUA_NOREF)
+		return NULL;
+	conn = node_conn (L, node);
+	if (conn->failures > node->failures) {
+		if (conn->ld != NULL) {
+			ldap_unbind (conn->ld);
+			conn->ld = NULL;
+		}
+		node->failures = conn->failures;
+		node->ejected = lualdap_now () + rs->retry;
+	}
+	if (node->ejected > 0 && node->ejected <= lualdap_now ())
+		node_open (L, rs, i);
+	return (node->ejected > 0) ? NULL : conn;
+}
+
+
+/*
+** Choose the node to perform an operation and replace the replica set at
+** the first stack position by its connection.
+** Reads go to the replica with the lowest latency average (or to the
+** provider when there is no replica in rotation); writes go to the provider.
+** Every reply is a latency sample, so replicas are measured from their
+** first operation.
+** @return 1 in case of success; 0 when no node is available.
+*/
+static int replicas_route (lua_State *L, replicas_data *rs, int write) {
+	conn_data *conns[LUALDAP_MAX_REPLICAS + 1];
+	int i, k, best = -1, sampled = 0;
+	double latency = 0, sum = 0;
+
+	if (!write) {
+		for (i = 1; i < rs->n; i++) {
+			conns[i] = node_check (L, rs, i);
+			if (conns[i] != NULL && conns[i]->latency > 0) {
+				sum += conns[i]->latency;
+				sampled++;
 			}
-/*No reference to LDAP_RES_SEARCH_REFERENCE on MSDN. Maybe there is a replacement to it?*/
-#ifdef LDAP_RES_SEARCH_REFERENCE
-			case LDAP_RES_SEARCH_REFERENCE: {
-				LDAPMessage *ref = ldap_first_reference (conn->ld, msg);
-				push_dn (L, conn->ld, ref); /* is this supposed to work? */
-				lua_pushnil (L);
-				ret = 2; /* two return values */
-				break;
+		}
+		/* nodes without samples (new or reinstated) are taken as average;
+		   ties are broken in turn, starting at a different node each time */
+		for (k = 0; k < rs->n - 1; k++) {
+			double l;
+			i = 1 + (rs->turn + k) % (rs->n - 1);
+			if (conns[i] == NULL)
+				continue;
+			l = (conns[i]->latency > 0) ? conns[i]->latency
+				: (sampled > 0) ? sum / sampled : 0;
+			if (best < 0 || l < latency) {
+				best = i;
+				latency = l;
 			}
-#endif
-			case LDAP_RES_SEARCH_RESULT:
-				/* close search object to avoid reuse */
-				search_close (L, search);
-				ret = 0;
-				break;
-			default:
-				ldap_msgfree (res);
-				return luaL_error (L, LUALDAP_PREFIX"error on search result chain");
 		}
+		rs->turn++;
 	}
-	ldap_msgfree (res);
-	return ret;
+	if (best < 0 && node_check (L, rs, 0) != NULL)
+		best = 0;
+	if (best < 0)
+		return 0;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, rs->nodes[best].conn);
+	lua_replace (L, 1);
+	return 1;
 }
 
 
 /*
-** Convert a string to one of the possible scopes of the search.
+** Perform an operation on the node chosen by replicas_route.
 */
-static int string2scope (lua_State *L, const char *s) {
-	if ((s == NULL) || (*s == '\0'))
-		return LDAP_SCOPE_DEFAULT;
-	switch (*s) {
-		case 'b':
-			return LDAP_SCOPE_BASE;
-		case 'o':
-			return LDAP_SCOPE_ONELEVEL;
-		case 's':
-			return LDAP_SCOPE_SUBTREE;
-		default:
-			return luaL_error (L, LUALDAP_PREFIX"invalid search scope `%s'", s);
+static int replicas_call (lua_State *L, int write, lua_CFunction op) {
+	replicas_data *rs = getreplicas (L);
+	if (!replicas_route (L, rs, write))
+		return faildirect (L, write ? LUALDAP_PREFIX"no provider available"
+			: LUALDAP_PREFIX"no replica available");
+	return op (L);
+}
+
+
+static int replicas_add (lua_State *L) {
+	return replicas_call (L, 1, lualdap_add);
+}
+
+
+static int replicas_compare (lua_State *L) {
+	return replicas_call (L, 0, lualdap_compare);
+}
+
+
+static int replicas_delete (lua_State *L) {
+	return replicas_call (L, 1, lualdap_delete);
+}
+
+
+static int replicas_modify (lua_State *L) {
+	return replicas_call (L, 1, lualdap_modify);
+}
+
+
+static int replicas_rename (lua_State *L) {
+	return replicas_call (L, 1, lualdap_rename);
+}
+
+
+static int replicas_update (lua_State *L) {
+	return replicas_call (L, 1, lualdap_update);
+}
+
+
+static int replicas_search (lua_State *L) {
+	return replicas_call (L, 0, lualdap_search);
+}
+
+
+/*
+** Describe the nodes of a replica set.
+** @return Array of tables with fields host, provider, latency and ejected.
+*/
+static int replicas_nodes (lua_State *L) {
+	replicas_data *rs = getreplicas (L);
+	int i, n = 0;
+
+	lua_newtable (L);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, rs->spec);
+	for (i = 0; i < rs->n; i++) {
+		node_data *node = &rs->nodes[i];
+		if (node->conn == LUA_NOREF)
+			continue;
+		node_check (L, rs, i);
+		lua_newtable (L);
+		lua_pushliteral (L, "host");
+		lua_rawgeti (L, -3, i+1);
+		lua_rawset (L, -3);
+		lua_pushliteral (L, "provider");
+		lua_pushboolean (L, i == 0);
+		lua_rawset (L, -3);
+		lua_pushliteral (L, "latency");
+		lua_pushnumber (L, node_conn (L, node)->latency);
+		lua_rawset (L, -3);
+		lua_pushliteral (L, "ejected");
+		lua_pushboolean (L, node->ejected > 0);
+		lua_rawset (L, -3);
+		lua_rawseti (L, -3, ++n);
 	}
+	lua_pop (L, 1);
+	return 1;
 }
 
 
 /*
-** Close the search object.
+** Close all the connections of a replica set.
+** @return 1 in case of success; nothing when already closed.
 */
-static int lualdap_search_close (lua_State *L) {
-	search_data *search = (search_data *)luaL_checkudata (L, 1, LUALDAP_SEARCH_METATABLE);
-	luaL_argcheck (L, search!=NULL, 1, LUALDAP_PREFIX"LDAP search expected");
-	if (search->conn == LUA_NOREF)
+static int replicas_close (lua_State *L) {
+	replicas_data *rs = (replicas_data *)luaL_checkudata (L, 1, LUALDAP_REPLICAS_METATABLE);
+	int i;
+	luaL_argcheck (L, rs!=NULL, 1, LUALDAP_PREFIX"LDAP replica set expected");
+	if (rs->spec == LUA_NOREF) /* already closed */
 		return 0;
-	search_close (L, search);
+	for (i = 0; i < rs->n; i++) {
+		node_data *node = &rs->nodes[i];
+		conn_data *conn;
+		if (node->conn == LUA_NOREF)
+			continue;
+		conn = node_conn (L, node);
+		if (conn->ld != NULL) {
+			ldap_unbind (conn->ld);
+			conn->ld = NULL;
+		}
+		luaL_unref (L, LUA_REGISTRYINDEX, node->conn);
+		node->conn = LUA_NOREF;
+	}
+	luaL_unref (L, LUA_REGISTRYINDEX, rs->spec);
+	rs->spec = LUA_NOREF;
 	lua_pushnumber (L, 1);
 	return 1;
 }
 
 
 /*
-** Create a search object and leaves it on top of the stack.
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
 */
-static void create_search (lua_State *L, int conn_index, int msgid) {
-	search_data *search = (search_data *)lua_newuserdata (L, sizeof (search_data));
-	lualdap_setmeta (L, LUALDAP_SEARCH_METATABLE);
-	search->conn = LUA_NOREF;
-	search->msgid = msgid;
-	lua_pushvalue (L, conn_index);
-	search->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+static int lualdap_replicas_tostring (lua_State *L) {
+	char buff[100];
+	replicas_data *rs = (replicas_data *)lua_touserdata (L, 1);
+	if (rs->spec == LUA_NOREF)
+		strcpy (buff, "closed");
+	else
+		sprintf (buff, "%p", rs);
+	lua_pushfstring (L, "%s (%s)", LUALDAP_REPLICAS_METATABLE, buff);
+	return 1;
+}
+
+
+/*
+** Check for a valid authenticator.
+*/
+static auth_data *getauth (lua_State *L) {
+	auth_data *auth = (auth_data *)luaL_checkudata (L, 1, LUALDAP_AUTH_METATABLE);
+	luaL_argcheck (L, auth!=NULL, 1, LUALDAP_PREFIX"LDAP authenticator expected");
+	luaL_argcheck (L, auth->spec!=LUA_NOREF, 1, LUALDAP_PREFIX"LDAP authenticator is closed");
+	return auth;
+}
+
+
+/*
+** Connect (or reconnect) a connection of an authenticator.
+** The connection is bound anonymously.
+** @return NULL in case of success or an error message.
+*/
+static const char *binder_open (lua_State *L, auth_data *auth, int i) {
+	binder_data *b = &auth->binders[i];
+	const char *err;
+	int usetls;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, auth->spec);
+	lua_pushliteral (L, "usetls");
+	lua_rawget (L, -2);
+	usetls = lua_toboolean (L, -1);
+	lua_pushliteral (L, "uri");
+	lua_rawget (L, -3);
+	err = conn_open (&b->conn, (ldap_pchar_t)lua_tostring (L, -1), NULL, NULL, usetls);
+	lua_pop (L, 3);
+	if (err != NULL && b->conn.ld != NULL) {
+		ldap_unbind (b->conn.ld);
+		b->conn.ld = NULL;
+	}
+	b->msgid = -1;
+	return err;
+}
+
+
+/*
+** Send a simple bind request on a connection of an authenticator.
+** @return Result code of the request.
+*/
+static int binder_send (binder_data *b, const char *dn, const char *password, size_t len) {
+#ifndef WINLDAP
+	BerValue cred;
+	cred.bv_val = (char *)password;
+	cred.bv_len = len;
+	return ldap_sasl_bind (b->conn.ld, dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &b->msgid);
+#else
+	(void)len;
+	b->msgid = ldap_simple_bind (b->conn.ld, (ldap_pchar_t)dn, (ldap_pchar_t)password);
+	return (b->msgid == -1) ? LdapGetLastError () : LDAP_SUCCESS;
+#endif
+}
+
+
+/*
+** Collect the result of the outstanding bind of a connection, storing it
+** at its ticket (unless the ticket was already collected as garbage).
+** @param timeout Time to wait for the result (NULL to block).
+** @return 1 if the result was collected; 0 if it did not arrive yet.
+*/
+static int binder_collect (lua_State *L, auth_data *auth, int i, struct timeval *timeout) {
+	binder_data *b = &auth->binders[i];
+	LDAPMessage *res = NULL;
+	auth_ticket *t;
+	const char *msg = NULL;
+	int rc, err = LDAP_SUCCESS;
+	rc = ldap_result (b->conn.ld, b->msgid, LDAP_MSG_ALL, timeout, &res);
+	if (rc == 0)
+		return 0;
+	if (rc < 0) {
+		if (res != NULL)
+			ldap_msgfree (res);
+		msg = LUALDAP_PREFIX"result error";
+		/* reconnect on next use */
+		ldap_unbind (b->conn.ld);
+		b->conn.ld = NULL;
+	} else if ((rc = ldap_parse_result (b->conn.ld, res, &err, NULL, NULL, NULL, NULL, 1)) != LDAP_SUCCESS)
+		msg = ldap_err2string (rc);
+	else if (err != LDAP_SUCCESS && err != LDAP_INVALID_CREDENTIALS)
+		msg = ldap_err2string (err);
+	b->msgid = -1;
+	/* store the result at the ticket, which is no longer pending */
+	lua_rawgeti (L, LUA_REGISTRYINDEX, auth->results);
+	lua_pushnumber (L, b->ticket);
+	lua_rawget (L, -2);
+	t = (auth_ticket *)lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	if (t != NULL) {
+		t->state = 1;
+		t->valid = (msg == NULL && err == LDAP_SUCCESS);
+		t->err = msg;
+		lua_pushnumber (L, b->ticket);
+		lua_pushnil (L);
+		lua_rawset (L, -3);
+	}
+	lua_pop (L, 1);
+	return 1;
 }
 
 
 /*
-** Fill in the attrs array, according to the attrs parameter.
+** Get an idle connection of an authenticator.
+** Only one bind may be outstanding on a connection, so when all of them
+** are busy the results already received are collected or, if none, the
+** oldest bind is waited for.
 */
-static int get_attrs_param (lua_State *L, char *attrs[]) {
-	lua_pushstring (L, "attrs");
-	lua_gettable (L, 2);
-	if (lua_isstring (L, -1)) {
-		attrs[0] = (char *)lua_tostring (L, -1);
-		attrs[1] = NULL;
-	} else if (!lua_istable (L, -1))
-		attrs[0] = NULL;
-	else
-		if (table2strarray (L, lua_gettop (L), attrs, LUALDAP_MAX_ATTRS))
-			return 0;
-	return 1;
+static int binder_acquire (lua_State *L, auth_data *auth) {
+	struct timeval zero;
+	int i, k, oldest = -1;
+	zero.tv_sec = 0;
+	zero.tv_usec = 0;
+	for (k = 0; k < auth->n; k++) {
+		i = (auth->next + k) % auth->n;
+		if (auth->binders[i].msgid < 0 || binder_collect (L, auth, i, &zero))
+			break;
+		if (oldest < 0 || auth->binders[i].ticket < auth->binders[oldest].ticket)
+			oldest = i;
+	}
+	if (k == auth->n) {
+		i = oldest;
+		binder_collect (L, auth, i, NULL);
+	}
+	auth->next = (i + 1) % auth->n;
+	return i;
 }
 
 
 /*
-** Fill in the struct timeval, according to the timeout parameter.
+** Get the result of a bind sent by an authenticator.
+** #1 upvalue == authenticator.
+** #2 upvalue == ticket of the bind.
+** @param #1 Optional number of seconds to wait for the result.
+** @return True if the credentials are valid; false if they are invalid;
+**	nil followed by an error message otherwise.
 */
-static struct timeval *get_timeout_param (lua_State *L, struct timeval *st) {
-	double t = numbertabparam (L, "timeout", 0);
-	st->tv_sec = (long)t;
-	st->tv_usec = (long)(1000000 * (t - st->tv_sec));
-	if (st->tv_sec == 0 && st->tv_usec == 0)
-		return NULL;
-	else
-		return st;
+static int auth_result (lua_State *L) {
+	auth_data *auth = (auth_data *)lua_touserdata (L, lua_upvalueindex (1));
+	auth_ticket *t = (auth_ticket *)lua_touserdata (L, lua_upvalueindex (2));
+	struct timeval st, *timeout = get_wait_arg (L, 1, &st);
+	int i;
+
+	luaL_argcheck (L, auth->spec!=LUA_NOREF, 1, LUALDAP_PREFIX"LDAP authenticator is closed");
+	if (t->state == 2)
+		return luaL_error (L, LUALDAP_PREFIX"result already collected");
+	if (t->state == 0) { /* wait for it */
+		for (i = 0; i < auth->n; i++)
+			if (auth->binders[i].msgid >= 0 && auth->binders[i].ticket == t->ticket)
+				break;
+		if (i == auth->n)
+			return faildirect (L, LUALDAP_PREFIX"result error");
+		if (!binder_collect (L, auth, i, timeout))
+			return faildirect (L, result_timeout);
+	}
+	/* results are collected once */
+	t->state = 2;
+	if (t->err != NULL)
+		return faildirect (L, t->err);
+	lua_pushboolean (L, t->valid);
+	return 1;
 }
 
 
 /*
-** Perform a search operation.
-** @return #1 Function to iterate over the result entries.
-** @return #2 nil.
-** @return #3 nil as first entry.
-** The search result is defined as an upvalue of the iterator.
+** Verify a password, binding as the given DN on one of the connections
+** of an authenticator.
+** @param #1 LDAP authenticator.
+** @param #2 String with the DN.
+** @param #3 String with the password.
+** @return Function to process the LDAP result.
 */
-static int lualdap_search (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	ldap_pchar_t base;
-	ldap_pchar_t filter;
-	char *attrs[LUALDAP_MAX_ATTRS];
-	int scope, attrsonly, msgid, rc, sizelimit;
-	struct timeval st, *timeout;
-
-	if (!lua_istable (L, 2))
-		return luaL_error (L, LUALDAP_PREFIX"no search specification");
-	if (!get_attrs_param (L, attrs))
-		return 2;
-	/* get other parameters */
-	attrsonly = booltabparam (L, "attrsonly", 0);
-	base = (ldap_pchar_t) strtabparam (L, "base", NULL);
-	filter = (ldap_pchar_t) strtabparam (L, "filter", NULL);
-	scope = string2scope (L, strtabparam (L, "scope", NULL));
-	sizelimit = longtabparam (L, "sizelimit", LDAP_NO_LIMIT);
-	timeout = get_timeout_param (L, &st);
-
-	rc = ldap_search_ext (conn->ld, base, scope, filter, attrs, attrsonly,
-		NULL, NULL, timeout, sizelimit, &msgid);
-	if (rc != LDAP_SUCCESS)
-		return luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (rc));
-
-	create_search (L, 1, msgid);
-	lua_pushcclosure (L, next_message, 1);
+static int auth_verify (lua_State *L) {
+	auth_data *auth = getauth (L);
+	const char *dn = luaL_checkstring (L, 2);
+	size_t len;
+	const char *password = luaL_checklstring (L, 3, &len);
+	binder_data *b;
+	auth_ticket *t;
+	int i, rc, retry;
+
+	/* a simple bind without password is an unauthenticated bind */
+	if (len == 0)
+		return faildirect (L, LUALDAP_PREFIX"empty password");
+	i = binder_acquire (L, auth);
+	b = &auth->binders[i];
+	for (retry = 0; ; retry++) {
+		if (b->conn.ld == NULL) {
+			const char *err = binder_open (L, auth, i);
+			if (err != NULL)
+				return faildirect (L, err);
+		}
+		rc = binder_send (b, dn, password, len);
+		if (rc == LDAP_SUCCESS)
+			break;
+		b->msgid = -1;
+		if (rc == LDAP_SERVER_DOWN) { /* reconnect once */
+			ldap_unbind (b->conn.ld);
+			b->conn.ld = NULL;
+		}
+		if (rc != LDAP_SERVER_DOWN || retry > 0)
+			return faildirect (L, ldap_err2string (rc));
+	}
+	b->ticket = ++auth->tickets;
+	lua_pushvalue (L, 1); /* push authenticator as #1 upvalue */
+	t = (auth_ticket *)lua_newuserdata (L, sizeof (auth_ticket));
+	t->ticket = b->ticket;
+	t->state = 0;
+	t->valid = 0;
+	t->err = NULL;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, auth->results);
+	lua_pushnumber (L, t->ticket);
+	lua_pushvalue (L, -3);
+	lua_rawset (L, -3);
+	lua_pop (L, 1);
+	lua_pushcclosure (L, auth_result, 2); /* ticket is #2 upvalue */
 	return 1;
 }
 
 
 /*
-** Return the name of the object's metatable.
-** This function is used by `tostring'.
+** Close all the connections of an authenticator.
+** @return 1 in case of success; nothing when already closed.
 */
-static int lualdap_conn_tostring (lua_State *L) {
-	char buff[100];
-	conn_data *conn = (conn_data *)lua_touserdata (L, 1);
-	if (conn->ld == NULL)
-		strcpy (buff, "closed");
-	else
-		sprintf (buff, "%p", conn);
-	lua_pushfstring (L, "%s (%s)", LUALDAP_CONNECTION_METATABLE, buff);
+static int auth_close (lua_State *L) {
+	auth_data *auth = (auth_data *)luaL_checkudata (L, 1, LUALDAP_AUTH_METATABLE);
+	int i;
+	luaL_argcheck (L, auth!=NULL, 1, LUALDAP_PREFIX"LDAP authenticator expected");
+	if (auth->spec == LUA_NOREF) /* already closed */
+		return 0;
+	for (i = 0; i < auth->n; i++)
+		if (auth->binders[i].conn.ld != NULL) {
+			ldap_unbind (auth->binders[i].conn.ld);
+			auth->binders[i].conn.ld = NULL;
+		}
+	luaL_unref (L, LUA_REGISTRYINDEX, auth->spec);
+	luaL_unref (L, LUA_REGISTRYINDEX, auth->results);
+	auth->spec = auth->results = LUA_NOREF;
+	lua_pushnumber (L, 1);
 	return 1;
 }
 
@@ -855,15 +6215,14 @@ static int lualdap_conn_tostring (lua_State *L) {
 ** Return the name of the object's metatable.
 ** This function is used by `tostring'.
 */
-static int lualdap_search_tostring (lua_State *L) {
+static int lualdap_auth_tostring (lua_State *L) {
 	char buff[100];
-	search_data *search = (search_data *)lua_touserdata (L, 1);
-	luaL_argcheck (L,search->conn!=LUA_NOREF,1,LUALDAP_PREFIX"LDAP search is closed");
-	if (search->conn == LUA_NOREF)
+	auth_data *auth = (auth_data *)lua_touserdata (L, 1);
+	if (auth->spec == LUA_NOREF)
 		strcpy (buff, "closed");
 	else
-		sprintf (buff, "%p", search);
-	lua_pushfstring (L, "%s (%s)", LUALDAP_SEARCH_METATABLE, buff);
+		sprintf (buff, "%p", auth);
+	lua_pushfstring (L, "%s (%s)", LUALDAP_AUTH_METATABLE, buff);
 	return 1;
 }
 
@@ -879,9 +6238,58 @@ static int lualdap_createmeta (lua_State *L) {
 		{"delete", lualdap_delete},
 		{"modify", lualdap_modify},
 		{"rename", lualdap_rename},
+		{"update", lualdap_update},
+#ifndef WINLDAP
+		{"increment", lualdap_increment},
+#endif
 		{"search", lualdap_search},
+		{"search_columns", lualdap_search_columns},
+		{"schema", lualdap_schema},
+		{"set_trace", lualdap_set_trace},
+#ifndef WINLDAP
+		{"snapshot", lualdap_snapshot},
+#endif
+		{NULL, NULL}
+	};
+	const luaL_reg search_methods[] = {
+		{"close", lualdap_search_close},
+		{"buffered", lualdap_search_buffered},
+		{NULL, NULL}
+	};
+	const luaL_reg replicas_methods[] = {
+		{"close", replicas_close},
+		{"add", replicas_add},
+		{"compare", replicas_compare},
+		{"delete", replicas_delete},
+		{"modify", replicas_modify},
+		{"rename", replicas_rename},
+		{"update", replicas_update},
+		{"search", replicas_search},
+		{"nodes", replicas_nodes},
+		{NULL, NULL}
+	};
+	const luaL_reg auth_methods[] = {
+		{"close", auth_close},
+		{"verify", auth_verify},
+		{NULL, NULL}
+	};
+#ifndef WINLDAP
+	const luaL_reg snapshot_methods[] = {
+		{"close", snapshot_close},
+		{"get", snapshot_get},
+		{"find", snapshot_find},
+		{NULL, NULL}
+	};
+#endif
+#ifdef LUALDAP_MUX
+	const luaL_reg mux_methods[] = {
+		{"close", mux_close},
+		{"search", mux_search},
+		{"compare", mux_compare},
+		{"stats", mux_stats},
 		{NULL, NULL}
 	};
+#endif
 
 	if (!luaL_newmetatable (L, LUALDAP_CONNECTION_METATABLE))
 		return 0;
@@ -909,10 +6317,18 @@ static int lualdap_createmeta (lua_State *L) {
 	if (!luaL_newmetatable (L, LUALDAP_SEARCH_METATABLE))
 		return 0;
 
+	/* define methods */
+	luaL_openlib (L, NULL, search_methods, 0);
+
+	/* define metamethods */
 	lua_pushliteral (L, "__gc");
 	lua_pushcfunction (L, lualdap_search_close);
 	lua_settable (L, -3);
 
+	lua_pushliteral (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
 	lua_pushliteral (L, "__tostring");
 	lua_pushcclosure (L, lualdap_search_tostring, 1);
 	lua_settable (L, -3);
@@ -921,6 +6337,113 @@ static int lualdap_createmeta (lua_State *L) {
 	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
 	lua_settable (L, -3);
 
+	if (!luaL_newmetatable (L, LUALDAP_REPLICAS_METATABLE))
+		return 0;
+
+	/* define methods */
+	luaL_openlib (L, NULL, replicas_methods, 0);
+
+	/* define metamethods */
+	lua_pushliteral (L, "__gc");
+	lua_pushcfunction (L, replicas_close);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__tostring");
+	lua_pushcfunction (L, lualdap_replicas_tostring);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__metatable");
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_settable (L, -3);
+
+	if (!luaL_newmetatable (L, LUALDAP_AUTH_METATABLE))
+		return 0;
+
+	/* define methods */
+	luaL_openlib (L, NULL, auth_methods, 0);
+
+	/* define metamethods */
+	lua_pushliteral (L, "__gc");
+	lua_pushcfunction (L, auth_close);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__tostring");
+	lua_pushcfunction (L, lualdap_auth_tostring);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__metatable");
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_settable (L, -3);
+
+#ifndef WINLDAP
+	if (!luaL_newmetatable (L, LUALDAP_SNAPSHOT_METATABLE))
+		return 0;
+
+	/* define methods */
+	luaL_openlib (L, NULL, snapshot_methods, 0);
+
+	/* define metamethods */
+	lua_pushliteral (L, "__gc");
+	lua_pushcfunction (L, snapshot_close);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__tostring");
+	lua_pushcfunction (L, lualdap_snapshot_tostring);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__metatable");
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_settable (L, -3);
+#endif
+
+#ifdef LUALDAP_MUX
+	if (!luaL_newmetatable (L, LUALDAP_MUX_METATABLE))
+		return 0;
+
+	/* define methods */
+	luaL_openlib (L, NULL, mux_methods, 0);
+
+	/* define metamethods */
+	lua_pushliteral (L, "__gc");
+	lua_pushcfunction (L, mux_close);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__tostring");
+	lua_pushcfunction (L, lualdap_mux_tostring);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__metatable");
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_settable (L, -3);
+
+	if (!luaL_newmetatable (L, LUALDAP_TICKET_METATABLE))
+		return 0;
+
+	lua_pushliteral (L, "__gc");
+	lua_pushcfunction (L, mux_ticket_release);
+	lua_settable (L, -3);
+
+	lua_pushliteral (L, "__metatable");
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_settable (L, -3);
+#endif
+
 	return 0;
 }
 
@@ -939,34 +6462,211 @@ static int lualdap_open_simple (lua_State *L) {
 	const char *password = luaL_optstring (L, 3, NULL);
 	int use_tls = lua_toboolean (L, 4);
 	conn_data *conn = (conn_data *)lua_newuserdata (L, sizeof(conn_data));
-	int err;
+	const char *err;
 
 	/* Initialize */
 	lualdap_setmeta (L, LUALDAP_CONNECTION_METATABLE);
-	conn->version = 0;
-	conn->ld = ldap_init (host, LDAP_PORT);
-	if (conn->ld == NULL)
-		return faildirect(L,LUALDAP_PREFIX"Error connecting to server");
-	/* Set protocol version */
-	conn->version = LDAP_VERSION3;
-	if (ldap_set_option (conn->ld, LDAP_OPT_PROTOCOL_VERSION, &conn->version)
-		!= LDAP_OPT_SUCCESS)
-		return faildirect(L, LUALDAP_PREFIX"Error setting LDAP version");
-	/* Use TLS */
-	if (use_tls) {
-		int rc = ldap_start_tls_s (conn->ld, NULL, NULL);
-		if (rc != LDAP_SUCCESS)
-			return faildirect (L, ldap_err2string (rc));
+	conn->schema = conn->types = conn->trace = conn->referrals = LUA_NOREF;
+	err = conn_open (conn, host, who, password, use_tls);
+	if (err != NULL)
+		return faildirect (L, err);
+
+	return 1;
+}
+
+
+/*
+** Open a replica set: a provider, which receives the write operations,
+** and a group of replicas, which share the read operations.
+** @param #1 Table with fields provider (hostname), replicas (hostname or
+**	list of hostnames), who, password, usetls and retry (number of seconds
+**	an ejected node stays out of rotation).
+** @return #1 Userdata with replica set structure.
+*/
+static int lualdap_open_replicas (lua_State *L) {
+	replicas_data *rs;
+	const char *err = NULL;
+	int i, spec, ok = 0;
+
+	luaL_checktype (L, 1, LUA_TTABLE);
+	lua_settop (L, 1);
+	lua_pushvalue (L, 1); /* options are read from position 2 */
+	rs = (replicas_data *)lua_newuserdata (L, sizeof (replicas_data));
+	lualdap_setmeta (L, LUALDAP_REPLICAS_METATABLE);
+	rs->spec = LUA_NOREF;
+	rs->n = 1;
+	rs->turn = 0;
+	for (i = 0; i <= LUALDAP_MAX_REPLICAS; i++) {
+		rs->nodes[i].conn = LUA_NOREF;
+		rs->nodes[i].failures = 0;
+		rs->nodes[i].ejected = 0;
 	}
-	/* Bind to a server */
-	err = ldap_bind_s (conn->ld, who, password, LDAP_AUTH_SIMPLE);
-	if (err != LDAP_SUCCESS)
-		return faildirect (L, ldap_err2string (err));
+	rs->retry = numbertabparam (L, "retry", LUALDAP_REPLICA_RETRY);
+	/* build internal specification: hosts indexed by node + 1 */
+	lua_newtable (L);
+	spec = lua_gettop (L);
+	lua_pushliteral (L, "who");
+	strtabparam (L, "who", NULL);
+	lua_rawset (L, spec);
+	lua_pushliteral (L, "password");
+	strtabparam (L, "password", NULL);
+	lua_rawset (L, spec);
+	lua_pushliteral (L, "usetls");
+	lua_pushboolean (L, booltabparam (L, "usetls", 0));
+	lua_remove (L, -2);
+	lua_rawset (L, spec);
+	if (strtabparam (L, "provider", NULL) != NULL)
+		lua_rawseti (L, spec, 1);
+	else
+		lua_pop (L, 1);
+	strgettable (L, "replicas");
+	if (lua_isstring (L, -1)) {
+		lua_rawseti (L, spec, 2);
+		rs->n = 2;
+	} else if (lua_istable (L, -1)) {
+		int n = luaL_getn (L, -1);
+		if (n > LUALDAP_MAX_REPLICAS)
+			return luaL_error (L, LUALDAP_PREFIX"too many replicas");
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti (L, -1, i);
+			if (!lua_isstring (L, -1))
+				return luaL_error (L, LUALDAP_PREFIX"invalid value #%d", i);
+			lua_rawseti (L, spec, i+1);
+		}
+		rs->n = n + 1;
+		lua_pop (L, 1);
+	} else if (lua_isnil (L, -1))
+		lua_pop (L, 1);
+	else
+		return option_error (L, "replicas", "table or string");
+	rs->spec = luaL_ref (L, LUA_REGISTRYINDEX);
+	/* connect to each node */
+	for (i = 0; i < rs->n; i++) {
+		conn_data *conn;
+		const char *msg;
+		lua_rawgeti (L, LUA_REGISTRYINDEX, rs->spec);
+		lua_rawgeti (L, -1, i+1);
+		if (lua_isnil (L, -1)) {
+			lua_pop (L, 2);
+			continue;
+		}
+		lua_pop (L, 2);
+		conn = (conn_data *)lua_newuserdata (L, sizeof (conn_data));
+		lualdap_setmeta (L, LUALDAP_CONNECTION_METATABLE);
+		conn->version = 0;
+		conn->ld = NULL;
+		conn->latency = 0;
+		conn->failures = 0;
+		conn->schema = conn->types = conn->trace = conn->referrals = LUA_NOREF;
+		rs->nodes[i].conn = luaL_ref (L, LUA_REGISTRYINDEX);
+		msg = node_open (L, rs, i);
+		if (msg == NULL)
+			ok++;
+		else
+			err = msg;
+	}
+	if (ok == 0)
+		return faildirect (L, err ? err : LUALDAP_PREFIX"no hosts given");
+	return 1;
+}
+
+
+/*
+** Create an authenticator: a set of connections reserved for verifying
+** passwords with simple binds.
+** @param #1 Table with the fields uri (the server, as an LDAP URI or a
+**	host name), connections (number of connections) and usetls.
+** @return #1 Userdata with authenticator structure.
+*/
+static int lualdap_authenticator (lua_State *L) {
+	auth_data *auth;
+	int i, n, udata;
+
+	luaL_checktype (L, 1, LUA_TTABLE);
+	lua_settop (L, 1);
+	lua_pushvalue (L, 1); /* options are read from position 2 */
+	n = (int)longtabparam (L, "connections", LUALDAP_BINDERS);
+	if (n < 1 || n > LUALDAP_MAX_BINDERS)
+		return luaL_error (L, LUALDAP_PREFIX"invalid number of connections");
+	auth = (auth_data *)lua_newuserdata (L, sizeof (auth_data));
+	udata = lua_gettop (L);
+	lualdap_setmeta (L, LUALDAP_AUTH_METATABLE);
+	auth->spec = auth->results = LUA_NOREF;
+	auth->n = n;
+	auth->next = 0;
+	auth->tickets = 0;
+	for (i = 0; i < n; i++) {
+		auth->binders[i].conn.ld = NULL;
+		auth->binders[i].conn.schema = LUA_NOREF;
+		auth->binders[i].conn.types = LUA_NOREF;
+		auth->binders[i].conn.trace = LUA_NOREF;
+		auth->binders[i].conn.referrals = LUA_NOREF;
+		auth->binders[i].msgid = -1;
+		auth->binders[i].ticket = 0;
+	}
+	lua_newtable (L);
+	lua_pushliteral (L, "uri");
+	if (strtabparam (L, "uri", NULL) == NULL)
+		return luaL_error (L, LUALDAP_PREFIX"no uri given");
+	lua_rawset (L, -3);
+	lua_pushliteral (L, "usetls");
+	lua_pushboolean (L, booltabparam (L, "usetls", 0));
+	lua_remove (L, -2);
+	lua_rawset (L, -3);
+	auth->spec = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_newtable (L);
+	lua_newtable (L); /* metatable with weak values */
+	lua_pushliteral (L, "__mode");
+	lua_pushliteral (L, "v");
+	lua_rawset (L, -3);
+	lua_setmetatable (L, -2);
+	auth->results = luaL_ref (L, LUA_REGISTRYINDEX);
+	for (i = 0; i < n; i++) {
+		const char *err = binder_open (L, auth, i);
+		if (err != NULL) {
+			lua_pushvalue (L, udata);
+			lua_replace (L, 1);
+			auth_close (L);
+			return faildirect (L, err);
+		}
+	}
+	lua_pushvalue (L, udata);
+	return 1;
+}
+
 
+/*
+** Get the current time, in the clock of the times reported to trace
+** callbacks.
+** @return #1 Number of seconds.
+*/
+static int lualdap_clock (lua_State *L) {
+	lua_pushnumber (L, lualdap_now ());
 	return 1;
 }
 
 
+/*
+** Suspend the calling thread, to pace the requests of a client.
+** @param #1 Number of seconds.
+*/
+static int lualdap_sleep (lua_State *L) {
+	double t = luaL_checknumber (L, 1);
+#ifdef WIN32
+	if (t > 0)
+		Sleep ((DWORD)(t * 1000));
+#else
+	struct timespec ts;
+	if (t > 0) {
+		ts.tv_sec = (time_t)t;
+		ts.tv_nsec = (long)(1e9 * (t - ts.tv_sec));
+		nanosleep (&ts, NULL);
+	}
+#endif
+	return 0;
+}
+
+
 /*
 ** Assumes the table is on top of the stack.
 */
@@ -989,12 +6689,40 @@ static void set_info (lua_State *L) {
 int luaopen_lualdap (lua_State *L) {
 	struct luaL_reg lualdap[] = {
 		{"open_simple", lualdap_open_simple},
+		{"open_replicas", lualdap_open_replicas},
+		{"authenticator", lualdap_authenticator},
+		{"clock", lualdap_clock},
+		{"sleep", lualdap_sleep},
+#ifndef WINLDAP
+		{"open_snapshot", lualdap_open_snapshot},
+#endif
+#ifdef LUALDAP_MUX
+		{"mux", lualdap_mux},
+#endif
+		{NULL, NULL},
+	};
+
+#ifndef WINLDAP
+	struct luaL_reg dn[] = {
+		{"parse", lualdap_dn_parse},
+		{"normalize", lualdap_dn_normalize},
+		{"parent", lualdap_dn_parent},
+		{"is_descendant", lualdap_dn_is_descendant},
+		{"compare", lualdap_dn_compare},
 		{NULL, NULL},
 	};
+#endif
 
 	lualdap_createmeta (L);
 	luaL_openlib (L, LUALDAP_TABLENAME, lualdap, 0);
 	set_info (L);
+#ifndef WINLDAP
+	/* DN utilities */
+	lua_pushliteral (L, "dn");
+	lua_newtable (L);
+	luaL_openlib (L, NULL, dn, 0);
+	lua_settable (L, -3);
+#endif
 
 	return 1;
 }
@@ -18,7 +18,10 @@
 /* MSDN doesn't mention this function at all.  Unfortunately, LDAPMessage an opaque type. */
 #define ldap_msgtype(m) ((m)->lm_msgtype)
 
-#define ldap_first_message ldap_first_entry
+/* Messages are walked through the chain, since ldap_next_entry skips the
+   references and the final result of a search. */
+#define ldap_first_message(ld,m) (m)
+#define ldap_next_message(ld,m) ((m)->lm_chain)
 
 /* The WinLDAP API allows comparisons against either string or binary values */
 #undef ldap_compare_ext
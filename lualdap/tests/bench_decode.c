@@ -0,0 +1,137 @@
+/*
+** Micro-benchmark of the decoding of search entries.
+** Compares looking up the values of each attribute by name (as
+** ldap_get_values_len does, rescanning the entry from its start) with
+** the single pass decoding used by LuaLDAP (as ldap_get_attribute_ber
+** does). Entries are canned BER encodings, so no server is needed.
+** Usage: bench_decode [iterations]
+*/
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+
+#include "lber.h"
+
+#define VALUES 3
+
+
+static double now (void) {
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+/*
+** Encode an entry with the given number of attributes (each one with
+** VALUES values) like the body of a SearchResultEntry.
+*/
+static void encode_entry (int nattrs, struct berval *bv) {
+	BerElement *ber = ber_alloc_t (LBER_USE_DER);
+	char name[32], value[64];
+	int i, j;
+	ber_printf (ber, "{s{", "cn=user,ou=people,dc=example,dc=com");
+	for (i = 0; i < nattrs; i++) {
+		sprintf (name, "attribute%d", i);
+		ber_printf (ber, "{s[", name);
+		for (j = 0; j < VALUES; j++) {
+			sprintf (value, "value %d of attribute %d", j, i);
+			ber_printf (ber, "s", value);
+		}
+		ber_printf (ber, "]}");
+	}
+	ber_printf (ber, "}}");
+	ber_flatten2 (ber, bv, 1);
+	ber_free (ber, 1);
+}
+
+
+/*
+** Walk the attribute names, then look up the values of each one by name.
+*/
+static long decode_by_name (struct berval *bv, BerElement *walk, BerElement *look) {
+	char *attr, *name;
+	struct berval **vals;
+	long n = 0;
+	ber_len_t len;
+	ber_init2 (walk, bv, 0);
+	ber_scanf (walk, "{x{");
+	while (ber_get_option (walk, LBER_OPT_REMAINING_BYTES, &len) == 0 && len > 0) {
+		if (ber_scanf (walk, "{ax}", &attr) == LBER_ERROR)
+			break;
+		/* ldap_get_values_len: rescan the entry until the attribute */
+		ber_init2 (look, bv, 0);
+		ber_scanf (look, "{x{{a", &name);
+		while (strcasecmp (attr, name) != 0) {
+			ber_memfree (name);
+			ber_scanf (look, "x}{a", &name);
+		}
+		ber_memfree (name);
+		ber_scanf (look, "[V]", &vals);
+		n += vals != NULL;
+		ber_bvecfree (vals);
+		ber_memfree (attr);
+	}
+	return n;
+}
+
+
+/*
+** Decode each attribute and its values as they come.
+*/
+static long decode_single_pass (struct berval *bv, BerElement *ber) {
+	struct berval dn, attr;
+	BerVarray vals;
+	long n = 0;
+	ber_len_t len, siz;
+	ber_init2 (ber, bv, 0);
+	ber_scanf (ber, "{m{", &dn);
+	while (ber_get_option (ber, LBER_OPT_REMAINING_BYTES, &len) == 0 && len > 0) {
+		vals = NULL;
+		if (ber_scanf (ber, "{mM}", &attr, &vals, &siz, (ber_len_t)0) == LBER_ERROR)
+			break;
+		n += vals != NULL;
+		ber_memfree (vals);
+	}
+	return n;
+}
+
+
+int main (int argc, char *argv[]) {
+	static const int sizes[] = { 10, 40, 80, 160 };
+	long iterations = (argc > 1) ? atol (argv[1]) : 20000;
+	BerElement *ber1 = ber_alloc_t (0);
+	BerElement *ber2 = ber_alloc_t (0);
+	unsigned k;
+
+	printf ("%10s %16s %16s %8s\n", "attributes", "by name (ns)", "single (ns)", "speedup");
+	for (k = 0; k < sizeof (sizes) / sizeof (sizes[0]); k++) {
+		struct berval bv;
+		double t0, t1, t2;
+		long i, n1 = 0, n2 = 0;
+		encode_entry (sizes[k], &bv);
+		t0 = now ();
+		for (i = 0; i < iterations; i++)
+			n1 += decode_by_name (&bv, ber1, ber2);
+		t1 = now ();
+		for (i = 0; i < iterations; i++)
+			n2 += decode_single_pass (&bv, ber1);
+		t2 = now ();
+		if (n1 != n2 || n1 != (long)sizes[k] * iterations) {
+			fprintf (stderr, "decoders disagree: %ld != %ld\n", n1, n2);
+			return 1;
+		}
+		printf ("%10d %16.0f %16.0f %7.1fx\n", sizes[k],
+			(t1 - t0) * 1e9 / iterations, (t2 - t1) * 1e9 / iterations,
+			(t1 - t0) / (t2 - t1));
+		ber_memfree (bv.bv_val);
+	}
+	ber_free (ber1, 0);
+	ber_free (ber2, 0);
+	return 0;
+}
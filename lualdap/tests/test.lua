@@ -89,7 +89,7 @@ CONN_OK = function (obj, err)
 	if obj == nil then
 		error (err, 2)
 	end
-	return test_object (obj, { "close", "add", "compare", "delete", "modify", "rename", "search", })
+	return test_object (obj, { "close", "add", "compare", "delete", "modify", "rename", "search", "update", })
 end
 
 ---------------------------------------------------------------------
@@ -124,6 +124,80 @@ function basic_test ()
 end
 
 
+---------------------------------------------------------------------
+-- checking authenticator.
+---------------------------------------------------------------------
+function authenticator_test ()
+	assert2 (false, pcall (lualdap.authenticator))
+	assert2 (false, pcall (lualdap.authenticator, { uri = HOSTNAME, connections = 0 }))
+	local auth = assert (lualdap.authenticator { uri = HOSTNAME, connections = 2 })
+	-- empty passwords are not accepted.
+	assert2 (nil, auth:verify (WHO or "", ""))
+	if WHO and PASSWORD then
+		-- more binds than connections.
+		local f1 = assert (auth:verify (WHO, PASSWORD))
+		local f2 = assert (auth:verify (WHO, PASSWORD.."_"))
+		local f3 = assert (auth:verify (WHO, PASSWORD))
+		assert2 (true, f1 ())
+		assert2 (false, f2 ())
+		assert2 (true, f3 ())
+		-- results are collected once.
+		assert2 (false, pcall (f1))
+		-- results never asked for are dropped.
+		for i = 1, 10 do
+			auth:verify (WHO, PASSWORD)
+		end
+		collectgarbage ()
+		assert2 (true, assert (auth:verify (WHO, PASSWORD)) ())
+	end
+	assert2 (1, auth:close ())
+	assert2 (false, pcall (auth.verify, auth, WHO, PASSWORD))
+end
+
+
+---------------------------------------------------------------------
+-- checking replica sets.
+---------------------------------------------------------------------
+function replicas_test ()
+	local _,_,rdn_name,rdn_value = string.find (BASE, DN_PAT)
+	assert2 (false, pcall (lualdap.open_replicas))
+	assert2 (nil, lualdap.open_replicas { replicas = "unknown-server" })
+	local rs = assert (lualdap.open_replicas {
+		provider = HOSTNAME, replicas = { HOSTNAME, "unknown-server" },
+		who = WHO, password = PASSWORD, retry = 60,
+	})
+	local nodes = rs:nodes ()
+	assert2 (3, table.getn (nodes))
+	assert2 (true, nodes[1].provider)
+	assert2 (false, nodes[2].provider)
+	assert2 (false, nodes[2].ejected)
+	assert2 (true, nodes[3].ejected)
+	-- reads go to the replica in rotation.
+	local f = assert (rs:compare (BASE, rdn_name, rdn_value))
+	assert2 (true, f ())
+	local found = 0
+	for dn in rs:search { base = BASE, scope = "base", } do
+		found = found + 1
+	end
+	assert2 (1, found)
+	assert2 (1, rs:close ())
+	assert2 (nil, rs:close ())
+	assert2 (false, pcall (rs.search, rs, { base = BASE, }))
+	-- replicas without latency samples get reads in turn.
+	rs = assert (lualdap.open_replicas {
+		provider = HOSTNAME, replicas = { HOSTNAME, HOSTNAME },
+		who = WHO, password = PASSWORD,
+	})
+	for i = 1, 2 do
+		assert2 (true, assert (rs:compare (BASE, rdn_name, rdn_value)) ())
+	end
+	nodes = rs:nodes ()
+	assert (nodes[2].latency > 0, "first replica not sampled")
+	assert (nodes[3].latency > 0, "second replica not sampled")
+	assert2 (1, rs:close ())
+end
+
+
 ---------------------------------------------------------------------
 -- checks return value which should be a function AND also its return value.
 ---------------------------------------------------------------------
@@ -136,6 +210,35 @@ function check_future (ret, method, ...)
 end
 
 
+---------------------------------------------------------------------
+-- checking DN utilities.
+---------------------------------------------------------------------
+function dn_test ()
+	local dn = lualdap.dn
+	local rdns = dn.parse ("CN=Smith\\, John+uid=js,dc=example,dc=com")
+	assert2 (3, table.getn (rdns))
+	assert2 ("Smith, John", rdns[1].cn)
+	assert2 ("js", rdns[1].uid)
+	assert2 ("example", rdns[2].dc)
+	assert2 (dn.normalize ("uid=JS+cn=smith\\, john, DC=Example,dc=com"),
+		dn.normalize ("CN=Smith\\, John+uid=js,dc=example,dc=com"))
+	assert2 ("dc=example,dc=com", dn.parent ("cn=a\\,b,dc=example,dc=com"))
+	assert2 ("", dn.parent ("dc=com"))
+	assert2 (nil, dn.parent (""))
+	assert2 (true, dn.is_descendant ("cn=a,dc=example,dc=com", "DC=example,dc=com"))
+	assert2 (false, dn.is_descendant ("cn=a\\,dc=example,dc=com", "dc=example,dc=com"))
+	assert2 (false, dn.is_descendant ("dc=example,dc=com", "dc=example,dc=com"))
+	assert2 (true, dn.is_descendant ("dc=com", ""))
+	assert2 (0, dn.compare ("cn=A,dc=com", "cn=a, dc=com"))
+	assert2 (-1, dn.compare ("dc=com", "cn=a,dc=com"))
+	assert2 (1, dn.compare ("cn=b,dc=com", "cn=a,dc=com"))
+	assert2 (false, pcall (dn.normalize, "invalid"))
+	-- normalized DNs on search.
+	local entry_dn = LD:search { base = BASE, scope = "base", normalizedn = true, }()
+	assert2 (dn.normalize (BASE), entry_dn)
+end
+
+
 ---------------------------------------------------------------------
 -- checking compare operation.
 ---------------------------------------------------------------------
@@ -158,6 +261,85 @@ function compare_test ()
 end
 
 
+---------------------------------------------------------------------
+-- checking shared multiplexer.
+---------------------------------------------------------------------
+function mux_test ()
+	local _,_,rdn_name,rdn_value = string.find (BASE, DN_PAT)
+	assert2 (false, pcall (lualdap.mux))
+	assert2 (false, pcall (lualdap.mux, "test", { uri = HOSTNAME, connections = 0 }))
+	assert2 (false, pcall (lualdap.mux, "test", { uri = HOSTNAME, timeout = -1 }))
+	assert2 (nil, lualdap.mux ("no such multiplexer"))
+	-- a multiplexer which could not be created is not kept.
+	assert2 (nil, lualdap.mux ("broken", { uri = "ldap://127.0.0.1:1" }))
+	assert2 (nil, lualdap.mux ("broken"))
+	local mux = assert (lualdap.mux ("test", {
+		uri = HOSTNAME, who = WHO, password = PASSWORD, connections = 2,
+	}))
+	-- the same multiplexer is found by its name.
+	local other = assert (lualdap.mux ("test"))
+	assert2 (tostring (mux), tostring (other))
+	-- requests are sent before their results are collected.
+	local f1 = mux:compare (BASE, rdn_name, rdn_value)
+	local f2 = mux:compare (BASE, rdn_name, rdn_value.."_")
+	local iter = mux:search { base = BASE, scope = "base", }
+	local f3 = mux:compare ("qwerty", rdn_name, rdn_value)
+	assert2 (true, f1 ())
+	assert2 (false, f2 ())
+	assert2 (nil, f3 ())
+	assert2 (nil, f1 ())
+	local found = 0
+	for dn, entry in iter do
+		found = found + 1
+		assert2 ("string", type (dn))
+		assert2 ("table", type (entry))
+	end
+	assert2 (1, found)
+	-- a failed search returns an error after its entries.
+	local dn, err = mux:search { base = "qwerty", scope = "base", } ()
+	assert2 (nil, dn)
+	assert2 ("string", type (err))
+	assert2 (5, mux:stats ().submitted)
+	assert2 (0, mux:stats ().pending)
+	assert2 (1, other:close ())
+	assert2 (nil, other:close ())
+	assert2 (false, pcall (other.search, other, { base = BASE, }))
+	-- uncollected results are released.
+	mux:compare (BASE, rdn_name, rdn_value)
+	collectgarbage ()
+	assert2 (1, mux:close ())
+end
+
+
+---------------------------------------------------------------------
+-- checking results collected without blocking.
+---------------------------------------------------------------------
+function wait_test ()
+	local _,_,rdn_name,rdn_value = string.find (BASE, DN_PAT)
+	local timeout = "LuaLDAP: result timeout expired"
+	local t0 = lualdap.clock ()
+	lualdap.sleep (0.05)
+	assert (lualdap.clock () - t0 >= 0.04, "sleep returned too early")
+	-- polling a compare until its result arrives.
+	local f = LD:compare (BASE, rdn_name, rdn_value)
+	local ok, err = f (0)
+	while ok == nil and err == timeout do
+		lualdap.sleep (0.01)
+		ok, err = f (0)
+	end
+	assert2 (true, ok)
+	-- waiting a limited time for the entries of a search.
+	local iter = LD:search { base = BASE, scope = "base", }
+	local dn, entry = iter (0)
+	while dn == nil and entry == timeout do
+		dn, entry = iter (10)
+	end
+	assert2 ("string", type (dn))
+	assert2 ("table", type (entry))
+	assert2 (nil, iter (10))
+end
+
+
 ---------------------------------------------------------------------
 -- checking basic search operation.
 ---------------------------------------------------------------------
@@ -239,6 +421,78 @@ function modify_test ()
 	check_future (nil, LD.modify, LD, new_dn)
 	-- trying to create an undefined attribute.
 	check_future (nil, LD.modify, LD, NEW_DN, {'+', unknown_attribute = 'a'})
+	-- updating with invalid tables.
+	assert2 (false, pcall (LD.update, LD, NEW_DN, NEW))
+	assert2 (false, pcall (LD.update, LD, NEW_DN, {}, { a = { {} } }))
+	-- nothing to update: no request is sent, even to an unknown entry.
+	check_future (true, LD.update, LD, new_dn, NEW, clone (NEW))
+	-- trying to update an undefined attribute.
+	check_future (nil, LD.update, LD, NEW_DN, {}, {unknown_attribute = 'a'})
+	-- modifying under a failed assertion.
+	check_future (false, LD.modify, LD, NEW_DN, "(objectClass=noSuchClass)", {'+', description = 'x'})
+	-- incrementing by a non-integer and incrementing a non-integer attribute.
+	assert2 (false, pcall (LD.increment, LD, NEW_DN, rdn_name, 1.5))
+	check_future (nil, LD.increment, LD, NEW_DN, rdn_name, 1)
+	-- incrementing an integer attribute returns its new value.
+	local int_attr, int_value
+	for attr, value in pairs (NEW) do
+		if type (value) == "string" and string.find (value, "^%d+$") then
+			int_attr, int_value = attr, tonumber (value)
+			break
+		end
+	end
+	if int_attr == nil then
+		io.write ("\nWarning!  No integer attribute to increment.")
+	else
+		check_future (int_value + 3, LD.increment, LD, NEW_DN, int_attr, 3)
+		check_future (int_value, LD.increment, LD, NEW_DN, int_attr, -3)
+		-- other modifications still return true.
+		check_future (true, LD.modify, LD, NEW_DN, {'=', [int_attr] = tostring (int_value)})
+	end
+end
+
+
+---------------------------------------------------------------------
+-- checking update of a large multi-valued attribute.
+---------------------------------------------------------------------
+function update_test ()
+	local values = {}
+	for i = 1, 150 do
+		values[i] = "value "..i
+	end
+	-- the modify operation is limited to 100 values per request.
+	check_future (true, LD.modify, LD, NEW_DN, { '=', description = "extra" })
+	for i = 0, 100, 50 do
+		local chunk = {}
+		for j = 1, 50 do
+			chunk[j] = values[i + j]
+		end
+		check_future (true, LD.modify, LD, NEW_DN, { '+', description = chunk })
+	end
+	-- only the changed values are sent: "extra", which is not on the old
+	-- state, would be removed if the whole attribute was replaced.
+	local new = clone (values)
+	new[1] = "value 151"
+	check_future (true, LD.update, LD, NEW_DN, { description = values }, { description = new })
+	local _, entry = LD:search { base = NEW_DN, scope = "base", attrs = { "description" }, }()
+	local found = {}
+	for i = 1, table.getn (entry.description) do
+		found[entry.description[i]] = true
+	end
+	assert2 (151, table.getn (entry.description))
+	assert2 (true, found["extra"])
+	assert2 (true, found["value 151"])
+	assert2 (nil, found["value 1"])
+	-- repeated values are sent once.
+	local more = clone (new)
+	table.insert (more, "value 152")
+	table.insert (more, "value 152")
+	check_future (true, LD.update, LD, NEW_DN, { description = new }, { description = more })
+	_, entry = LD:search { base = NEW_DN, scope = "base", attrs = { "description" }, }()
+	assert2 (152, table.getn (entry.description))
+	-- numbers which are not integers have no LDAP syntax.
+	assert2 (false, pcall (LD.update, LD, NEW_DN, {}, { description = 1.5 }))
+	check_future (true, LD.modify, LD, NEW_DN, { '-', description = true })
 end
 
 
@@ -306,6 +560,253 @@ function search_test_2 ()
 	-- checking collecting search objects.
 	local dn, entry = LD:search { base = BASE, scope = "base" }()
 	collectgarbage()
+	-- checking columnar search.
+	assert2 (false, pcall (LD.search_columns, LD, { base = BASE, }))
+	local cols, n = LD:search_columns {
+		base = BASE,
+		scope = "subtree",
+		attrs = { "objectClass", "unknownAttribute", },
+	}
+	assert2 (count { base = BASE, scope = "subtree", }, n)
+	assert2 (n, table.getn (cols.dn))
+	assert2 ("string", type (cols.dn[1]))
+	assert2 (false, cols.unknownAttribute[1])
+	assert (cols.objectClass[1], "objectClass column missing")
+	-- checking invalid dereference specifications.
+	assert2 (false, pcall (LD.search, LD, { base = BASE, deref = "member" }))
+	assert2 (false, pcall (LD.search, LD, { base = BASE, deref = { member = {{}} } }))
+	-- checking matched values.
+	assert2 (false, pcall (LD.search, LD, { base = BASE, matched_values = "(objectClass" }))
+	local dn, entry = LD:search {
+		base = BASE,
+		scope = "base",
+		attrs = "objectClass",
+		matched_values = "(objectClass=noSuchClass)",
+	} ()
+	assert2 ("string", type (dn))
+	assert2 (nil, entry.objectClass)
+	-- checking invalid referral chasing specification.
+	assert2 (false, pcall (LD.search, LD, { base = BASE, chase_referrals = "yes" }))
+	-- checking referral chasing.
+	local refs = 0
+	for dn, entry in LD:search { base = BASE, scope = "subtree", attrs = "1.1" } do
+		if entry == nil then
+			refs = refs + 1
+		end
+	end
+	if refs == 0 then
+		io.write ("\nWarning!  No continuation reference found to chase.")
+	else
+		local left = 0
+		for dn, entry in LD:search { base = BASE, scope = "subtree", attrs = "1.1", chase_referrals = true } do
+			if entry == nil then
+				left = left + 1
+			end
+		end
+		assert (left < refs, "no continuation reference chased")
+		-- the connection returns references again once the search is over.
+		local again = 0
+		for dn, entry in LD:search { base = BASE, scope = "subtree", attrs = "1.1" } do
+			if entry == nil then
+				again = again + 1
+			end
+		end
+		assert2 (refs, again)
+	end
+	-- checking bounded buffering.
+	local iter, search = LD:search {
+		base = BASE,
+		scope = "subtree",
+		max_buffered_entries = 2,
+	}
+	local total = 0
+	for dn, entry in iter, search do
+		local entries, bytes = search:buffered ()
+		assert (entries <= 1, "too many entries buffered")
+		assert2 ("number", type (bytes))
+		total = total + 1
+	end
+	assert2 (n, total)
+end
+
+
+---------------------------------------------------------------------
+-- checking attributes retrieved by ranges (only on servers which
+-- support them, such as Active Directory).
+---------------------------------------------------------------------
+function range_test ()
+	local dn, entry = LD:search { base = BASE, scope = "subtree",
+		filter = "(member=*)", attrs = { "member" }, sizelimit = 1, }()
+	if type (dn) ~= "string" then
+		io.write ("\nWarning!  No group found to retrieve by ranges.")
+		return
+	end
+	-- ranges of two values are requested until the last one.
+	local _, ranged = LD:search { base = dn, scope = "base",
+		attrs = { "member;range=0-1" }, }()
+	assert2 ("table", type (ranged))
+	if ranged.member == nil then
+		io.write ("\nWarning!  The server does not support ranges.")
+		return
+	end
+	local all = entry.member
+	if type (all) ~= "table" then
+		all = { all }
+	end
+	assert2 (table.getn (all), table.getn (ranged.member))
+	for attr in pairs (ranged) do
+		assert (not string.find (attr, ";range="), "range option left in "..attr)
+	end
+	-- columns get all the values too.
+	local cols, n = LD:search_columns { base = dn, scope = "base",
+		attrs = { "member;range=0-1" }, }
+	assert2 (1, n)
+	local values = cols["member;range=0-1"][1]
+	assert2 ("table", type (values))
+	assert2 (table.getn (all), table.getn (values))
+end
+
+
+---------------------------------------------------------------------
+-- checking schema and typed search.
+---------------------------------------------------------------------
+function schema_test ()
+	local schema = assert (LD:schema ())
+	assert2 ("table", type (schema.rootdse))
+	assert2 ("table", type (schema.attributetypes))
+	-- the schema is cached.
+	assert2 (schema, LD:schema ())
+	local cn = assert (schema.attributetypes.cn, "no cn attribute type")
+	assert2 ("table", type (cn))
+	local oc = assert (schema.attributetypes.objectclass)
+	assert2 (false, oc.single_value)
+	-- multi-valued attributes are always tables.
+	for dn, entry in LD:search { base = BASE, scope = "base", typed = true, } do
+		assert2 ("table", type (entry.objectClass))
+	end
+end
+
+
+---------------------------------------------------------------------
+-- checking tracing.
+---------------------------------------------------------------------
+function trace_test ()
+	local _,_,rdn_name,rdn_value = string.find (BASE, DN_PAT)
+	local ops = {}
+	assert2 (false, pcall (LD.set_trace, LD, "no function"))
+	assert2 (true, LD:set_trace (function (op) table.insert (ops, op) end))
+	check_future (true, LD.compare, LD, BASE, rdn_name, rdn_value)
+	assert2 (1, table.getn (ops))
+	assert2 ("compare", ops[1].op)
+	assert2 (BASE, ops[1].dn)
+	assert2 ("number", type (ops[1].elapsed_ms))
+	for dn, entry in LD:search { base = BASE, scope = "base", } do
+	end
+	assert2 (2, table.getn (ops))
+	assert2 ("search", ops[2].op)
+	assert2 (BASE, ops[2].base)
+	assert2 (1, ops[2].entries)
+	-- a slow consumer does not make the search look slow.
+	local iter = LD:search { base = BASE, scope = "base", }
+	assert2 ("string", type (iter ()))
+	lualdap.sleep (0.5)
+	assert2 (nil, iter ())
+	assert2 (3, table.getn (ops))
+	assert (ops[3].elapsed_ms < 500, "search timed until consumed")
+	-- searches closed before their result is consumed are reported.
+	local iter, search = LD:search { base = BASE, scope = "subtree", }
+	assert2 ("string", type (iter ()))
+	assert2 (1, search:close ())
+	assert2 (4, table.getn (ops))
+	assert2 (1, ops[4].entries)
+	assert (ops[4].rc ~= 0, "cancelled search reported as successful")
+	-- operations faster than the threshold are not reported.
+	LD:set_trace (function (op) table.insert (ops, op) end, { threshold_ms = 1e9 })
+	check_future (true, LD.compare, LD, BASE, rdn_name, rdn_value)
+	assert2 (4, table.getn (ops))
+	-- disable tracing.
+	LD:set_trace (nil)
+	check_future (true, LD.compare, LD, BASE, rdn_name, rdn_value)
+	assert2 (4, table.getn (ops))
+end
+
+
+---------------------------------------------------------------------
+-- checking snapshots.
+---------------------------------------------------------------------
+function snapshot_test ()
+	local _,_,rdn_name,rdn_value = string.find (BASE, DN_PAT)
+	local path = os.tmpname ()
+	assert2 (false, pcall (LD.snapshot, LD, { base = BASE, }))
+	local n = assert (LD:snapshot {
+		base = BASE,
+		scope = "subtree",
+		index = { rdn_name, "objectClass", },
+		path = path,
+	})
+	assert2 (count { base = BASE, scope = "subtree", }, n)
+	local snap = assert (lualdap.open_snapshot (path))
+	assert2 (true, string.find (tostring (snap), "snapshot") ~= nil)
+	-- lookups by DN.
+	local dn, entry = snap:get (BASE)
+	assert2 ("string", type (dn))
+	assert2 ("table", type (entry))
+	assert2 (nil, snap:get ("cn=no such entry,"..BASE))
+	assert2 (false, pcall (snap.get, snap, "not a DN"))
+	-- lookups by indexed values (ignoring case).
+	local found = 0
+	for dn, entry in snap:find (rdn_name, string.upper (rdn_value)) do
+		found = found + 1
+		assert2 ("table", type (entry))
+	end
+	assert (found >= 1, "entry not found by its indexed value")
+	assert2 (nil, snap:find (rdn_name, "no such value") ())
+	assert2 (false, pcall (snap.find, snap, "description", "x"))
+	assert2 (1, snap:close ())
+	assert2 (nil, snap:close ())
+	assert2 (false, pcall (snap.get, snap, BASE))
+	os.remove (path)
+	assert2 (nil, lualdap.open_snapshot (path))
+end
+
+
+---------------------------------------------------------------------
+-- checking the logs read by tools/lualdap-replay.lua (option -p).
+---------------------------------------------------------------------
+function replay_test ()
+	if _VERSION == "Lua 5.0" then
+		io.write ("\nWarning!  lualdap-replay needs Lua 5.1.")
+		return
+	end
+	local dir = string.gsub (arg[0], "[^/\\]*$", "")
+	local tool = assert (loadfile (dir.."../tools/lualdap-replay.lua"))
+	local function describe (file)
+		local out, saved_arg, saved_print = {}, arg, print
+		arg = { "-p", dir.."replay/"..file }
+		print = function (s) table.insert (out, s or "") end
+		local ok, err = pcall (tool)
+		arg, print = saved_arg, saved_print
+		assert (ok, err)
+		return table.concat (out, "\n")
+	end
+	-- slapd log: same-second operations are spread along it, SASL binds
+	-- and operations without a request line are skipped.
+	local out = describe ("access.log")
+	assert (string.find (out, "^6 operations\n"), out)
+	assert (string.find (out, "spanning 4.000 s", 1, true), out)
+	assert (string.find (out, "\nbind +1\n"), out)
+	assert (string.find (out, "\nsearch +1\n"), out)
+	assert (string.find (out, "\nmodify +1\n"), out)
+	assert (string.find (out, "\n4 operations without logged contents"), out)
+	assert (string.find (out, "p50 0.500 s, p90 1.500 s, max 1.500 s", 1, true), out)
+	-- JSON trace: unknown operations and blank lines are skipped.
+	out = describe ("trace.json")
+	assert (string.find (out, "^5 operations\n"), out)
+	assert (string.find (out, "spanning 2.000 s", 1, true), out)
+	assert (string.find (out, "\ncompare +1\n"), out)
+	assert (string.find (out, "\ndelete +1\n"), out)
+	assert (string.find (out, "\n0 operations without logged contents"), out)
+	assert (string.find (out, "p50 0.250 s, p90 1.000 s, max 1.000 s", 1, true), out)
 end
 
 
@@ -341,6 +842,15 @@ function delete_test ()
 	assert2 (false, pcall (LD.delete, CLOSED_LD, NEW_DN))
 	-- trying to delete with an invalid connection.
 	assert2 (false, pcall (LD.delete, io.output(), NEW_DN))
+	-- trying to delete new entry under a failed assertion.
+	check_future (false, LD.delete, LD, NEW_DN, "(objectClass=noSuchClass)")
+	-- trying to delete a second entry under a true assertion.
+	local second = clone (NEW)
+	local _,_, rdn_name, rdn_value, parent_dn = string.find (NEW_DN, DN_PAT)
+	second[rdn_name] = rdn_value.."2"
+	local second_dn = string.format ("%s=%s,%s", rdn_name, second[rdn_name], parent_dn)
+	check_future (true, LD.add, LD, second_dn, second)
+	check_future (true, LD.delete, LD, second_dn, "(objectClass=*)")
 	-- trying to delete new entry.
 	check_future (true, LD.delete, LD, NEW_DN)
 	-- trying to delete an already deleted entry.
@@ -363,11 +873,22 @@ end
 ---------------------------------------------------------------------
 tests = {
 	{ "basic checking", basic_test },
+	{ "checking DN utilities", dn_test },
+	{ "checking authenticator", authenticator_test },
+	{ "checking replica sets", replicas_test },
 	{ "checking compare operation", compare_test },
+	{ "checking shared multiplexer", mux_test },
+	{ "checking results without blocking", wait_test },
 	{ "checking basic search operation", search_test_1 },
 	{ "checking add operation", add_test },
 	{ "checking modify operation", modify_test },
+	{ "checking update of large attributes", update_test },
 	{ "checking advanced search operation", search_test_2 },
+	{ "checking attributes retrieved by ranges", range_test },
+	{ "checking schema", schema_test },
+	{ "checking tracing", trace_test },
+	{ "checking snapshots", snapshot_test },
+	{ "checking replay logs", replay_test },
 	{ "checking rename operation", rename_test },
 	{ "checking delete operation", delete_test },
 	{ "closing everything", close_test },
@@ -0,0 +1,900 @@
+#!/usr/bin/env lua5.1
+---------------------------------------------------------------------
+-- lualdap-replay: replays the operations of an LDAP access log against
+-- a server and reports throughput, error rates and latency percentiles.
+--
+-- The log is either a slapd access log (loglevel stats) or a JSON trace
+-- with one object per line, such as the tables given to the trace
+-- callbacks of LuaLDAP connections.  Searches, compares, binds, adds,
+-- modifications and deletions are rebuilt and replayed with their
+-- original timing (optionally sped up) or at a fixed rate, pipelined
+-- over a number of connections.  slapd does not log values, so the
+-- contents of compares, adds and modifications read from its logs are
+-- made up (see the manual).
+--
+-- See Copyright Notice in license.html
+---------------------------------------------------------------------
+
+require "lualdap"
+
+local unpack = unpack or table.unpack
+
+local USAGE = [[
+Usage: lualdap-replay.lua [options] file
+Options:
+  -H uri       server to replay against (default ldap://127.0.0.1:389)
+  -D dn        DN to bind the connections
+  -w password  password of this DN
+  -c n         number of connections (default 4)
+  -q n         requests in flight per connection (default 8)
+  -x factor    replay the original timing factor times faster (default 1)
+  -r rate      replay at a fixed rate, in operations per second, or
+               as fast as possible with "max"
+  -n n         replay at most n operations
+  -t seconds   give up waiting for a result (default 30)
+  -b password  password of the binds read from slapd logs (they are
+               skipped without it)
+  -v value     value of the rebuilt compares and modifications
+               (default "lualdap-replay")
+  -f format    "slapd" or "json" (default: guessed from the first line)
+  -p           only parse the file and print the operations found
+The file "-" is the standard input.
+]]
+
+-- error returned by results not received within the time given
+local TIMEOUT = "LuaLDAP: result timeout expired"
+
+-- names of the result codes which usually show up on a replay
+local RESULT_NAMES = {
+	[3] = "timeLimitExceeded", [4] = "sizeLimitExceeded",
+	[10] = "referral", [16] = "noSuchAttribute",
+	[17] = "undefinedAttributeType", [20] = "attributeOrValueExists",
+	[21] = "invalidAttributeSyntax", [32] = "noSuchObject",
+	[34] = "invalidDNSyntax", [49] = "invalidCredentials",
+	[50] = "insufficientAccessRights", [51] = "busy",
+	[52] = "unavailable", [53] = "unwillingToPerform",
+	[65] = "objectClassViolation", [68] = "entryAlreadyExists",
+}
+
+local KINDS = { "search", "compare", "bind", "add", "modify", "delete" }
+
+
+---------------------------------------------------------------------
+-- Minimal JSON decoder.
+---------------------------------------------------------------------
+local json_value
+
+local function json_error (i, msg)
+	error (string.format ("invalid JSON at position %d: %s", i, msg), 0)
+end
+
+local function skip (s, i)
+	return string.find (s, "[^ \t\r\n]", i) or (string.len (s) + 1)
+end
+
+local function utf8_char (c)
+	if c < 0x80 then
+		return string.char (c)
+	elseif c < 0x800 then
+		return string.char (0xC0 + math.floor (c / 0x40), 0x80 + c % 0x40)
+	elseif c < 0x10000 then
+		return string.char (0xE0 + math.floor (c / 0x1000),
+			0x80 + math.floor (c / 0x40) % 0x40, 0x80 + c % 0x40)
+	else
+		return string.char (0xF0 + math.floor (c / 0x40000),
+			0x80 + math.floor (c / 0x1000) % 0x40,
+			0x80 + math.floor (c / 0x40) % 0x40, 0x80 + c % 0x40)
+	end
+end
+
+local ESCAPES = { b = "\b", f = "\f", n = "\n", r = "\r", t = "\t" }
+
+local function json_string (s, i)
+	local parts, j = {}, i + 1
+	while true do
+		local k = string.find (s, '["\\]', j)
+		if not k then
+			json_error (i, "unterminated string")
+		end
+		table.insert (parts, string.sub (s, j, k - 1))
+		if string.sub (s, k, k) == '"' then
+			return table.concat (parts), k + 1
+		end
+		local c = string.sub (s, k + 1, k + 1)
+		if c == "u" then
+			local code = tonumber (string.sub (s, k + 2, k + 5), 16)
+			if not code then
+				json_error (k, "invalid escape")
+			end
+			j = k + 6
+			if code >= 0xD800 and code < 0xDC00 and string.sub (s, j, j + 1) == "\\u" then
+				local low = tonumber (string.sub (s, j + 2, j + 5), 16)
+				if low and low >= 0xDC00 and low < 0xE000 then
+					code = 0x10000 + (code - 0xD800) * 0x400 + (low - 0xDC00)
+					j = j + 6
+				end
+			end
+			table.insert (parts, utf8_char (code))
+		else
+			table.insert (parts, ESCAPES[c] or c)
+			j = k + 2
+		end
+	end
+end
+
+function json_value (s, i)
+	i = skip (s, i)
+	local c = string.sub (s, i, i)
+	if c == "{" then
+		local obj = {}
+		i = skip (s, i + 1)
+		if string.sub (s, i, i) == "}" then
+			return obj, i + 1
+		end
+		while true do
+			if string.sub (s, i, i) ~= '"' then
+				json_error (i, "string expected")
+			end
+			local key
+			key, i = json_string (s, i)
+			i = skip (s, i)
+			if string.sub (s, i, i) ~= ":" then
+				json_error (i, "`:' expected")
+			end
+			obj[key], i = json_value (s, i + 1)
+			i = skip (s, i)
+			c = string.sub (s, i, i)
+			if c == "}" then
+				return obj, i + 1
+			elseif c ~= "," then
+				json_error (i, "`,' or `}' expected")
+			end
+			i = skip (s, i + 1)
+		end
+	elseif c == "[" then
+		local arr, n = {}, 0
+		i = skip (s, i + 1)
+		if string.sub (s, i, i) == "]" then
+			return arr, i + 1
+		end
+		while true do
+			n = n + 1
+			arr[n], i = json_value (s, i)
+			i = skip (s, i)
+			c = string.sub (s, i, i)
+			if c == "]" then
+				return arr, i + 1
+			elseif c ~= "," then
+				json_error (i, "`,' or `]' expected")
+			end
+			i = i + 1
+		end
+	elseif c == '"' then
+		return json_string (s, i)
+	elseif string.sub (s, i, i + 3) == "true" then
+		return true, i + 4
+	elseif string.sub (s, i, i + 4) == "false" then
+		return false, i + 5
+	elseif string.sub (s, i, i + 3) == "null" then
+		return nil, i + 4
+	end
+	local num = string.match (s, "^-?%d+%.?%d*[eE]?[-+]?%d*", i)
+	if not num then
+		json_error (i, "unexpected character")
+	end
+	return tonumber (num), i + string.len (num)
+end
+
+local function json_decode (s)
+	local v, i = json_value (s, 1)
+	if skip (s, i) <= string.len (s) then
+		json_error (i, "unexpected character")
+	end
+	return v
+end
+
+
+---------------------------------------------------------------------
+-- Reading slapd access logs.
+---------------------------------------------------------------------
+local MONTHS = { Jan = 1, Feb = 2, Mar = 3, Apr = 4, May = 5, Jun = 6,
+	Jul = 7, Aug = 8, Sep = 9, Oct = 10, Nov = 11, Dec = 12 }
+
+local SCOPES = { ["0"] = "base", ["1"] = "onelevel", ["2"] = "subtree", ["3"] = "subtree" }
+
+-- attributes maintained by the server, which are not replayed
+local OPERATIONAL = { entrycsn = true, modifiersname = true, modifytimestamp = true }
+
+-- Time of a line, in seconds, followed by the rest of the line.  Lines
+-- of syslog have a resolution of one second.
+local function line_time (line)
+	-- OpenLDAP 2.5 and newer: hexadecimal seconds and nanoseconds
+	local sec, nsec, rest = string.match (line, "^(%x+)%.(%x+) %S+ (.*)$")
+	if sec then
+		return tonumber (sec, 16) + math.min (tonumber (nsec, 16) / 1e9, 0.999999), rest
+	end
+	-- RFC 3339 (rsyslog)
+	local y, mo, d, h, mi, s
+	y, mo, d, h, mi, s, rest = string.match (line,
+		"^(%d+)%-(%d+)%-(%d+)T(%d+):(%d+):(%d+%.?%d*)%S* (.*)$")
+	if y then
+		return os.time { year = tonumber (y), month = tonumber (mo), day = tonumber (d),
+			hour = tonumber (h), min = tonumber (mi), sec = 0 } + tonumber (s), rest
+	end
+	-- BSD syslog
+	mo, d, h, mi, s, rest = string.match (line, "^(%a+) +(%d+) (%d+):(%d+):(%d+) (.*)$")
+	if mo and MONTHS[mo] then
+		return os.time { year = 2000, month = MONTHS[mo], day = tonumber (d),
+			hour = tonumber (h), min = tonumber (mi), sec = tonumber (s) }, rest
+	end
+	return nil, line
+end
+
+local function words (s)
+	local list = {}
+	for w in string.gmatch (s, "%S+") do
+		table.insert (list, w)
+	end
+	return list
+end
+
+-- Spread the operations logged on the same second along it.
+local function spread (ops)
+	local i, n = 1, #ops
+	while i <= n do
+		local j = i
+		while j < n and ops[j + 1].time == ops[i].time do
+			j = j + 1
+		end
+		if ops[i].time and ops[i].time == math.floor (ops[i].time) then
+			for k = i, j do
+				ops[k].time = ops[k].time + (k - i) / (j - i + 1)
+			end
+		end
+		i = j + 1
+	end
+end
+
+-- Operations of a slapd log, in the order they were received.
+local function parse_slapd (lines, max)
+	local ops, pending = {}, {}
+	for line in lines do
+		local time, rest = line_time (line)
+		local conn, opn, kind, args = string.match (rest, "conn=(%d+) op=(%d+) (%u+) (.*)$")
+		local key = conn and (conn.." "..opn)
+		local op
+		if kind == "SRCH" then
+			local attrs = string.match (args, "^attr=(.*)$")
+			if attrs then
+				if pending[key] then
+					pending[key].attrs = words (attrs)
+				end
+			else
+				local base, scope, filter = string.match (args,
+					'^base="(.*)" scope=(%d) deref=%d filter="(.*)"$')
+				if base then
+					op = { kind = "search", base = base, scope = SCOPES[scope], filter = filter }
+				end
+			end
+		elseif kind == "CMP" then
+			local dn, attr = string.match (args, '^dn="(.*)" attr="(.*)"$')
+			if dn then
+				op = { kind = "compare", dn = dn, attr = attr }
+			end
+		elseif kind == "BIND" then
+			local dn, method = string.match (args, '^dn="(.*)" method=(%d+)$')
+			if dn and method == "128" then -- simple binds only
+				op = { kind = "bind", dn = dn }
+			end
+		elseif kind == "ADD" then
+			local dn = string.match (args, '^dn="(.*)"$')
+			if dn then
+				op = { kind = "add", dn = dn }
+			end
+		elseif kind == "MOD" then
+			local attrs = string.match (args, "^attr=(.*)$")
+			if attrs then
+				if pending[key] then
+					pending[key].modattrs = words (attrs)
+				end
+			else
+				local dn = string.match (args, '^dn="(.*)"$')
+				if dn then
+					op = { kind = "modify", dn = dn }
+				end
+			end
+		elseif kind == "DEL" then
+			local dn = string.match (args, '^dn="(.*)"$')
+			if dn then
+				op = { kind = "delete", dn = dn }
+			end
+		end
+		if op then
+			if max and #ops >= max then
+				break
+			end
+			op.time = time
+			pending[key] = op
+			table.insert (ops, op)
+		end
+	end
+	spread (ops)
+	return ops
+end
+
+
+---------------------------------------------------------------------
+-- Reading JSON traces.
+---------------------------------------------------------------------
+
+-- Convert modifications written as {"op": "=", "attribute": value...}
+-- to the tables of operations of conn:modify.
+local function json_mods (list)
+	local mods = {}
+	for _, m in ipairs (list or {}) do
+		local t = { m.op }
+		for name, value in pairs (m) do
+			if name ~= "op" then
+				t[name] = value
+			end
+		end
+		table.insert (mods, t)
+	end
+	return mods
+end
+
+local function parse_json (lines, max)
+	local ops = {}
+	local valid = {}
+	for _, kind in ipairs (KINDS) do
+		valid[kind] = true
+	end
+	local n = 0
+	for line in lines do
+		n = n + 1
+		if string.find (line, "%S") then
+			local ok, t = pcall (json_decode, line)
+			if not ok then
+				error (string.format ("line %d: %s", n, t), 0)
+			end
+			if type (t) == "table" and valid[t.op] then
+				if max and #ops >= max then
+					break
+				end
+				local op = {
+					kind = t.op,
+					time = tonumber (t.time or t.start),
+					dn = t.dn,
+					base = t.base,
+					scope = SCOPES[tostring (t.scope)] or t.scope,
+					filter = t.filter,
+					attrs = t.attrs,
+					attrsonly = t.attrsonly,
+					sizelimit = t.sizelimit,
+					attr = t.attr,
+					value = t.value,
+					password = t.password,
+					entry = t.entry,
+				}
+				if t.mods then
+					op.mods = json_mods (t.mods)
+				end
+				table.insert (ops, op)
+			end
+		end
+	end
+	return ops
+end
+
+
+---------------------------------------------------------------------
+-- Rebuilding the contents which are not logged.
+---------------------------------------------------------------------
+
+-- structural object class of entries added, by the attribute of their RDN
+local STRUCTURAL = { cn = "applicationProcess", uid = "account", ou = "organizationalUnit",
+	o = "organization", dc = "domain", l = "locality" }
+
+-- Entry named after its RDN, which accepts any attribute.
+local function made_up_entry (dn)
+	local attr, value = string.match (dn, "^%s*([^=,+]+)=([^,+]*)")
+	attr = string.lower (attr or "cn")
+	value = value or ""
+	local entry = { objectClass = { STRUCTURAL[attr] or "applicationProcess", "extensibleObject" } }
+	entry[attr] = value
+	if not STRUCTURAL[attr] then
+		entry.cn = value
+	end
+	return entry
+end
+
+-- Replacement of the logged attributes by the given value.
+local function made_up_mods (op, value)
+	local mod, empty = { "=" }, true
+	for _, attr in ipairs (op.modattrs or {}) do
+		if not OPERATIONAL[string.lower (attr)] then
+			mod[attr] = value
+			empty = false
+		end
+	end
+	if empty then
+		mod.description = value
+	end
+	return { mod }
+end
+
+
+---------------------------------------------------------------------
+-- Replaying.
+---------------------------------------------------------------------
+
+-- Function to poll a future: it returns nil while the result has not
+-- arrived, then the result code (or an error message) and the latency
+-- measured by the library, when known.
+local function future_waiter (lane, f, err)
+	if not f then
+		return nil, err
+	end
+	return function (timeout)
+		lane.rc, lane.elapsed = nil, nil
+		local ok, msg = f (timeout)
+		if ok == nil and msg == TIMEOUT then
+			return nil
+		end
+		-- the result code is reported to the trace callback
+		return lane.rc or msg or 0, lane.elapsed
+	end
+end
+
+local function bind_waiter (f, err)
+	if not f then
+		return nil, err
+	end
+	return function (timeout)
+		local ok, msg = f (timeout)
+		if ok == nil and msg == TIMEOUT then
+			return nil
+		elseif ok == nil then
+			return msg
+		end
+		return ok and 0 or 49
+	end
+end
+
+local function search_waiter (lane, req, iter)
+	return function (timeout)
+		while true do
+			lane.rc, lane.elapsed = nil, nil
+			local dn, attrs = iter (timeout)
+			if dn ~= nil then
+				req.entries = req.entries + 1
+				timeout = 0
+			elseif attrs == TIMEOUT then
+				return nil
+			elseif attrs ~= nil then
+				return attrs
+			else
+				-- the library times the search until its result arrived,
+				-- not until its entries were decoded here
+				return lane.rc or 0, lane.elapsed
+			end
+		end
+	end
+end
+
+-- Send an operation on a lane.
+-- @return Function to poll its result or nil followed by an error message.
+local function send (lane, req, opts)
+	local op = req.op
+	local ld = lane.ld
+	if op.kind == "search" then
+		local iter, search = ld:search {
+			base = op.base, scope = op.scope, filter = op.filter, attrs = op.attrs,
+			attrsonly = op.attrsonly, sizelimit = op.sizelimit,
+		}
+		req.search = search
+		return search_waiter (lane, req, iter)
+	elseif op.kind == "compare" then
+		return future_waiter (lane, ld:compare (op.dn, op.attr, op.value or opts.value))
+	elseif op.kind == "add" then
+		return future_waiter (lane, ld:add (op.dn, op.entry or made_up_entry (op.dn)))
+	elseif op.kind == "modify" then
+		return future_waiter (lane, ld:modify (op.dn, unpack (op.mods or made_up_mods (op, opts.value))))
+	elseif op.kind == "delete" then
+		return future_waiter (lane, ld:delete (op.dn))
+	else
+		return bind_waiter (lane.auth:verify (op.dn, op.password or opts.bind_password))
+	end
+end
+
+local function new_stats ()
+	local stats = { kinds = {}, errors = {}, skipped = 0, lag = 0, completed = 0 }
+	for _, kind in ipairs (KINDS) do
+		stats.kinds[kind] = { n = 0, errors = 0, entries = 0, samples = {} }
+	end
+	return stats
+end
+
+local function record (stats, req, result, latency)
+	local kind = req.op.kind
+	local k = stats.kinds[kind]
+	k.n = k.n + 1
+	k.samples[k.n] = latency
+	k.entries = k.entries + (req.entries or 0)
+	stats.completed = stats.completed + 1
+	if result ~= 0 and not (kind == "compare" and (result == 5 or result == 6)) then
+		local key
+		if type (result) == "number" then
+			key = string.format ("%s (%d)", RESULT_NAMES[result] or "result code", result)
+		else
+			key = tostring (result)
+		end
+		key = kind..": "..key
+		k.errors = k.errors + 1
+		stats.errors[key] = (stats.errors[key] or 0) + 1
+	end
+end
+
+local function open_lanes (opts, binds)
+	local lanes = {}
+	for i = 1, opts.connections do
+		local ld, err = lualdap.open_simple (opts.uri, opts.who, opts.password)
+		if not ld then
+			error (string.format ("couldn't connect to %s: %s", opts.uri, tostring (err)), 0)
+		end
+		local lane = { ld = ld, reqs = {}, depth = opts.depth }
+		ld:set_trace (function (t)
+			lane.rc = t.rc
+			lane.elapsed = t.elapsed_ms / 1000
+		end)
+		table.insert (lanes, lane)
+	end
+	local auth
+	if binds then
+		local err
+		auth, err = lualdap.authenticator { uri = opts.uri, connections = opts.connections }
+		if not auth then
+			error (string.format ("couldn't connect to %s: %s", opts.uri, tostring (err)), 0)
+		end
+	end
+	-- binds go to an authenticator, which waits when all its connections are busy
+	return lanes, auth and { auth = auth, reqs = {}, depth = opts.connections }
+end
+
+-- Lane of an operation: the least loaded one (nil if all of them are full).
+local function pick (lanes, binder, op)
+	if op.kind == "bind" then
+		return (#binder.reqs < binder.depth) and binder or nil
+	end
+	local best
+	for _, lane in ipairs (lanes) do
+		if not best or #lane.reqs < #best.reqs then
+			best = lane
+		end
+	end
+	return (#best.reqs < best.depth) and best or nil
+end
+
+-- Poll a request of a lane without waiting, removing it when its result
+-- arrived or when it is given up.  The latency is the one measured by the
+-- library or else the time the result was seen.
+-- @return true if it was finished.
+local function poll (lane, k, stats, opts)
+	local req = lane.reqs[k]
+	local ok, result, elapsed = pcall (req.wait, 0)
+	local now = lualdap.clock ()
+	if not ok then -- raised by the library (for instance, on a closed connection)
+		result, elapsed = tostring (result), nil
+	end
+	if result == nil then
+		if now - req.sent < opts.timeout then
+			return false
+		end
+		result = "timeout"
+		if req.search then
+			req.search:close ()
+		end
+	end
+	record (stats, req, result, elapsed or (now - req.sent))
+	table.remove (lane.reqs, k)
+	return true
+end
+
+-- Poll all the requests in flight without waiting, so that no result
+-- waits to be seen while another one is waited for.
+-- @return Number of requests finished.
+local function collect (lanes, stats, opts)
+	local finished = 0
+	for _, lane in ipairs (lanes) do
+		for k = #lane.reqs, 1, -1 do
+			if poll (lane, k, stats, opts) then
+				finished = finished + 1
+			end
+		end
+	end
+	return finished
+end
+
+local function replay (ops, opts)
+	local binds = false
+	for _, op in ipairs (ops) do
+		binds = binds or (op.kind == "bind" and (op.password or opts.bind_password) ~= nil)
+	end
+	local lanes, binder = open_lanes (opts, binds)
+	local all = {}
+	for _, lane in ipairs (lanes) do
+		table.insert (all, lane)
+	end
+	table.insert (all, binder)
+
+	local stats = new_stats ()
+	local clock = lualdap.clock
+	local n = #ops
+	local first = (ops[1] and ops[1].time) or 0
+	local t0 = clock ()
+	local function due (i)
+		if opts.rate then
+			return t0 + (i - 1) / opts.rate
+		end
+		return t0 + ((ops[i].time or first) - first) / opts.speed
+	end
+
+	local i, inflight = 1, 0
+	while i <= n or inflight > 0 do
+		local now = clock ()
+		local full = false
+		-- send the operations which are due
+		while i <= n and due (i) <= now do
+			local op = ops[i]
+			if op.kind == "bind" and not (op.password or opts.bind_password) then
+				stats.skipped = stats.skipped + 1
+			else
+				local lane = pick (lanes, binder, op)
+				if not lane then
+					full = true
+					break -- wait for a result
+				end
+				if now - due (i) > stats.lag then
+					stats.lag = now - due (i)
+				end
+				local req = { op = op, sent = clock (), entries = 0 }
+				local ok, wait, err = pcall (send, lane, req, opts)
+				if ok and wait then
+					req.wait = wait
+					table.insert (lane.reqs, req)
+					inflight = inflight + 1
+				else
+					record (stats, req, tostring (ok and err or wait), clock () - req.sent)
+				end
+			end
+			i = i + 1
+		end
+		-- collect the results which arrived
+		local finished = collect (all, stats, opts)
+		inflight = inflight - finished
+		if finished == 0 then
+			-- wait a tick for the results or until the next operation
+			if inflight > 0 then
+				local wait = opts.tick
+				if i <= n and not full then
+					wait = math.min (wait, due (i) - clock ())
+				end
+				if wait > 0 then
+					lualdap.sleep (wait)
+				end
+			elseif i <= n then
+				lualdap.sleep (due (i) - clock ())
+			end
+		end
+	end
+	stats.elapsed = clock () - t0
+
+	for _, lane in ipairs (lanes) do
+		lane.ld:close ()
+	end
+	if binder then
+		binder.auth:close ()
+	end
+	return stats
+end
+
+
+---------------------------------------------------------------------
+-- Reporting.
+---------------------------------------------------------------------
+local function percentile (sorted, q)
+	local n = #sorted
+	if n == 0 then
+		return 0
+	end
+	return sorted[math.max (1, math.ceil (q * n))]
+end
+
+local function report (stats)
+	local elapsed = math.max (stats.elapsed, 1e-9)
+	print (string.format ("replayed %d operations in %.2f s: %.1f operations/s",
+		stats.completed, stats.elapsed, stats.completed / elapsed))
+	print (string.format ("skipped %d binds without password; largest delay on schedule %.3f s",
+		stats.skipped, stats.lag))
+	print ()
+	print (string.format ("%-8s %8s %8s %7s %8s %9s %9s %9s %9s %9s", "op", "count", "op/s",
+		"errors", "entries", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms"))
+	for _, kind in ipairs (KINDS) do
+		local k = stats.kinds[kind]
+		if k.n > 0 then
+			table.sort (k.samples)
+			print (string.format ("%-8s %8d %8.1f %6.2f%% %8d %9.2f %9.2f %9.2f %9.2f %9.2f",
+				kind, k.n, k.n / elapsed, 100 * k.errors / k.n, k.entries,
+				1000 * percentile (k.samples, 0.5), 1000 * percentile (k.samples, 0.9),
+				1000 * percentile (k.samples, 0.99), 1000 * percentile (k.samples, 0.999),
+				1000 * k.samples[k.n]))
+		end
+	end
+	local errors = {}
+	for key, count in pairs (stats.errors) do
+		table.insert (errors, { key = key, count = count })
+	end
+	if #errors > 0 then
+		table.sort (errors, function (a, b) return a.count > b.count end)
+		print ()
+		print ("errors:")
+		for _, e in ipairs (errors) do
+			print (string.format ("%8d  %s", e.count, e.key))
+		end
+	end
+end
+
+-- Summary of the operations read (option -p).
+local function describe (ops)
+	local counts, made_up = {}, 0
+	for _, op in ipairs (ops) do
+		counts[op.kind] = (counts[op.kind] or 0) + 1
+		if (op.kind == "compare" and not op.value) or (op.kind == "add" and not op.entry)
+			or (op.kind == "modify" and not op.mods) or (op.kind == "bind" and not op.password) then
+			made_up = made_up + 1
+		end
+	end
+	local n = #ops
+	print (string.format ("%d operations", n))
+	if n > 0 and ops[1].time and ops[n].time then
+		print (string.format ("spanning %.3f s", ops[n].time - ops[1].time))
+	end
+	for _, kind in ipairs (KINDS) do
+		if counts[kind] then
+			print (string.format ("%-8s %8d", kind, counts[kind]))
+		end
+	end
+	print (string.format ("%d operations without logged contents (values, entries or passwords)", made_up))
+	-- times between operations, as replayed without -x or -r
+	local gaps = {}
+	for k = 2, n do
+		if ops[k].time and ops[k - 1].time then
+			table.insert (gaps, ops[k].time - ops[k - 1].time)
+		end
+	end
+	if #gaps > 0 then
+		table.sort (gaps)
+		print (string.format ("gaps between operations: p50 %.3f s, p90 %.3f s, max %.3f s",
+			percentile (gaps, 0.5), percentile (gaps, 0.9), gaps[#gaps]))
+	end
+end
+
+
+---------------------------------------------------------------------
+-- Main
+---------------------------------------------------------------------
+local function usage (msg)
+	if msg then
+		io.stderr:write ("lualdap-replay: ", msg, "\n")
+	end
+	io.stderr:write (USAGE)
+	os.exit (1)
+end
+
+local function number_arg (v, name)
+	local n = tonumber (v)
+	if not n or n <= 0 then
+		usage ("invalid value of "..name)
+	end
+	return n
+end
+
+local function parse_args (args)
+	local opts = {
+		uri = "ldap://127.0.0.1:389",
+		connections = 4,
+		depth = 8,
+		speed = 1,
+		timeout = 30,
+		tick = 0.001,
+		value = "lualdap-replay",
+	}
+	local i = 1
+	while args[i] do
+		local a = args[i]
+		local v = args[i + 1]
+		if a == "-p" then
+			opts.parse_only = true
+			i = i + 1
+		elseif string.sub (a, 1, 1) == "-" and a ~= "-" then
+			if not v then
+				usage ("missing value of "..a)
+			end
+			if a == "-H" then opts.uri = v
+			elseif a == "-D" then opts.who = v
+			elseif a == "-w" then opts.password = v
+			elseif a == "-c" then opts.connections = math.floor (number_arg (v, a))
+			elseif a == "-q" then opts.depth = math.floor (number_arg (v, a))
+			elseif a == "-x" then opts.speed = number_arg (v, a)
+			elseif a == "-r" then opts.rate = (v == "max") and math.huge or number_arg (v, a)
+			elseif a == "-n" then opts.max = math.floor (number_arg (v, a))
+			elseif a == "-t" then opts.timeout = number_arg (v, a)
+			elseif a == "-b" then opts.bind_password = v
+			elseif a == "-v" then opts.value = v
+			elseif a == "-f" then
+				if v ~= "slapd" and v ~= "json" then
+					usage ("unknown format "..v)
+				end
+				opts.format = v
+			else
+				usage ("unknown option "..a)
+			end
+			i = i + 2
+		else
+			if opts.file then
+				usage ("more than one file given")
+			end
+			opts.file = a
+			i = i + 1
+		end
+	end
+	if not opts.file then
+		usage ()
+	end
+	return opts
+end
+
+-- First line of the file and an iterator over all of its lines.
+local function open_lines (path)
+	local f = io.stdin
+	if path ~= "-" then
+		local err
+		f, err = io.open (path, "r")
+		if not f then
+			error (err, 0)
+		end
+	end
+	local first = f:read ("*l")
+	local pending = first
+	return first, function ()
+		if pending then
+			local line = pending
+			pending = nil
+			return line
+		end
+		return f:read ("*l")
+	end
+end
+
+local function main (args)
+	local opts = parse_args (args)
+	local first, lines = open_lines (opts.file)
+	local format = opts.format or ((first and string.find (first, "^%s*{")) and "json" or "slapd")
+	local ops
+	if format == "json" then
+		ops = parse_json (lines, opts.max)
+	else
+		ops = parse_slapd (lines, opts.max)
+	end
+	if opts.parse_only then
+		describe (ops)
+	else
+		report (replay (ops, opts))
+	end
+end
+
+local ok, err = pcall (main, arg or {})
+if not ok then
+	io.stderr:write ("lualdap-replay: ", tostring (err), "\n")
+	os.exit (1)
+end
@@ -0,0 +1,96 @@
+#!/bin/sh
+# Throwaway slapd for lualdap-replay: runs a local server, listening only
+# on the loopback interface, from a scratch directory which holds its
+# configuration and database, so no system configuration is touched.
+#
+# Usage: replay-slapd.sh start dir [ldif]
+#        replay-slapd.sh stop dir
+#
+# The database is loaded from the LDIF file or, without it, gets only the
+# entry of the suffix (which must then be made of dc components).  The
+# root DN is cn=admin,<suffix> with password "secret".
+#
+# Environment:
+#   SLAPD, SLAPADD  programs (default slapd and slapadd from the PATH)
+#   SCHEMA_DIR      directory of the schema files (default /etc/ldap/schema)
+#   MODULE_DIR      directory of back_mdb, when backends are modules
+#   PORT            port to listen on (default 3890)
+#   SUFFIX          suffix of the database (default dc=example,dc=com)
+
+SLAPD=${SLAPD:-slapd}
+SLAPADD=${SLAPADD:-slapadd}
+SCHEMA_DIR=${SCHEMA_DIR:-/etc/ldap/schema}
+PORT=${PORT:-3890}
+SUFFIX=${SUFFIX:-dc=example,dc=com}
+
+usage () {
+	echo "Usage: $0 start dir [ldif] | stop dir" >&2
+	exit 1
+}
+
+fail () {
+	echo "$0: $*" >&2
+	exit 1
+}
+
+[ $# -ge 2 ] || usage
+dir=$2
+
+case "$1" in
+start)
+	[ ! -f "$dir/slapd.pid" ] || fail "a server is already running on $dir"
+	mkdir -p "$dir/db" || exit 1
+	dir=$(cd "$dir" && pwd)
+	touch "$dir/.replay-slapd"
+	{
+		for schema in core cosine inetorgperson nis; do
+			echo "include $SCHEMA_DIR/$schema.schema"
+		done
+		echo "pidfile $dir/slapd.pid"
+		echo "argsfile $dir/slapd.args"
+		if [ -n "$MODULE_DIR" ]; then
+			echo "modulepath $MODULE_DIR"
+			echo "moduleload back_mdb"
+		fi
+		echo "database mdb"
+		echo "maxsize 1073741824"
+		echo "suffix \"$SUFFIX\""
+		echo "rootdn \"cn=admin,$SUFFIX\""
+		echo "rootpw secret"
+		echo "directory $dir/db"
+		echo "index objectClass eq"
+	} > "$dir/slapd.conf"
+	if [ -n "$3" ]; then
+		ldif=$3
+	else
+		dc=$(expr "$SUFFIX" : 'dc=\([^,]*\)') || fail "no LDIF given for suffix $SUFFIX"
+		ldif=$dir/base.ldif
+		printf 'dn: %s\nobjectClass: dcObject\nobjectClass: organization\ndc: %s\no: %s\n' \
+			"$SUFFIX" "$dc" "$dc" > "$ldif"
+	fi
+	"$SLAPADD" -f "$dir/slapd.conf" -l "$ldif" || fail "could not load $ldif"
+	"$SLAPD" -f "$dir/slapd.conf" -h "ldap://127.0.0.1:$PORT/" || fail "could not start $SLAPD"
+	i=0
+	while [ ! -f "$dir/slapd.pid" ]; do
+		i=$((i + 1))
+		[ $i -le 50 ] || fail "$SLAPD did not start"
+		sleep 0.1
+	done
+	echo "ldap://127.0.0.1:$PORT/ cn=admin,$SUFFIX secret"
+	;;
+stop)
+	[ -f "$dir/.replay-slapd" ] || fail "$dir was not created by $0"
+	if [ -f "$dir/slapd.pid" ]; then
+		kill "$(cat "$dir/slapd.pid")"
+		i=0
+		while [ -f "$dir/slapd.pid" ] && [ $i -le 50 ]; do
+			i=$((i + 1))
+			sleep 0.1
+		done
+	fi
+	rm -rf "$dir"
+	;;
+*)
+	usage
+	;;
+esac